@@ -43,13 +43,21 @@
 #ifndef T_PGE_DEF
 #define T_PGE_DEF
 
+// There is no window or GPU to present to outside of Windows, so only the
+// headless backend is available there
+#if !defined(_WIN32) && !defined(T_PGE_HEADLESS)
+#define T_PGE_HEADLESS
+#endif
+
 #ifdef _WIN32
 // Link to libraries
 #ifdef _MSC_VER
 #pragma comment(lib, "gdiplus.lib")
 #pragma comment(lib, "Shlwapi.lib")
+#ifndef T_PGE_HEADLESS
 #pragma comment(lib, "d3d11.lib")
 #pragma comment(lib, "D3DCompiler.lib")
+#endif
 
 #else
 #error unsupported compiler
@@ -59,14 +67,14 @@
 #include <gdiplus.h>
 #include <Shlwapi.h>
 
+#ifndef T_PGE_HEADLESS
 // DirectX related headers
 #include <wrl/client.h>
 #include <d3d11_1.h>
 #include <d3dcompiler.h>
 #include <DirectXMath.h>
+#endif
 
-#else
-#error unsupported os
 #endif
 
 // Standard includes
@@ -80,8 +88,16 @@
 #include <vector>
 #include <fstream>
 #include <map>
+#include <unordered_map>
 #include <functional>
 #include <algorithm>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #if __cplusplus >= 201703L
   // C++17 onwards
@@ -93,6 +109,16 @@ namespace _gfs = std::filesystem;
 namespace _gfs = std::experimental::filesystem::v1;
 #endif
 
+// SIMD paths of the software rasteriser, SSE2 is the x86/x64 baseline
+#if !defined(T_PGE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define T_PGE_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define T_PGE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 #undef min
 #undef max
 #define UNUSED(x) (void)(x)
@@ -220,47 +246,320 @@ namespace tDX // tucna - DirectX
 
   //=============================================================
 
+  // Cache line aligned storage for sprite pixels and depth. Released blocks are
+  // kept by size, up to nMaxKeptBytes in total, and handed out again, so render
+  // targets created, dropped or resized every frame do not go to the heap.
+  class SurfacePool
+  {
+  public:
+    static constexpr size_t nAlignment = 64;
+    static constexpr size_t nMaxKeptBytes = 64 << 20;
+
+    static void* Allocate(size_t nBytes);
+    static void Free(void* p, size_t nBytes);
+    // Returns the kept blocks to the heap
+    static void Trim();
+    static size_t KeptBytes();
+    // Blocks taken from the heap so far, the pool is reused when this stays put
+    static uint64_t HeapAllocations();
+
+  private:
+    struct State
+    {
+      std::mutex mtx;
+      std::unordered_map<size_t, std::vector<void*>> mapFree;
+      size_t nKept = 0;
+      uint64_t nHeapAllocations = 0;
+    };
+
+    static State& Get();
+    // std::align_val_t needs C++17, the engine builds as C++14
+    static void* AlignedNew(size_t nBytes);
+    static void AlignedDelete(void* p);
+  };
+
+  //=============================================================
+
   // A bitmap-like structure that stores a 2D array of Pixels
   class Sprite
   {
   public:
     Sprite();
     Sprite(std::string sImageFile, tDX::ResourcePack *pack = nullptr);
+    // Pixels are set to Pixel() on first access, see DiscardContents
     Sprite(int32_t w, int32_t h);
+    // Copies pixels and depth, moves hand the storage over
+    Sprite(const Sprite& sprite);
+    Sprite(Sprite&& sprite) noexcept;
+    Sprite& operator=(const Sprite& sprite);
+    Sprite& operator=(Sprite&& sprite) noexcept;
     ~Sprite();
 
   public:
+    // PNG and QOI images are decoded on every platform, other formats need GDI+
     tDX::rcode LoadFromFile(std::string sImageFile, tDX::ResourcePack *pack = nullptr);
+    // Decodes an image file held in memory, rows go straight into the sprite
+    tDX::rcode LoadFromMemory(const uint8_t* pData, size_t nSize);
     tDX::rcode LoadFromPGESprFile(std::string sImageFile, tDX::ResourcePack *pack = nullptr);
     tDX::rcode SaveToPGESprFile(std::string sImageFile);
+    // Loads file i into sprite i, decoding several files at once on nThreads
+    // threads (0 = every hardware thread). Returns the result of every file.
+    static std::vector<tDX::rcode> LoadFromFiles(const std::vector<std::string>& vFiles, std::vector<Sprite>& vSprites,
+      uint32_t nThreads = 0, tDX::ResourcePack *pack = nullptr);
 
   public:
     int32_t width = 0; // int32 here, really?
     int32_t height = 0;
     enum Mode { NORMAL, PERIODIC };
+    // How the pixels are stored. TILED keeps 8x8 blocks together, each in Z order,
+    // so sampling rotated or scaled touches fewer cache lines than going across rows.
+    enum Layout { ROW_MAJOR, TILED };
 
   public:
     void SetSampleMode(tDX::Sprite::Mode mode = tDX::Sprite::Mode::NORMAL);
+    tDX::Sprite::Mode GetSampleMode() const;
+    // Reorders the pixels. Draw targets have to be ROW_MAJOR, SetDrawTarget
+    // converts them back. Depth is always stored by rows.
+    void SetLayout(tDX::Sprite::Layout layout);
+    tDX::Sprite::Layout GetLayout() const;
+    // Position of pixel (x, y) in GetData for the current layout
+    size_t Offset(int32_t x, int32_t y) const;
+    // Copies count pixels of row y from column x on, all inside the sprite
+    void CopyRow(int32_t x, int32_t y, int32_t count, Pixel* dst);
     Pixel GetPixel(int32_t x, int32_t y);
     bool  SetPixel(int32_t x, int32_t y, Pixel p);
 
     Pixel Sample(float x, float y);
     Pixel SampleBL(float u, float v);
+    enum Filter { NEAREST, BILINEAR, TRILINEAR };
+    // Builds the chain of half sized, box filtered copies SampleBatch minifies
+    // from. Has to be called again after the pixels change.
+    void GenerateMipmaps();
+    // 1 without mipmaps
+    int32_t GetMipLevels() const;
+    // Samples count coordinates in 0..1 at once. Unlike Sample and SampleBL,
+    // NORMAL mode clamps to the edge pixels and alpha is filtered too, PERIODIC
+    // wraps. lod is log2 of the sprite pixels per drawn pixel and picks the mip
+    // level, TRILINEAR blends the two nearest ones.
+    void SampleBatch(const float* u, const float* v, int32_t count, Pixel* out, Filter filter = Filter::BILINEAR, float lod = 0.0f);
     Pixel* GetData();
+    // Allocates (or frees) a float per pixel for depth tested drawing, cleared to 1.0f
+    void EnableDepth(bool bEnable = true);
+    // Returns nullptr if the sprite has no depth buffer
+    float* GetDepthData();
+    // Changed pixels are tracked as a span of columns per row, sprites start out
+    // fully dirty. Drawing through PixelGameEngine marks them, writes through
+    // SetPixel or GetData have to call MarkDirty themselves.
+    void MarkDirty(int32_t x, int32_t y, int32_t w, int32_t h);
+    // Columns x0 to x1 (exclusive) of row y changed, x0 >= x1 if none did
+    void GetDirtySpan(int32_t y, int32_t& x0, int32_t& x1) const;
+    void ResetDirty();
+    // Multiplies the colour of every pixel by its alpha. In ALPHA mode the sprite
+    // is then drawn as premultiplied, which saves a multiply per channel and lets
+    // pixels with zero alpha add light. Loading an image undoes the flag.
+    void PremultiplyAlpha();
+    bool IsPremultiplied() const;
+    // New size with every pixel Pixel() again, and depth 1.0f if enabled.
+    // Storage of the same size is reused, other sizes come from SurfacePool.
+    void Resize(int32_t w, int32_t h);
+    // Skips setting the pixels of a new or resized sprite, for callers that are
+    // about to overwrite all of them. Their values are undefined until then.
+    void DiscardContents();
 
   private:
+    static bool ReadImageFile(const std::string& sImageFile, tDX::ResourcePack *pack, std::vector<char>& vData);
+    tDX::rcode DecodePNG(const uint8_t* pData, size_t nSize);
+    tDX::rcode DecodeQOI(const uint8_t* pData, size_t nSize);
+    void Release();
+    void ResolvePendingFill();
+    // Pixels allocated for the layout, TILED rounds the size up to whole tiles
+    size_t StoragePixels(Layout layout) const;
+    static size_t TiledOffset(int32_t x, int32_t y, int32_t width);
+
+    // Level 0 is the sprite itself in its layout, the others are stored by rows
+    struct Texels { const Pixel* pData; int32_t width, height; bool bTiled; };
+    Texels GetMipLevel(int32_t level);
+    void SampleLevel(const Texels& texels, const float* u, const float* v, int32_t count, Pixel* out, bool bBilinear) const;
+    static void LerpPixels(Pixel* a, const Pixel* b, int32_t count, uint32_t weight);
+    void ReleaseMipmaps();
+    size_t MipPixels() const;
+
     Pixel *pColData = nullptr;
+    float *pDepthData = nullptr;
     Mode modeSample = Mode::NORMAL;
+    Layout layoutData = Layout::ROW_MAJOR;
+    bool bPremultiplied = false;
+    bool bFillPending = false;
+    // Levels 1 and up, all in one block
+    struct MipLevel { int32_t width, height; size_t nOffset; };
+    std::vector<MipLevel> vMips;
+    Pixel *pMipData = nullptr;
+    // Empty until the first ResetDirty, meaning everything is dirty
+    struct DirtySpan { int32_t x0, x1; };
+    std::vector<DirtySpan> vDirtyRows;
 
 #ifdef T_DBG_OVERDRAW
   public:
-    static int nOverdrawCount;
+    static std::atomic<int> nOverdrawCount;
 #endif
 
   };
 
   //=============================================================
 
+  // Rolling window of timings (in microseconds) recorded for one named
+  // part of the frame, reported as min/p50/p99/max
+  class ProfileZone
+  {
+  public:
+    ProfileZone(const std::string& sZoneName, const bool* pEnabled);
+
+  public:
+    void AddSample(float fMicroseconds);
+    // Returns the p-th percentile (0..100) over the current window
+    float Percentile(float p) const;
+    float Min() const;
+    float Max() const;
+    uint32_t Samples() const;
+
+  public:
+    std::string sName;
+    const bool* bEnabled;
+    static constexpr uint32_t nWindowSize = 1024;
+
+  private:
+    std::vector<float> vSamples;
+    uint32_t nNext = 0;
+  };
+
+  // Times the enclosing scope into a zone, does nothing if profiling is off
+  class ProfileScope
+  {
+  public:
+    ProfileScope(ProfileZone* zone);
+    ~ProfileScope();
+
+  private:
+    ProfileZone* pZone = nullptr;
+    std::chrono::steady_clock::time_point tStart;
+  };
+
+  class Profiler
+  {
+  public:
+    // Zones live as long as the profiler, the returned pointer stays valid
+    ProfileZone* Zone(const std::string& sName);
+    void Enable(bool bEnable);
+    bool Enabled() const;
+    void Report(std::ostream& os) const;
+    bool SaveCSV(const std::string& sFile) const;
+
+  private:
+    bool bEnabled = false;
+    std::vector<std::unique_ptr<ProfileZone>> vZones;
+  };
+
+  //=============================================================
+
+  // Fixed set of worker threads for parallel loops, the calling thread works too
+  class ThreadPool
+  {
+  public:
+    // nThreads includes the calling thread, 0 uses every hardware thread
+    ThreadPool(uint32_t nThreads = 0);
+    ~ThreadPool();
+
+  public:
+    uint32_t Threads() const;
+    // Calls task(i) for every i below nTasks and returns when all calls have finished
+    void ParallelFor(uint32_t nTasks, const std::function<void(uint32_t)>& task);
+
+  private:
+    void Worker();
+    void RunTasks();
+
+    std::vector<std::thread> vWorkers;
+    std::mutex mtxState;
+    std::condition_variable cvWork;
+    std::condition_variable cvDone;
+    const std::function<void(uint32_t)>* pTask = nullptr;
+    uint32_t nTasks = 0;
+    std::atomic<uint32_t> nNextTask{ 0 };
+    uint32_t nBusyWorkers = 0;
+    uint64_t nGeneration = 0;
+    bool bStop = false;
+  };
+
+  //=============================================================
+
+  // Custom blending of count pixels of row y starting at column x. src holds the
+  // drawn colours, dst the pixels of the draw target, which the shader overwrites.
+  // Between BeginTiles and EndTiles it is called from several threads at once,
+  // for different tiles, so it must not change state shared between calls
+  // without synchronising.
+  typedef std::function<void(int32_t x, int32_t y, int32_t count, const Pixel* src, Pixel* dst)> SpanShader;
+
+  //=============================================================
+
+  // Corner of a textured triangle on the screen. w is 1/w of the clip space
+  // vertex, as the perspective divide leaves it, (u,v) the texture coordinate
+  // in 0..1.
+  struct TexturedVertex
+  {
+    float x, y, z, w;
+    float u, v;
+  };
+
+  // Texture of a triangle and the coordinates and 1/w of its corners. Recorded
+  // and binned triangles read the sprite when they are drawn.
+  struct TriangleTexture
+  {
+    Sprite* sprite;
+    Sprite::Filter filter;
+    float u[3], v[3], w[3];
+  };
+
+  //=============================================================
+
+  // A deferred drawing call or state change, kept by command lists and screen tiles
+  struct DrawCommand
+  {
+    enum Type : uint8_t { SPAN, LINE, TRIANGLE, CLEAR, CLEAR_DEPTH, PIXEL, TARGET, PIXEL_MODE, SPRITE } type;
+    bool bSmooth;
+    int32_t x1, y1, x2, y2;
+    // Source corner of SPRITE, which keeps its scale in pattern
+    int32_t ox, oy;
+    uint32_t pattern;
+    float vx[3], vy[3], vz[3];
+    Pixel col[3];
+    // New draw target of TARGET, the drawn sprite of SPRITE. TRIANGLE is textured
+    // by it if it is set, pattern is the index of its TriangleTexture kept next
+    // to the commands, so that untextured commands stay small. A recorded SPRITE
+    // has none, it draws the copy of the area kept by the list at index ox.
+    Sprite* target;
+  };
+
+  // Drawing calls recorded by PixelGameEngine::BeginRecording, replayed in order
+  // with Replay. Clearing keeps the memory, so recording again does not allocate.
+  class CommandList
+  {
+    friend class PixelGameEngine;
+  public:
+    void Clear();
+    bool Empty() const;
+    size_t Size() const;
+
+  private:
+    std::vector<DrawCommand> vCommands;
+    std::vector<SpanShader> vPixelModes;
+    std::vector<TriangleTexture> vTextures;
+    // Areas drawn by DrawSprite and DrawPartialSprite as they were when recorded.
+    // Replay only reads them, mutable as drawing takes a Sprite*.
+    mutable std::vector<Sprite> vSprites;
+  };
+
+  //=============================================================
+
   enum Key
   {
     NONE,
@@ -285,6 +584,10 @@ namespace tDX // tucna - DirectX
   public:
     tDX::rcode	Construct(uint32_t screen_w, uint32_t screen_h, uint32_t pixel_w, uint32_t pixel_h, bool full_screen = false, bool vsync = false);
     tDX::rcode	Start();
+    // Run Start() without a window or GPU, drawing straight into the default
+    // draw target. Stops after nFrames frames (0 = until OnUserUpdate returns
+    // false) and uses fFixedElapsedTime as the frame time if it is above zero
+    void SetHeadless(uint32_t nFrames = 0, float fFixedElapsedTime = 0.0f);
 
   public: // Override Interfaces
     // Called once on application startup, use to load your resources
@@ -308,6 +611,14 @@ namespace tDX // tucna - DirectX
     // Get Mouse Wheel Delta
     int32_t GetMouseWheel();
 
+  public: // Profiling
+    // Time the engine frame phases (input, update, upload, present) and any
+    // user zones, the summary is saved to sCsvFile (if given) on exit
+    void EnableProfiling(const std::string& sCsvFile = "");
+    // Returns a named zone to time with tDX::ProfileScope
+    ProfileZone* GetProfileZone(const std::string& sName);
+    Profiler& GetProfiler();
+
   public: // Utility
     // Returns the width of the screen in "pixels"
     int32_t ScreenWidth();
@@ -330,8 +641,23 @@ namespace tDX // tucna - DirectX
     // tDX::Pixel::ALPHA  = Full transparency
     void SetPixelMode(Pixel::Mode m);
     Pixel::Mode GetPixelMode();
-    // Use a custom blend function
+    // Use a custom blend function, called for every pixel. Like the span shaders
+    // below it runs on several threads between BeginTiles and EndTiles, see SpanShader.
     void SetPixelMode(std::function<tDX::Pixel(const int x, const int y, const tDX::Pixel& pSource, const tDX::Pixel& pDest)> pixelMode);
+    // Use a custom blend function called once per span of a row, see SpanShader
+    void SetSpanShader(SpanShader shader);
+    // Use a blend functor with the signature of the per pixel function above. Its
+    // calls are inlined into the loop over each span, which the compiler can vectorize.
+    // It is copied and called concurrently like any SpanShader.
+    template <typename F>
+    void SetPixelShader(F blend)
+    {
+      SetSpanShader([blend](int32_t x, int32_t y, int32_t count, const Pixel* src, Pixel* dst)
+      {
+        for (int32_t i = 0; i < count; i++)
+          dst[i] = blend(x + i, y, src[i], dst[i]);
+      });
+    }
     // Change the blend factor form between 0.0f to 1.0f;
     void SetPixelBlend(float fBlend);
     // Offset texels by sub-pixel amount (advanced, do not use)
@@ -344,6 +670,9 @@ namespace tDX // tucna - DirectX
     void DrawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p = tDX::WHITE, uint32_t pattern = 0xFFFFFFFF);
     void DrawLine(const tDX::vi2d& pos1, const tDX::vi2d& pos2, Pixel p = tDX::WHITE, uint32_t pattern = 0xFFFFFFFF);
     void DrawLineClipped(float x1, float y1, float x2, float y2, const tDX::vf2d& clipWinPos, const tDX::vf2d& clipWinSize, Pixel p = tDX::WHITE);
+    // Fills a horizontal run of len pixels starting at (x,y), clipped to the draw target
+    void FillSpan(int32_t x, int32_t y, int32_t len, Pixel p = tDX::WHITE);
+    void FillSpan(const tDX::vi2d& pos, int32_t len, Pixel p = tDX::WHITE);
     // Draws a circle located at (x,y) with radius
     void DrawCircle(int32_t x, int32_t y, int32_t radius, Pixel p = tDX::WHITE, uint8_t mask = 0xFF);
     void DrawCircle(const tDX::vi2d& pos, int32_t radius, Pixel p = tDX::WHITE, uint8_t mask = 0xFF);
@@ -362,6 +691,18 @@ namespace tDX // tucna - DirectX
     // Flat fills a triangle between points (x1,y1), (x2,y2) and (x3,y3)
     void FillTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p = tDX::WHITE);
     void FillTriangle(const tDX::vi2d& pos1, const tDX::vi2d& pos2, const tDX::vi2d& pos3, Pixel p = tDX::WHITE);
+    // Flat fills a triangle with sub-pixel vertex positions, pixel centres lie at +0.5.
+    // If the draw target has a depth buffer only pixels with z below it are drawn.
+    void FillTriangle(const tDX::vf2d& pos1, float z1, const tDX::vf2d& pos2, float z2, const tDX::vf2d& pos3, float z3, Pixel p = tDX::WHITE);
+    // As above with the vertex colours interpolated across the triangle
+    void FillTriangle(const tDX::vf2d& pos1, float z1, Pixel p1, const tDX::vf2d& pos2, float z2, Pixel p2, const tDX::vf2d& pos3, float z3, Pixel p3);
+    // Fills a triangle with a texture like the above. Texture coordinates are
+    // interpolated perspective correct and sampled a block of 8x8 pixels at a time
+    // with Sprite::SampleBatch, from the mip level the block shrinks the texture to.
+    // Texels are multiplied by tint. Recorded or between BeginTiles and EndTiles,
+    // the texture is read when the triangle is drawn and must live until then.
+    void FillTexturedTriangle(const TexturedVertex& v1, const TexturedVertex& v2, const TexturedVertex& v3, Sprite* texture,
+      Sprite::Filter filter = Sprite::Filter::NEAREST, Pixel tint = tDX::WHITE);
     // Draws an entire sprite at location (x,y)
     void DrawSprite(int32_t x, int32_t y, Sprite *sprite, uint32_t scale = 1);
     void DrawSprite(const tDX::vi2d& pos, Sprite *sprite, uint32_t scale = 1);
@@ -369,23 +710,87 @@ namespace tDX // tucna - DirectX
     // selected area is (ox,oy) to (ox+w,oy+h)
     void DrawPartialSprite(int32_t x, int32_t y, Sprite *sprite, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale = 1);
     void DrawPartialSprite(const tDX::vi2d& pos, Sprite *sprite, const tDX::vi2d& sourcepos, const tDX::vi2d& size, uint32_t scale = 1);
+    // Draws a sprite with its pixel coordinate (u,v) mapped to (m[0]*u + m[1]*v + m[2],
+    // m[3]*u + m[4]*v + m[5]). Rows are sampled with Sprite::SampleBatch, which
+    // picks a smaller mip level for shrunk sprites that have mipmaps.
+    void DrawAffineSprite(const float m[6], Sprite *sprite, Sprite::Filter filter = Sprite::Filter::NEAREST);
+    // Draws a sprite turned by fAngle radians and scaled by fScale around its
+    // pixel coordinate center, which lands on pos
+    void DrawRotatedSprite(const tDX::vf2d& pos, Sprite *sprite, float fAngle, const tDX::vf2d& center = { 0.0f, 0.0f }, float fScale = 1.0f, Sprite::Filter filter = Sprite::Filter::NEAREST);
     // Draws a single line of text
     void DrawString(int32_t x, int32_t y, const std::string& sText, Pixel col = tDX::WHITE, uint32_t scale = 1);
+    // Zero terminated text, drawn without building a std::string
+    void DrawString(int32_t x, int32_t y, const char* sText, Pixel col = tDX::WHITE, uint32_t scale = 1);
     void DrawString(const tDX::vi2d& pos, const std::string& sText, Pixel col = tDX::WHITE, uint32_t scale = 1);
+    // Keeps the pixel runs of drawn strings, so the same text is not built from
+    // its glyphs again. Colour and scale are applied when drawing.
+    void EnableTextCache(bool bEnable = true);
     // Clears entire draw target to Pixel
     void Clear(Pixel p);
+    // Clears the area (x,y) to (x+w,y+h) of the draw target to Pixel
+    void Clear(int32_t x, int32_t y, int32_t w, int32_t h, Pixel p);
+    void Clear(const tDX::vi2d& pos, const tDX::vi2d& size, Pixel p);
+    // Clears the depth buffer of the draw target, whole or the area (x,y) to (x+w,y+h)
+    void ClearDepth(float fDepth = 1.0f);
+    void ClearDepth(int32_t x, int32_t y, int32_t w, int32_t h, float fDepth = 1.0f);
     // Resize the primary screen sprite
     void SetScreenSize(int w, int h);
 
+  public: // Parallel drawing
+    // Threads (0 = all hardware threads) and tile size used between BeginTiles
+    // and EndTiles, a single thread keeps drawing immediate
+    void SetRenderThreads(uint32_t nThreads, int32_t nTileSize = 64);
+    // Draw, FillSpan, DrawLine, the vf2d FillTriangle, FillTexturedTriangle, Clear and ClearDepth called
+    // in between are binned into screen tiles, which EndTiles draws concurrently.
+    // Other drawing and state changes first finish what has been binned so far.
+    // Sprites binned by DrawSprite, DrawPartialSprite and FillTexturedTriangle
+    // are read when the tiles are drawn and must live until then. A custom pixel
+    // mode is called by the worker threads at the same time and has to be thread safe.
+    void BeginTiles();
+    void EndTiles();
+
+  public: // Presentation statistics
+    // Bytes of the screen marked by drawing and bytes uploaded to present it,
+    // summed since Start. Only rows that changed are uploaded.
+    uint64_t GetBytesTouched() const;
+    uint64_t GetBytesUploaded() const;
+
+  public: // Command lists
+    // Drawing calls and draw target or pixel mode changes until EndRecording go
+    // into the list instead of the draw target. The list starts with the current state.
+    // Calls reading pixels, like DrawSprite, read them while recording, the list
+    // keeps a copy of the drawn area. FillTexturedTriangle and SetDrawTarget keep
+    // the sprite by pointer, it is read or drawn to when the list is replayed, so
+    // later changes to it show and it must outlive the list.
+    void BeginRecording(CommandList& list);
+    void EndRecording();
+    // Draws a recorded list, the draw target and pixel mode are restored afterwards.
+    // Replayed between BeginTiles and EndTiles, the list must live until EndTiles.
+    void Replay(const CommandList& list);
+
   public: // Branding
     std::string sAppName;
 
   private: // Inner mysterious workings
+#ifndef T_PGE_HEADLESS
     struct Vertex
     {
       DirectX::XMFLOAT3 position;
       DirectX::XMFLOAT2 texCoord;
     };
+#endif
+
+    // Horizontal run of set font pixels in a string, in unscaled text pixels
+    struct TextRun
+    {
+      int32_t x, y, len;
+    };
+
+    struct TextLayout
+    {
+      std::string sText;
+      std::vector<TextRun> vRuns;
+    };
 
     Sprite		*pDefaultDrawTarget = nullptr;
     Sprite		*pDrawTarget = nullptr;
@@ -417,8 +822,38 @@ namespace tDX // tucna - DirectX
     bool		bEnableVSYNC = false;
     float		fFrameTimer = 1.0f;
     int			nFrameCount = 0;
+#ifdef T_PGE_HEADLESS
+    bool		bHeadless = true;
+#else
+    bool		bHeadless = false;
+#endif
+    uint32_t	nHeadlessFrames = 0;
+    float		fHeadlessElapsedTime = 0.0f;
+    Profiler	profiler;
+    std::string	sProfileFile;
+    ProfileZone	*pZoneFrame = nullptr;
+    ProfileZone	*pZoneInput = nullptr;
+    ProfileZone	*pZoneUpdate = nullptr;
+    ProfileZone	*pZoneUpload = nullptr;
+    ProfileZone	*pZonePresent = nullptr;
     Sprite		*fontSprite = nullptr;
-    std::function<tDX::Pixel(const int x, const int y, const tDX::Pixel&, const tDX::Pixel&)> funcPixelMode;
+    // Glyphs of the characters 32 to 127, bit j * 8 + i set for font pixel (i,j)
+    uint64_t	nFontGlyphs[96] = {};
+    std::unique_ptr<ThreadPool>	pThreadPool;
+    uint32_t	nRenderThreads = 1;
+    int32_t		nTileSize = 64;
+    bool		bTiling = false;
+    int32_t		nTilesX = 0;
+    int32_t		nTilesY = 0;
+    std::vector<DrawCommand>	vTileCommands;
+    std::vector<TriangleTexture>	vTileTextures;
+    CommandList	*pRecording = nullptr;
+    uint64_t	nBytesTouched = 0;
+    uint64_t	nBytesUploaded = 0;
+    bool		bTextCache = false;
+    std::unordered_map<uint64_t, TextLayout>	mapTextLayouts;
+    std::vector<std::vector<uint32_t>>	vTileBins;
+    SpanShader	funcPixelMode;
 
     static std::map<size_t, uint8_t> mapKeys;
     bool		pKeyNewState[256]{ 0 };
@@ -429,6 +864,7 @@ namespace tDX // tucna - DirectX
     bool		pMouseOldState[5]{ 0 };
     HWButton	pMouseState[5];
 
+#ifndef T_PGE_HEADLESS
     Microsoft::WRL::ComPtr<ID3D11Device>              m_d3dDevice;
     Microsoft::WRL::ComPtr<ID3D11DeviceContext>       m_d3dContext;
     Microsoft::WRL::ComPtr<IDXGISwapChain1>           m_swapChain;
@@ -441,6 +877,7 @@ namespace tDX // tucna - DirectX
     Microsoft::WRL::ComPtr<ID3D11SamplerState>        m_samplerState;
     Microsoft::WRL::ComPtr<ID3D11Texture2D>           m_texture;
     Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>  m_textureView;
+#endif
 
     // If anything sets this flag to false, the engine "should" shut down gracefully
     static bool bActive;
@@ -452,15 +889,73 @@ namespace tDX // tucna - DirectX
     void tDX_UpdateMouseWheel(int32_t delta);
     void tDX_UpdateWindowSize(int32_t x, int32_t y);
     void tDX_UpdateViewport();
+    void tDX_UpdateInputState();
+    void tDX_ConstructFontSheet();
+
+    uint64_t tDX_Glyph(char c) const;
+    void tDX_DrawGlyph(int32_t x, int32_t y, uint64_t glyph, Pixel col, uint32_t scale);
+    const TextLayout& tDX_LayoutText(const char* sText);
+    void tDX_FinishProfiling();
+    static void tDX_FillPixels(Pixel* dst, int32_t count, Pixel p);
+    // Integer source over destination blending with alpha 0 to 255, rounded.
+    // Blended pixels are opaque.
+    static uint32_t tDX_Div255(uint32_t x);
+    static Pixel tDX_Blend(Pixel src, Pixel dst, uint32_t alpha);
+    static void tDX_BlendPixels(Pixel* dst, int32_t count, Pixel p, uint32_t alpha);
+    // Source alpha of every pixel scaled by nBlend, colours premultiplied or not
+    static void tDX_BlendRow(Pixel* dst, const Pixel* src, int32_t count, uint32_t nBlend, bool bPremultiplied);
+    static Pixel tDX_Unpremultiply(Pixel p);
+    // fBlendFactor as 0 to 255
+    uint32_t tDX_BlendScale() const;
+    // Source pixels with alpha 255 are copied, the others skipped
+    static void tDX_MaskRow(Pixel* dst, const Pixel* src, int32_t count);
+    // Source pixels drawn in the pixel mode, premultiplied ones only in ALPHA mode
+    void tDX_WriteRow(Pixel* dst, const Pixel* src, int32_t x, int32_t y, int32_t count, bool bPremultiplied) const;
+    // Whether tDX_BlitSprite draws the area like drawing it pixel by pixel would
+    bool tDX_CanBlit(Sprite* sprite, int32_t ox, int32_t oy, int32_t w, int32_t h) const;
+    // The w x h area at (ox, oy) as the blit reads it, for recorded lists
+    static Sprite tDX_CopyArea(Sprite* sprite, int32_t ox, int32_t oy, int32_t w, int32_t h);
+
+    // Target and clip rectangle (x1, y1 exclusive) the drawing kernels work in.
+    // Tiles give each worker its own, so no two of them touch the same pixel.
+    struct RasterState
+    {
+      Sprite* target = nullptr;
+      int32_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    };
+
+    RasterState tDX_TargetState() const;
+    bool tDX_Plot(const RasterState& rs, int32_t x, int32_t y, Pixel p) const;
+    void tDX_FillSpan(const RasterState& rs, int32_t x, int32_t y, int32_t len, Pixel p) const;
+    void tDX_DrawLine(const RasterState& rs, int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p, uint32_t pattern) const;
+    void tDX_ClearRect(const RasterState& rs, int32_t x, int32_t y, int32_t w, int32_t h, Pixel p) const;
+    void tDX_ClearDepthRect(const RasterState& rs, int32_t x, int32_t y, int32_t w, int32_t h, float fDepth) const;
+    void tDX_FillTriangle(const float* vx, const float* vy, const float* vz, const Pixel* vc, bool bSmooth, const TriangleTexture* pTexture = nullptr);
+    void tDX_RasterTriangle(const RasterState& rs, const float* vx, const float* vy, const float* vz, const Pixel* vc, bool bSmooth, const TriangleTexture* pTexture = nullptr) const;
+    void tDX_BlitSprite(const RasterState& rs, int32_t x, int32_t y, Sprite* sprite, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale) const;
+
+    void tDX_DeferCommand(const DrawCommand& cmd, int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+    void tDX_BinCommand(const DrawCommand& cmd, int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+    void tDX_RecordState();
+    void tDX_MarkDirty(int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+    void tDX_UploadDirty();
+    void tDX_FlushTiles();
+    void tDX_DrawTile(uint32_t nTile);
+    // Fills from this size on (4 MB) use non-temporal stores
+    static constexpr int32_t nStreamingFillPixels = 1 << 20;
+    tDX::rcode tDX_StartHeadless();
+
+    std::wstring wsAppName;
+
+#ifndef T_PGE_HEADLESS
     void tDX_DirectXCreateResources();
     bool tDX_DirectXCreateDevice();
-    void tDX_ConstructFontSheet();
 
     // Windows specific window handling
     HWND tDX_hWnd = nullptr;
     HWND tDX_WindowCreate();
-    std::wstring wsAppName;
     static LRESULT CALLBACK tDX_WindowEvent(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+#endif
   };
 
 
@@ -529,6 +1024,7 @@ namespace tDX
 
   //==========================================================
 
+#ifdef _WIN32
   std::wstring ConvertS2W(std::string s)
   {
     int count = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, NULL, 0);
@@ -539,12 +1035,97 @@ namespace tDX
     delete[] buffer;
     return w;
   }
+#endif
+
+  void* SurfacePool::Allocate(size_t nBytes)
+  {
+    if (nBytes == 0) return nullptr;
+
+    State& state = Get();
+    {
+      std::lock_guard<std::mutex> lock(state.mtx);
+      auto it = state.mapFree.find(nBytes);
+      if (it != state.mapFree.end() && !it->second.empty())
+      {
+        void* p = it->second.back();
+        it->second.pop_back();
+        state.nKept -= nBytes;
+        return p;
+      }
+      state.nHeapAllocations++;
+    }
+
+    return AlignedNew(nBytes);
+  }
+
+  void SurfacePool::Free(void* p, size_t nBytes)
+  {
+    if (!p) return;
+
+    State& state = Get();
+    {
+      std::lock_guard<std::mutex> lock(state.mtx);
+      if (state.nKept + nBytes <= nMaxKeptBytes)
+      {
+        state.mapFree[nBytes].push_back(p);
+        state.nKept += nBytes;
+        return;
+      }
+    }
+
+    AlignedDelete(p);
+  }
+
+  void SurfacePool::Trim()
+  {
+    State& state = Get();
+    std::lock_guard<std::mutex> lock(state.mtx);
+
+    for (auto& bucket : state.mapFree)
+      for (void* p : bucket.second)
+        AlignedDelete(p);
+
+    state.mapFree.clear();
+    state.nKept = 0;
+  }
+
+  size_t SurfacePool::KeptBytes()
+  {
+    State& state = Get();
+    std::lock_guard<std::mutex> lock(state.mtx);
+    return state.nKept;
+  }
+
+  uint64_t SurfacePool::HeapAllocations()
+  {
+    State& state = Get();
+    std::lock_guard<std::mutex> lock(state.mtx);
+    return state.nHeapAllocations;
+  }
+
+  void* SurfacePool::AlignedNew(size_t nBytes)
+  {
+    // The block the heap returned is stored just before the aligned one
+    void* pRaw = ::operator new(nBytes + nAlignment);
+    void* p = (void*)(((uintptr_t)pRaw + nAlignment) & ~(uintptr_t)(nAlignment - 1));
+    ((void**)p)[-1] = pRaw;
+    return p;
+  }
+
+  void SurfacePool::AlignedDelete(void* p)
+  {
+    ::operator delete(((void**)p)[-1]);
+  }
+
+  SurfacePool::State& SurfacePool::Get()
+  {
+    // Never destroyed, static sprites may still release their storage at exit
+    static State* state = new State;
+    return *state;
+  }
 
   Sprite::Sprite()
   {
-    pColData = nullptr;
-    width = 0;
-    height = 0;
   }
 
   Sprite::Sprite(std::string sImageFile, tDX::ResourcePack *pack)
@@ -554,28 +1135,216 @@ namespace tDX
 
   Sprite::Sprite(int32_t w, int32_t h)
   {
-    if (pColData) delete[] pColData;
-    width = w;		height = h;
-    pColData = new Pixel[width * height];
-    for (int32_t i = 0; i < width*height; i++)
-      pColData[i] = Pixel();
+    Resize(w, h);
+  }
+
+  Sprite::Sprite(const Sprite& sprite)
+  {
+    *this = sprite;
+  }
+
+  Sprite::Sprite(Sprite&& sprite) noexcept
+  {
+    *this = std::move(sprite);
+  }
+
+  Sprite& Sprite::operator=(const Sprite& sprite)
+  {
+    if (this == &sprite) return *this;
+
+    Resize(sprite.width, sprite.height);
+    EnableDepth(sprite.pDepthData != nullptr);
+
+    // A pending fill is copied as such
+    SetLayout(sprite.layoutData);
+    bFillPending = sprite.bFillPending;
+    if (!bFillPending && pColData)
+      std::copy_n(sprite.pColData, StoragePixels(layoutData), pColData);
+    if (pDepthData)
+      std::copy_n(sprite.pDepthData, width * height, pDepthData);
+
+    if (sprite.pMipData)
+    {
+      vMips = sprite.vMips;
+      pMipData = (Pixel*)SurfacePool::Allocate(MipPixels() * sizeof(Pixel));
+      std::copy_n(sprite.pMipData, MipPixels(), pMipData);
+    }
+
+    modeSample = sprite.modeSample;
+    bPremultiplied = sprite.bPremultiplied;
+    vDirtyRows = sprite.vDirtyRows;
+    return *this;
+  }
+
+  Sprite& Sprite::operator=(Sprite&& sprite) noexcept
+  {
+    if (this == &sprite) return *this;
+
+    Release();
+    width = sprite.width;
+    height = sprite.height;
+    pColData = sprite.pColData;
+    pDepthData = sprite.pDepthData;
+    modeSample = sprite.modeSample;
+    layoutData = sprite.layoutData;
+    bPremultiplied = sprite.bPremultiplied;
+    bFillPending = sprite.bFillPending;
+    vDirtyRows = std::move(sprite.vDirtyRows);
+    vMips = std::move(sprite.vMips);
+    pMipData = sprite.pMipData;
+
+    sprite.pColData = nullptr;
+    sprite.pDepthData = nullptr;
+    sprite.pMipData = nullptr;
+    sprite.vMips.clear();
+    sprite.width = 0;
+    sprite.height = 0;
+    sprite.bFillPending = false;
+    sprite.vDirtyRows.clear();
+    return *this;
   }
 
   Sprite::~Sprite()
   {
-    if (pColData) delete pColData;
+    Release();
+  }
+
+  void Sprite::Release()
+  {
+    ReleaseMipmaps();
+    SurfacePool::Free(pColData, StoragePixels(layoutData) * sizeof(Pixel));
+    SurfacePool::Free(pDepthData, (size_t)width * height * sizeof(float));
+    pColData = nullptr;
+    pDepthData = nullptr;
+    bFillPending = false;
+  }
+
+  void Sprite::Resize(int32_t w, int32_t h)
+  {
+    const bool bDepth = pDepthData != nullptr;
+
+    // The pool hands the block just released back when the size matches
+    Release();
+    width = std::max(w, 0);
+    height = std::max(h, 0);
+    pColData = (Pixel*)SurfacePool::Allocate(StoragePixels(layoutData) * sizeof(Pixel));
+    bFillPending = pColData != nullptr;
+    bPremultiplied = false;
+    vDirtyRows.clear();
+
+    if (bDepth)
+      EnableDepth();
+  }
+
+  void Sprite::DiscardContents()
+  {
+    bFillPending = false;
+  }
+
+  void Sprite::ResolvePendingFill()
+  {
+    std::fill_n(pColData, StoragePixels(layoutData), Pixel());
+    bFillPending = false;
+  }
+
+  size_t Sprite::StoragePixels(Layout layout) const
+  {
+    if (layout == Layout::ROW_MAJOR)
+      return (size_t)width * height;
+
+    return (size_t)((width + 7) >> 3) * ((height + 7) >> 3) * 64;
+  }
+
+  size_t Sprite::Offset(int32_t x, int32_t y) const
+  {
+    if (layoutData == Layout::ROW_MAJOR)
+      return (size_t)y * width + x;
+
+    return TiledOffset(x, y, width);
+  }
+
+  size_t Sprite::TiledOffset(int32_t x, int32_t y, int32_t width)
+  {
+    // Tiles by rows, the bits of x and y interleaved inside a tile
+    static const uint8_t nSpread[8] = { 0, 1, 4, 5, 16, 17, 20, 21 };
+    const size_t tile = (size_t)(y >> 3) * ((width + 7) >> 3) + (x >> 3);
+    return (tile << 6) | (nSpread[y & 7] << 1) | nSpread[x & 7];
+  }
+
+  void Sprite::SetLayout(Layout layout)
+  {
+    if (layout == layoutData)
+      return;
+
+    Pixel* pOld = pColData;
+    const Layout layoutOld = layoutData;
+
+    layoutData = layout;
+    pColData = pOld ? (Pixel*)SurfacePool::Allocate(StoragePixels(layout) * sizeof(Pixel)) : nullptr;
+
+    // A pending fill does not care about the order
+    if (pOld && !bFillPending)
+    {
+      // Pixels of partly covered tiles are blank, like those of a new sprite
+      if (layout == Layout::TILED)
+        std::fill_n(pColData, StoragePixels(layout), Pixel());
+
+      for (int32_t y = 0; y < height; y++)
+        for (int32_t x = 0; x < width; x++)
+        {
+          const size_t r = (size_t)y * width + x;
+          const size_t t = TiledOffset(x, y, width);
+
+          if (layout == Layout::TILED)
+            pColData[t] = pOld[r];
+          else
+            pColData[r] = pOld[t];
+        }
+    }
+
+    SurfacePool::Free(pOld, StoragePixels(layoutOld) * sizeof(Pixel));
+  }
+
+  tDX::Sprite::Layout Sprite::GetLayout() const
+  {
+    return layoutData;
+  }
+
+  void Sprite::CopyRow(int32_t x, int32_t y, int32_t count, Pixel* dst)
+  {
+    const Pixel* src = GetData();
+
+    if (layoutData == Layout::ROW_MAJOR)
+    {
+      std::copy_n(src + Offset(x, y), count, dst);
+      return;
+    }
+
+    for (int32_t i = 0; i < count; i++)
+      dst[i] = src[TiledOffset(x + i, y, width)];
   }
 
   tDX::rcode Sprite::LoadFromPGESprFile(std::string sImageFile, tDX::ResourcePack *pack)
   {
-    if (pColData) delete[] pColData;
+    Release();
+    width = 0;
+    height = 0;
+    bPremultiplied = false;
 
+    // Files are stored by rows, the sprite keeps its layout
     auto ReadData = [&](std::istream &is)
     {
-      is.read((char*)&width, sizeof(int32_t));
-      is.read((char*)&height, sizeof(int32_t));
-      pColData = new Pixel[width * height];
+      const Layout layout = layoutData;
+      layoutData = Layout::ROW_MAJOR;
+
+      int32_t w = 0, h = 0;
+      is.read((char*)&w, sizeof(int32_t));
+      is.read((char*)&h, sizeof(int32_t));
+      Resize(w, h);
+      DiscardContents();
       is.read((char*)pColData, width * height * sizeof(uint32_t));
+
+      SetLayout(layout);
     };
 
     // These are essentially Memory Surfaces represented by tDX::Sprite
@@ -605,7 +1374,7 @@ namespace tDX
 
   tDX::rcode Sprite::SaveToPGESprFile(std::string sImageFile)
   {
-    if (pColData == nullptr) return tDX::FAIL;
+    if (GetData() == nullptr) return tDX::FAIL;
 
     std::ofstream ofs;
     ofs.open(sImageFile, std::ifstream::binary);
@@ -613,7 +1382,17 @@ namespace tDX
     {
       ofs.write((char*)&width, sizeof(int32_t));
       ofs.write((char*)&height, sizeof(int32_t));
-      ofs.write((char*)pColData, width*height * sizeof(uint32_t));
+      if (layoutData == Layout::ROW_MAJOR)
+        ofs.write((char*)pColData, width*height * sizeof(uint32_t));
+      else
+      {
+        std::vector<Pixel> vRow(width);
+        for (int32_t y = 0; y < height; y++)
+        {
+          CopyRow(0, y, width, vRow.data());
+          ofs.write((char*)vRow.data(), width * sizeof(uint32_t));
+        }
+      }
       ofs.close();
       return tDX::OK;
     }
@@ -621,115 +1400,1225 @@ namespace tDX
     return tDX::FAIL;
   }
 
-#if defined(__linux__)
-  void pngReadStream(png_structp pngPtr, png_bytep data, png_size_t length)
+  // DEFLATE decoder (RFC 1951) for the zlib streams inside PNG files. Codes of
+  // up to 9 bits are decoded with one table lookup, longer ones bit by bit.
+  class Inflater
   {
-    png_voidp a = png_get_io_ptr(pngPtr);
-    ((std::istream*)a)->read((char*)data, length);
-  }
-#endif
+  public:
+    // Decompresses the zlib stream into exactly nOut bytes. Every written byte
+    // is final, onProgress(n) is called once the first n bytes are written and
+    // returns the count at which it wants to be called next. False for corrupt,
+    // truncated or too short streams.
+    template <typename F>
+    bool Run(const uint8_t* pIn, size_t nIn, uint8_t* pOut, size_t nOut, F onProgress);
 
-  tDX::rcode Sprite::LoadFromFile(std::string sImageFile, tDX::ResourcePack *pack)
-  {
-    UNUSED(pack);
+  private:
+    static constexpr int nFastBits = 9;
 
-    Gdiplus::Bitmap *bmp = nullptr;
-    if (pack != nullptr)
+    struct Huffman
     {
-      // Load sprite from input stream
-      ResourceBuffer rb = pack->GetFileBuffer(sImageFile);
-      bmp = Gdiplus::Bitmap::FromStream(SHCreateMemStream((BYTE*)rb.vMemory.data(), (UINT)rb.vMemory.size()));
-    }
-    else
+      // Symbol and length (in the top 4 bits) of every code of up to nFastBits
+      // bits, indexed by the next bits of the stream, 0 for longer codes
+      uint16_t fast[1 << nFastBits];
+      // Codes per length and the symbols sorted by code, for the longer ones
+      uint16_t count[16];
+      uint16_t symbol[320];
+    };
+
+    static bool Build(Huffman& h, const uint8_t* lengths, int n);
+    int Decode(const Huffman& h);
+    void Refill();
+    uint32_t Bits(int n);
+    // Reading past the end yields zero bytes, an error once they are used
+    bool Overrun() const { return nCount < nPadding * 8; }
+
+    const uint8_t* p = nullptr;
+    const uint8_t* pEnd = nullptr;
+    uint64_t nBuffer = 0;
+    int nCount = 0;
+    int nPadding = 0;
+  };
+
+  void Inflater::Refill()
+  {
+    if (pEnd - p >= 8)
     {
-      // Load sprite from file
-      bmp = Gdiplus::Bitmap::FromFile(ConvertS2W(sImageFile).c_str());
+      uint64_t next;
+      std::memcpy(&next, p, 8);
+      nBuffer |= next << nCount;
+      p += (63 - nCount) >> 3;
+      nCount |= 56;
+      return;
     }
 
-    if (bmp == nullptr) return tDX::NO_FILE;
-    width = bmp->GetWidth();
-    height = bmp->GetHeight();
-    pColData = new Pixel[width * height];
-
-    for (int x = 0; x < width; x++)
-      for (int y = 0; y < height; y++)
-      {
-        Gdiplus::Color c;
-        bmp->GetPixel(x, y, &c);
-        SetPixel(x, y, Pixel(c.GetRed(), c.GetGreen(), c.GetBlue(), c.GetAlpha()));
-      }
-    delete bmp;
-    return tDX::OK;
+    while (nCount <= 56)
+    {
+      uint64_t next = 0;
+      if (p < pEnd) next = *p++;
+      else nPadding++;
+      nBuffer |= next << nCount;
+      nCount += 8;
+    }
   }
 
-  void Sprite::SetSampleMode(tDX::Sprite::Mode mode)
+  uint32_t Inflater::Bits(int n)
   {
-    modeSample = mode;
+    if (nCount < n) Refill();
+    const uint32_t v = (uint32_t)(nBuffer & ((1ull << n) - 1));
+    nBuffer >>= n;
+    nCount -= n;
+    return v;
   }
 
-
-  Pixel Sprite::GetPixel(int32_t x, int32_t y)
+  bool Inflater::Build(Huffman& h, const uint8_t* lengths, int n)
   {
-    if (modeSample == tDX::Sprite::Mode::NORMAL)
-    {
-      if (x >= 0 && x < width && y >= 0 && y < height)
-        return pColData[y*width + x];
-      else
-        return Pixel(0, 0, 0, 0);
-    }
-    else
+    std::fill_n(h.fast, 1 << nFastBits, (uint16_t)0);
+    std::fill_n(h.count, 16, (uint16_t)0);
+    for (int i = 0; i < n; i++)
+      h.count[lengths[i]]++;
+    h.count[0] = 0;
+
+    // Over-subscribed sets are corrupt, incomplete ones are allowed
+    int left = 1;
+    for (int len = 1; len < 16; len++)
     {
-      return pColData[abs(y%height)*width + abs(x%width)];
+      left = (left << 1) - h.count[len];
+      if (left < 0) return false;
     }
-  }
+
+    uint16_t offset[16] = {}, code[16] = {};
+    for (int len = 1; len < 15; len++)
+      offset[len + 1] = offset[len] + h.count[len];
+    for (int len = 1; len < 16; len++)
+      code[len] = (uint16_t)((code[len - 1] + h.count[len - 1]) << 1);
+
+    for (int i = 0; i < n; i++)
+    {
+      const int len = lengths[i];
+      if (len == 0) continue;
+
+      h.symbol[offset[len]++] = (uint16_t)i;
+
+      // Codes are sent from their top bit on, the table is indexed by them reversed
+      const uint32_t c = code[len]++;
+      if (len > nFastBits) continue;
+
+      uint32_t reversed = 0;
+      for (int b = 0; b < len; b++)
+        reversed |= ((c >> b) & 1) << (len - 1 - b);
+      for (uint32_t r = reversed; r < (1u << nFastBits); r += 1u << len)
+        h.fast[r] = (uint16_t)(len << 12 | i);
+    }
+
+    return true;
+  }
+
+  int Inflater::Decode(const Huffman& h)
+  {
+    if (nCount < 16) Refill();
+
+    const uint16_t e = h.fast[nBuffer & ((1 << nFastBits) - 1)];
+    if (e)
+    {
+      nBuffer >>= e >> 12;
+      nCount -= e >> 12;
+      return e & 0xFFF;
+    }
+
+    // Canonical codes are consecutive per length, the first of each follows
+    // from the counts of the shorter ones
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++)
+    {
+      code |= (int)(nBuffer & 1);
+      nBuffer >>= 1;
+      nCount--;
+
+      if (code - first < h.count[len])
+        return h.symbol[index + code - first];
+
+      index += h.count[len];
+      first = (first + h.count[len]) << 1;
+      code <<= 1;
+    }
+
+    return -1;
+  }
+
+  template <typename F>
+  bool Inflater::Run(const uint8_t* pIn, size_t nIn, uint8_t* pOut, size_t nOut, F onProgress)
+  {
+    // zlib header: deflate, no preset dictionary
+    if (nIn < 2 || (pIn[0] & 0x0F) != 8 || (pIn[0] << 8 | pIn[1]) % 31 != 0 || (pIn[1] & 0x20))
+      return false;
+
+    p = pIn + 2;
+    pEnd = pIn + nIn;
+    nBuffer = 0;
+    nCount = 0;
+    nPadding = 0;
+
+    static const uint16_t nLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const uint8_t nLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const uint16_t nDistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const uint8_t nDistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    static const uint8_t nCodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    Huffman literals, distances;
+    size_t o = 0;
+    size_t nNotify = onProgress(0);
+    bool bFinal = false;
+
+    while (!bFinal)
+    {
+      bFinal = Bits(1) != 0;
+      const uint32_t nType = Bits(2);
+      if (Overrun()) return false;
+
+      if (nType == 0)
+      {
+        // Stored: whole bytes left in the buffer go back to the input
+        nBuffer >>= nCount & 7;
+        nCount &= ~7;
+        if (nCount / 8 < nPadding) return false;
+        p -= nCount / 8 - nPadding;
+        nBuffer = 0;
+        nCount = 0;
+        nPadding = 0;
+
+        if (pEnd - p < 4) return false;
+        const size_t len = (size_t)(p[0] | p[1] << 8);
+        if (len != (size_t)(~(p[2] | p[3] << 8) & 0xFFFF)) return false;
+        p += 4;
+        if ((size_t)(pEnd - p) < len || nOut - o < len) return false;
+
+        std::memcpy(pOut + o, p, len);
+        p += len;
+        o += len;
+        if (o >= nNotify) nNotify = onProgress(o);
+        continue;
+      }
+
+      uint8_t lengths[320] = {};
+
+      if (nType == 1)
+      {
+        std::fill_n(lengths, 144, (uint8_t)8);
+        std::fill_n(lengths + 144, 112, (uint8_t)9);
+        std::fill_n(lengths + 256, 24, (uint8_t)7);
+        std::fill_n(lengths + 280, 8, (uint8_t)8);
+        std::fill_n(lengths + 288, 30, (uint8_t)5);
+        Build(literals, lengths, 288);
+        Build(distances, lengths + 288, 30);
+      }
+      else if (nType == 2)
+      {
+        const int nLiterals = (int)Bits(5) + 257, nDistances = (int)Bits(5) + 1, nCodeLengths = (int)Bits(4) + 4;
+        if (nLiterals > 286 || nDistances > 30) return false;
+
+        // The code lengths of both sets are Huffman coded themselves
+        for (int i = 0; i < nCodeLengths; i++)
+          lengths[nCodeLengthOrder[i]] = (uint8_t)Bits(3);
+
+        Huffman codeLengths;
+        if (!Build(codeLengths, lengths, 19)) return false;
+
+        for (int i = 0; i < nLiterals + nDistances;)
+        {
+          const int sym = Decode(codeLengths);
+          if (sym < 0 || Overrun()) return false;
+
+          if (sym < 16)
+          {
+            lengths[i++] = (uint8_t)sym;
+            continue;
+          }
+
+          uint8_t value = 0;
+          int repeat;
+          if (sym == 16)
+          {
+            if (i == 0) return false;
+            value = lengths[i - 1];
+            repeat = 3 + (int)Bits(2);
+          }
+          else if (sym == 17)
+            repeat = 3 + (int)Bits(3);
+          else
+            repeat = 11 + (int)Bits(7);
+
+          if (i + repeat > nLiterals + nDistances) return false;
+          std::fill_n(lengths + i, repeat, value);
+          i += repeat;
+        }
+
+        if (lengths[256] == 0) return false;
+        if (!Build(literals, lengths, nLiterals) || !Build(distances, lengths + nLiterals, nDistances)) return false;
+      }
+      else
+        return false;
+
+      while (true)
+      {
+        int sym = Decode(literals);
+
+        if (sym < 256)
+        {
+          if (sym < 0 || o == nOut) return false;
+          pOut[o++] = (uint8_t)sym;
+        }
+        else if (sym == 256)
+          break;
+        else
+        {
+          sym -= 257;
+          if (sym >= 29) return false;
+          const size_t len = nLengthBase[sym] + Bits(nLengthExtra[sym]);
+
+          const int d = Decode(distances);
+          if (d < 0 || d >= 30) return false;
+          const size_t distance = nDistanceBase[d] + Bits(nDistanceExtra[d]);
+          if (distance > o || len > nOut - o) return false;
+
+          // Shorter distances than lengths repeat the bytes being written
+          uint8_t* dst = pOut + o;
+          const uint8_t* src = dst - distance;
+          if (distance >= len)
+            std::memcpy(dst, src, len);
+          else
+            for (size_t i = 0; i < len; i++)
+              dst[i] = src[i];
+          o += len;
+        }
+
+        if (Overrun()) return false;
+        if (o >= nNotify) nNotify = onProgress(o);
+      }
+    }
+
+    return o == nOut;
+  }
+
+  bool Sprite::ReadImageFile(const std::string& sImageFile, tDX::ResourcePack *pack, std::vector<char>& vData)
+  {
+    if (pack != nullptr)
+    {
+      ResourceBuffer rb = pack->GetFileBuffer(sImageFile);
+      vData = std::move(rb.vMemory);
+      return !vData.empty();
+    }
+
+    std::ifstream ifs(sImageFile, std::ifstream::binary | std::ifstream::ate);
+    if (!ifs.is_open())
+      return false;
+
+    const std::streamsize nSize = ifs.tellg();
+    if (nSize <= 0)
+      return false;
+
+    vData.resize((size_t)nSize);
+    ifs.seekg(0);
+    return (bool)ifs.read(vData.data(), nSize);
+  }
+
+  tDX::rcode Sprite::LoadFromFile(std::string sImageFile, tDX::ResourcePack *pack)
+  {
+    std::vector<char> vData;
+    if (!ReadImageFile(sImageFile, pack, vData))
+    {
+      Release();
+      width = 0;
+      height = 0;
+      return tDX::NO_FILE;
+    }
+
+    return LoadFromMemory((const uint8_t*)vData.data(), vData.size());
+  }
+
+  tDX::rcode Sprite::LoadFromMemory(const uint8_t* pData, size_t nSize)
+  {
+    Release();
+    width = 0;
+    height = 0;
+    bPremultiplied = false;
+
+    // Images are decoded by rows, the sprite keeps its layout
+    const Layout layout = layoutData;
+    layoutData = Layout::ROW_MAJOR;
+
+    static const uint8_t nPNGSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    tDX::rcode result = tDX::FAIL;
+
+    if (nSize >= 8 && std::memcmp(pData, nPNGSignature, 8) == 0)
+      result = DecodePNG(pData, nSize);
+    else if (nSize >= 4 && std::memcmp(pData, "qoif", 4) == 0)
+      result = DecodeQOI(pData, nSize);
+#ifdef _WIN32
+    else
+    {
+      // Other formats through GDI+, which hands the pixels over by rows
+      IStream* stream = SHCreateMemStream(pData, (UINT)nSize);
+      Gdiplus::Bitmap* bmp = stream ? Gdiplus::Bitmap::FromStream(stream) : nullptr;
+
+      if (bmp != nullptr && bmp->GetLastStatus() == Gdiplus::Ok)
+      {
+        Resize((int32_t)bmp->GetWidth(), (int32_t)bmp->GetHeight());
+        DiscardContents();
+
+        Gdiplus::Rect rect(0, 0, width, height);
+        Gdiplus::BitmapData data;
+        if (bmp->LockBits(&rect, Gdiplus::ImageLockModeRead, PixelFormat32bppARGB, &data) == Gdiplus::Ok)
+        {
+          for (int32_t y = 0; y < height; y++)
+          {
+            const uint32_t* src = (const uint32_t*)((const uint8_t*)data.Scan0 + (ptrdiff_t)y * data.Stride);
+            Pixel* dst = pColData + (size_t)y * width;
+
+            // ARGB words to the byte order of Pixel
+            for (int32_t x = 0; x < width; x++)
+              dst[x].n = (src[x] & 0xFF00FF00) | (src[x] >> 16 & 0xFF) | (src[x] & 0xFF) << 16;
+          }
+
+          bmp->UnlockBits(&data);
+          result = tDX::OK;
+        }
+      }
+
+      delete bmp;
+      if (stream) stream->Release();
+    }
+#endif
+
+    if (result != tDX::OK)
+    {
+      Release();
+      width = 0;
+      height = 0;
+    }
+
+    SetLayout(layout);
+    return result;
+  }
+
+  tDX::rcode Sprite::DecodePNG(const uint8_t* pData, size_t nSize)
+  {
+    auto be32 = [](const uint8_t* b) { return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3]; };
+    auto be16 = [](const uint8_t* b) { return (uint32_t)(b[0] << 8 | b[1]); };
+
+    uint32_t w = 0, h = 0, nDepth = 0, nColour = 0, nInterlace = 0;
+    Pixel palette[256];
+    uint32_t nPalette = 0;
+    bool bKey = false;
+    uint32_t key[3] = {};
+    std::vector<uint8_t> vCompressed;
+
+    // Chunks, their checksums are not verified
+    const uint8_t* p = pData + 8;
+    const uint8_t* pEnd = pData + nSize;
+    bool bHeader = false;
+
+    while (pEnd - p >= 12)
+    {
+      const uint32_t len = be32(p);
+      const uint8_t* type = p + 4;
+      const uint8_t* body = p + 8;
+      if (len > (size_t)(pEnd - body) - 4) return tDX::FAIL;
+      p = body + len + 4;
+
+      if (std::memcmp(type, "IHDR", 4) == 0)
+      {
+        if (len < 13 || body[10] != 0 || body[11] != 0) return tDX::FAIL;
+        w = be32(body); h = be32(body + 4);
+        nDepth = body[8]; nColour = body[9]; nInterlace = body[12];
+        bHeader = true;
+      }
+      else if (!bHeader)
+        return tDX::FAIL;
+      else if (std::memcmp(type, "PLTE", 4) == 0)
+      {
+        nPalette = std::min(len / 3, 256u);
+        for (uint32_t i = 0; i < nPalette; i++)
+          palette[i] = Pixel(body[i * 3], body[i * 3 + 1], body[i * 3 + 2]);
+      }
+      else if (std::memcmp(type, "tRNS", 4) == 0)
+      {
+        // Alpha of palette entries, or the one colour that is transparent
+        if (nColour == 3)
+          for (uint32_t i = 0; i < std::min(len, 256u); i++)
+            palette[i].a = body[i];
+        else if (nColour == 0 && len >= 2)
+        {
+          key[0] = be16(body);
+          bKey = true;
+        }
+        else if (nColour == 2 && len >= 6)
+        {
+          key[0] = be16(body); key[1] = be16(body + 2); key[2] = be16(body + 4);
+          bKey = true;
+        }
+      }
+      else if (std::memcmp(type, "IDAT", 4) == 0)
+        vCompressed.insert(vCompressed.end(), body, body + len);
+      else if (std::memcmp(type, "IEND", 4) == 0)
+        break;
+    }
+
+    // Colour types are grey 0, RGB 2, palette 3, grey and alpha 4, RGBA 6
+    const bool bValidDepth =
+      (nColour == 0 && (nDepth == 1 || nDepth == 2 || nDepth == 4 || nDepth == 8 || nDepth == 16)) ||
+      (nColour == 3 && (nDepth == 1 || nDepth == 2 || nDepth == 4 || nDepth == 8)) ||
+      ((nColour == 2 || nColour == 4 || nColour == 6) && (nDepth == 8 || nDepth == 16));
+
+    if (!bValidDepth || nInterlace > 1 || (nColour == 3 && nPalette == 0) || vCompressed.empty())
+      return tDX::FAIL;
+    if (w == 0 || h == 0 || w > (1u << 24) || h > (1u << 24) || (uint64_t)w * h > (1u << 28))
+      return tDX::FAIL;
+
+    const uint32_t nChannels = nColour == 2 ? 3 : nColour == 4 ? 2 : nColour == 6 ? 4 : 1;
+    const uint32_t nPixelBits = nChannels * nDepth;
+    // Filters work on the bytes of whole pixels, at least one
+    const size_t nFilterStride = std::max(nPixelBits / 8, 1u);
+    auto rowBytes = [&](uint32_t nPixels) { return ((size_t)nPixels * nPixelBits + 7) / 8; };
+
+    Resize((int32_t)w, (int32_t)h);
+    DiscardContents();
+    if (!pColData) return tDX::FAIL;
+
+    // Undoes the filter of a row in place, prev is the row above unfiltered
+    auto unfilter = [&](uint8_t nFilter, uint8_t* row, const uint8_t* prev, size_t n)
+    {
+      const size_t bpp = nFilterStride;
+      switch (nFilter)
+      {
+      case 0:
+        return true;
+      case 1:
+        for (size_t i = bpp; i < n; i++) row[i] = (uint8_t)(row[i] + row[i - bpp]);
+        return true;
+      case 2:
+        for (size_t i = 0; i < n; i++) row[i] = (uint8_t)(row[i] + prev[i]);
+        return true;
+      case 3:
+        for (size_t i = 0; i < bpp; i++) row[i] = (uint8_t)(row[i] + (prev[i] >> 1));
+        for (size_t i = bpp; i < n; i++) row[i] = (uint8_t)(row[i] + ((row[i - bpp] + prev[i]) >> 1));
+        return true;
+      case 4:
+        for (size_t i = 0; i < bpp; i++) row[i] = (uint8_t)(row[i] + prev[i]);
+        for (size_t i = bpp; i < n; i++)
+        {
+          const int a = row[i - bpp], b = prev[i], c = prev[i - bpp];
+          const int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+          row[i] = (uint8_t)(row[i] + (pa <= pb && pa <= pc ? a : pb <= pc ? b : c));
+        }
+        return true;
+      default:
+        return false;
+      }
+    };
+
+    // Sample i of a row, channels interleaved, and its value in 8 bits
+    const uint32_t nMax = (1u << nDepth) - 1;
+    auto sample = [&](const uint8_t* row, uint32_t i) -> uint32_t
+    {
+      if (nDepth == 8) return row[i];
+      if (nDepth == 16) return be16(row + i * 2);
+      const uint32_t bit = i * nDepth;
+      return (uint32_t)(row[bit >> 3] >> (8 - nDepth - (bit & 7))) & nMax;
+    };
+    auto to8 = [&](uint32_t v) { return (uint8_t)(nDepth == 16 ? v >> 8 : v * 255 / nMax); };
+
+    // Unfiltered row of count pixels to the sprite's pixel format
+    auto expand = [&](const uint8_t* row, Pixel* dst, uint32_t count)
+    {
+      // RGBA in 8 bits is already in the byte order of Pixel
+      if (nColour == 6 && nDepth == 8)
+      {
+        std::memcpy(dst, row, (size_t)count * 4);
+        return;
+      }
+
+      for (uint32_t x = 0; x < count; x++)
+      {
+        const uint32_t i = x * nChannels;
+        switch (nColour)
+        {
+        case 0:
+        {
+          const uint32_t v = sample(row, i);
+          const uint8_t g = to8(v);
+          dst[x] = Pixel(g, g, g, bKey && v == key[0] ? 0 : 255);
+          break;
+        }
+        case 2:
+        {
+          const uint32_t r = sample(row, i), g = sample(row, i + 1), b = sample(row, i + 2);
+          dst[x] = Pixel(to8(r), to8(g), to8(b), bKey && r == key[0] && g == key[1] && b == key[2] ? 0 : 255);
+          break;
+        }
+        case 3:
+          dst[x] = palette[sample(row, x)];
+          break;
+        case 4:
+        {
+          const uint8_t g = to8(sample(row, i));
+          dst[x] = Pixel(g, g, g, to8(sample(row, i + 1)));
+          break;
+        }
+        default:
+          dst[x] = Pixel(to8(sample(row, i)), to8(sample(row, i + 1)), to8(sample(row, i + 2)), to8(sample(row, i + 3)));
+          break;
+        }
+      }
+    };
+
+    // The first row of an image or pass is filtered against zeros
+    const std::vector<uint8_t> vZero(rowBytes(w), 0);
+    Inflater inflater;
+
+    if (nInterlace == 0)
+    {
+      // Rows are unfiltered and converted as soon as they are inflated, while
+      // they are still in the cache. Later matches copy the filtered bytes, so
+      // the inflated rows stay as they are and are unfiltered into a copy.
+      const size_t nRow = rowBytes(w) + 1;
+      std::unique_ptr<uint8_t[]> raw(new uint8_t[nRow * h]);
+      std::vector<uint8_t> vCurrent(nRow - 1), vPrevious(vZero);
+      uint32_t y = 0;
+      bool bValid = true;
+
+      auto onRows = [&](size_t n)
+      {
+        for (; y < h && n >= (y + 1) * nRow; y++)
+        {
+          const uint8_t* row = raw.get() + y * nRow;
+          std::memcpy(vCurrent.data(), row + 1, nRow - 1);
+          bValid &= unfilter(row[0], vCurrent.data(), vPrevious.data(), nRow - 1);
+          expand(vCurrent.data(), pColData + (size_t)y * w, w);
+          vCurrent.swap(vPrevious);
+        }
+
+        return y < h ? (y + 1) * nRow : SIZE_MAX;
+      };
+
+      if (!inflater.Run(vCompressed.data(), vCompressed.size(), raw.get(), nRow * h, onRows) || !bValid)
+        return tDX::FAIL;
+
+      return tDX::OK;
+    }
+
+    // Adam7: seven passes of every n-th pixel of every m-th row, inflated as one
+    static const uint32_t nPassX[7] = { 0, 4, 0, 2, 0, 1, 0 }, nPassY[7] = { 0, 0, 4, 0, 2, 0, 1 };
+    static const uint32_t nStepX[7] = { 8, 8, 4, 4, 2, 2, 1 }, nStepY[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+    uint32_t nPassW[7], nPassH[7];
+    size_t nTotal = 0;
+    for (int i = 0; i < 7; i++)
+    {
+      nPassW[i] = (w - nPassX[i] + nStepX[i] - 1) / nStepX[i];
+      nPassH[i] = (h - nPassY[i] + nStepY[i] - 1) / nStepY[i];
+      if (nPassW[i] && nPassH[i])
+        nTotal += (rowBytes(nPassW[i]) + 1) * nPassH[i];
+    }
+
+    std::unique_ptr<uint8_t[]> raw(new uint8_t[nTotal]);
+    if (!inflater.Run(vCompressed.data(), vCompressed.size(), raw.get(), nTotal, [](size_t) { return SIZE_MAX; }))
+      return tDX::FAIL;
+
+    std::vector<Pixel> vRow(w);
+    uint8_t* row = raw.get();
+
+    for (int i = 0; i < 7; i++)
+    {
+      if (!nPassW[i] || !nPassH[i]) continue;
+
+      const size_t nRow = rowBytes(nPassW[i]) + 1;
+      for (uint32_t y = 0; y < nPassH[i]; y++, row += nRow)
+      {
+        if (!unfilter(row[0], row + 1, y ? row + 1 - nRow : vZero.data(), nRow - 1))
+          return tDX::FAIL;
+
+        expand(row + 1, vRow.data(), nPassW[i]);
+        Pixel* dst = pColData + (size_t)(nPassY[i] + y * nStepY[i]) * w + nPassX[i];
+        for (uint32_t x = 0; x < nPassW[i]; x++)
+          dst[x * nStepX[i]] = vRow[x];
+      }
+    }
+
+    return tDX::OK;
+  }
+
+  tDX::rcode Sprite::DecodeQOI(const uint8_t* pData, size_t nSize)
+  {
+    // 14 byte header, the stream ends with 8 bytes of padding
+    if (nSize < 22) return tDX::FAIL;
+
+    auto be32 = [](const uint8_t* b) { return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3]; };
+    const uint32_t w = be32(pData + 4), h = be32(pData + 8);
+    if ((pData[12] != 3 && pData[12] != 4) || pData[13] > 1)
+      return tDX::FAIL;
+    if (w == 0 || h == 0 || w > (1u << 24) || h > (1u << 24) || (uint64_t)w * h > (1u << 28))
+      return tDX::FAIL;
+
+    Resize((int32_t)w, (int32_t)h);
+    DiscardContents();
+    if (!pColData) return tDX::FAIL;
+
+    // Every pixel is written in order, previously seen ones are kept by hash
+    Pixel seen[64];
+    std::fill_n(seen, 64, Pixel(0, 0, 0, 0));
+    Pixel px(0, 0, 0, 255);
+
+    const uint8_t* p = pData + 14;
+    const uint8_t* pEnd = pData + nSize - 8;
+    Pixel* dst = pColData;
+    const size_t nPixels = (size_t)w * h;
+
+    for (size_t i = 0; i < nPixels;)
+    {
+      if (p >= pEnd) return tDX::FAIL;
+      const uint8_t op = *p++;
+      size_t nRun = 1;
+
+      if (op == 0xFE)
+      {
+        if (pEnd - p < 3) return tDX::FAIL;
+        px = Pixel(p[0], p[1], p[2], px.a);
+        p += 3;
+      }
+      else if (op == 0xFF)
+      {
+        if (pEnd - p < 4) return tDX::FAIL;
+        px = Pixel(p[0], p[1], p[2], p[3]);
+        p += 4;
+      }
+      else
+        switch (op >> 6)
+        {
+        case 0:
+          px = seen[op];
+          break;
+        case 1:
+          px.r = (uint8_t)(px.r + ((op >> 4) & 3) - 2);
+          px.g = (uint8_t)(px.g + ((op >> 2) & 3) - 2);
+          px.b = (uint8_t)(px.b + (op & 3) - 2);
+          break;
+        case 2:
+        {
+          if (p >= pEnd) return tDX::FAIL;
+          const int dg = (op & 0x3F) - 32;
+          const uint8_t next = *p++;
+          px.r = (uint8_t)(px.r + dg - 8 + (next >> 4));
+          px.g = (uint8_t)(px.g + dg);
+          px.b = (uint8_t)(px.b + dg - 8 + (next & 0x0F));
+          break;
+        }
+        default:
+          nRun = std::min<size_t>((op & 0x3F) + 1, nPixels - i);
+          break;
+        }
+
+      seen[(px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) & 63] = px;
+      std::fill_n(dst + i, nRun, px);
+      i += nRun;
+    }
+
+    return tDX::OK;
+  }
+
+  std::vector<tDX::rcode> Sprite::LoadFromFiles(const std::vector<std::string>& vFiles, std::vector<Sprite>& vSprites, uint32_t nThreads, tDX::ResourcePack *pack)
+  {
+    vSprites.resize(vFiles.size());
+    std::vector<tDX::rcode> vResults(vFiles.size(), tDX::FAIL);
+
+    if (nThreads == 0)
+      nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    ThreadPool pool(std::max(std::min(nThreads, (uint32_t)vFiles.size()), 1u));
+
+    // Files are taken one at a time by whichever thread is free. A pack reads
+    // them from one stream, which only one thread may use at once.
+    std::mutex mtxPack;
+    pool.ParallelFor((uint32_t)vFiles.size(), [&](uint32_t i)
+    {
+      std::vector<char> vData;
+      bool bRead;
+      {
+        std::unique_lock<std::mutex> lock(mtxPack, std::defer_lock);
+        if (pack != nullptr) lock.lock();
+        bRead = ReadImageFile(vFiles[i], pack, vData);
+      }
+
+      vResults[i] = bRead ? vSprites[i].LoadFromMemory((const uint8_t*)vData.data(), vData.size()) : tDX::NO_FILE;
+    });
+
+    return vResults;
+  }
+
+  void Sprite::SetSampleMode(tDX::Sprite::Mode mode)
+  {
+    modeSample = mode;
+  }
+
+  tDX::Sprite::Mode Sprite::GetSampleMode() const
+  {
+    return modeSample;
+  }
+
+
+  Pixel Sprite::GetPixel(int32_t x, int32_t y)
+  {
+    if (bFillPending) ResolvePendingFill();
+
+    if (modeSample == tDX::Sprite::Mode::NORMAL)
+    {
+      if (x >= 0 && x < width && y >= 0 && y < height)
+        return pColData[Offset(x, y)];
+      else
+        return Pixel(0, 0, 0, 0);
+    }
+    else
+    {
+      return pColData[Offset(abs(x%width), abs(y%height))];
+    }
+  }
 
   bool Sprite::SetPixel(int32_t x, int32_t y, Pixel p)
   {
 
-#ifdef T_DBG_OVERDRAW
-    nOverdrawCount++;
+#ifdef T_DBG_OVERDRAW
+    nOverdrawCount++;
+#endif
+
+    if (bFillPending) ResolvePendingFill();
+
+    // This check is too expensive
+    //if (x >= 0 && x < width && y >= 0 && y < height)
+    //{
+      pColData[Offset(x, y)] = p;
+      return true;
+    //}
+    //else
+    //  return false;
+  }
+
+  Pixel Sprite::Sample(float x, float y)
+  {
+    int32_t sx = std::min((int32_t)((x * (float)width)), width - 1);
+    int32_t sy = std::min((int32_t)((y * (float)height)), height - 1);
+    return GetPixel(sx, sy);
+  }
+
+  Pixel Sprite::SampleBL(float u, float v)
+  {
+    u = u * width - 0.5f;
+    v = v * height - 0.5f;
+    int x = (int)floor(u); // cast to int rounds toward zero, not downward
+    int y = (int)floor(v); // Thanks @joshinils
+    float u_ratio = u - x;
+    float v_ratio = v - y;
+    float u_opposite = 1 - u_ratio;
+    float v_opposite = 1 - v_ratio;
+
+    tDX::Pixel p1 = GetPixel(std::max(x, 0), std::max(y, 0));
+    tDX::Pixel p2 = GetPixel(std::min(x + 1, (int)width - 1), std::max(y, 0));
+    tDX::Pixel p3 = GetPixel(std::max(x, 0), std::min(y + 1, (int)height - 1));
+    tDX::Pixel p4 = GetPixel(std::min(x + 1, (int)width - 1), std::min(y + 1, (int)height - 1));
+
+    return tDX::Pixel(
+      (uint8_t)((p1.r * u_opposite + p2.r * u_ratio) * v_opposite + (p3.r * u_opposite + p4.r * u_ratio) * v_ratio),
+      (uint8_t)((p1.g * u_opposite + p2.g * u_ratio) * v_opposite + (p3.g * u_opposite + p4.g * u_ratio) * v_ratio),
+      (uint8_t)((p1.b * u_opposite + p2.b * u_ratio) * v_opposite + (p3.b * u_opposite + p4.b * u_ratio) * v_ratio));
+  }
+
+  void Sprite::GenerateMipmaps()
+  {
+    ReleaseMipmaps();
+    if (!GetData()) return;
+
+    // Halved until 1x1, odd sizes drop their last row or column
+    for (int32_t w = width, h = height; w > 1 || h > 1; )
+    {
+      w = std::max(w / 2, 1);
+      h = std::max(h / 2, 1);
+      vMips.push_back({ w, h, vMips.empty() ? 0 : vMips.back().nOffset + (size_t)vMips.back().width * vMips.back().height });
+    }
+
+    if (vMips.empty()) return;
+    pMipData = (Pixel*)SurfacePool::Allocate(MipPixels() * sizeof(Pixel));
+
+    // Each level is the average of 2x2 pixels of the one above
+    for (int32_t level = 1; level <= (int32_t)vMips.size(); level++)
+    {
+      const Texels src = GetMipLevel(level - 1);
+      Pixel* dst = pMipData + vMips[level - 1].nOffset;
+      const int32_t w = vMips[level - 1].width, h = vMips[level - 1].height;
+
+      auto fetch = [&](int32_t x, int32_t y)
+      {
+        x = std::min(x, src.width - 1);
+        y = std::min(y, src.height - 1);
+        return src.pData[src.bTiled ? TiledOffset(x, y, src.width) : (size_t)y * src.width + x];
+      };
+
+      for (int32_t y = 0; y < h; y++)
+        for (int32_t x = 0; x < w; x++)
+        {
+          const Pixel p00 = fetch(2 * x, 2 * y), p10 = fetch(2 * x + 1, 2 * y);
+          const Pixel p01 = fetch(2 * x, 2 * y + 1), p11 = fetch(2 * x + 1, 2 * y + 1);
+
+          dst[y * w + x] = Pixel(
+            (uint8_t)((p00.r + p10.r + p01.r + p11.r + 2) >> 2),
+            (uint8_t)((p00.g + p10.g + p01.g + p11.g + 2) >> 2),
+            (uint8_t)((p00.b + p10.b + p01.b + p11.b + 2) >> 2),
+            (uint8_t)((p00.a + p10.a + p01.a + p11.a + 2) >> 2));
+        }
+    }
+  }
+
+  int32_t Sprite::GetMipLevels() const
+  {
+    return 1 + (int32_t)vMips.size();
+  }
+
+  void Sprite::ReleaseMipmaps()
+  {
+    SurfacePool::Free(pMipData, MipPixels() * sizeof(Pixel));
+    pMipData = nullptr;
+    vMips.clear();
+  }
+
+  size_t Sprite::MipPixels() const
+  {
+    return vMips.empty() ? 0 : vMips.back().nOffset + (size_t)vMips.back().width * vMips.back().height;
+  }
+
+  Sprite::Texels Sprite::GetMipLevel(int32_t level)
+  {
+    if (level == 0)
+      return { GetData(), width, height, layoutData == Layout::TILED };
+
+    const MipLevel& mip = vMips[level - 1];
+    return { pMipData + mip.nOffset, mip.width, mip.height, false };
+  }
+
+  void Sprite::SampleBatch(const float* u, const float* v, int32_t count, Pixel* out, Filter filter, float lod)
+  {
+    if (count <= 0 || !GetData()) return;
+
+    const float fLevel = std::min(std::max(lod, 0.0f), (float)(GetMipLevels() - 1));
+    const int32_t nLevel = (int32_t)fLevel;
+
+    if (filter != Filter::TRILINEAR || fLevel == (float)nLevel)
+    {
+      // The nearest level
+      const int32_t nNearest = filter == Filter::TRILINEAR ? nLevel : (int32_t)(fLevel + 0.5f);
+      SampleLevel(GetMipLevel(nNearest), u, v, count, out, filter != Filter::NEAREST);
+      return;
+    }
+
+    // Both levels in blocks, so the second one fits on the stack
+    const Texels fine = GetMipLevel(nLevel), coarse = GetMipLevel(nLevel + 1);
+    const uint32_t nWeight = (uint32_t)((fLevel - (float)nLevel) * 256.0f);
+
+    Pixel block[256];
+    for (int32_t i = 0; i < count; i += 256)
+    {
+      const int32_t n = std::min(count - i, 256);
+      SampleLevel(fine, u + i, v + i, n, out + i, true);
+      SampleLevel(coarse, u + i, v + i, n, block, true);
+      LerpPixels(out + i, block, n, nWeight);
+    }
+  }
+
+  // Both paths compute the same texel addresses and 8 bit weights and round the
+  // same, so a batch gives the same pixels whichever path sampled them
+  void Sprite::SampleLevel(const Texels& texels, const float* u, const float* v, int32_t count, Pixel* out, bool bBilinear) const
+  {
+    const int32_t w = texels.width, h = texels.height;
+    const bool bWrap = modeSample == Mode::PERIODIC;
+    const float fOffset = bBilinear ? 0.5f : 0.0f;
+
+    auto fetch = [&](int32_t x, int32_t y)
+    {
+      return texels.pData[texels.bTiled ? TiledOffset(x, y, w) : (size_t)y * w + x].n;
+    };
+
+#if defined(T_PGE_SSE2)
+    // Power of two sizes wrap with a mask, others by subtracting whole sizes
+    const bool bMaskX = (w & (w - 1)) == 0, bMaskY = (h & (h - 1)) == 0;
+    const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+
+    auto floor4 = [&](__m128 x)
+    {
+      const __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+      return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), one));
+    };
+
+    // Integer texel coordinates of the pixels at i and i + 1 from the floored
+    // coordinate, in range
+    auto address = [&](__m128 i, int32_t size, bool bMask, __m128i& i0, __m128i& i1)
+    {
+      const __m128 fSize = _mm_set1_ps((float)size);
+
+      if (!bWrap)
+      {
+        const __m128 fMax = _mm_set1_ps((float)(size - 1));
+        i0 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(i, zero), fMax));
+        i1 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(i, one), zero), fMax));
+      }
+      else if (bMask)
+      {
+        const __m128i mask = _mm_set1_epi32(size - 1);
+        i0 = _mm_cvttps_epi32(i);
+        i1 = _mm_and_si128(_mm_add_epi32(i0, _mm_set1_epi32(1)), mask);
+        i0 = _mm_and_si128(i0, mask);
+      }
+      else
+      {
+        // Exact for whole numbers, the rounding of the division is fixed after
+        __m128 r = _mm_sub_ps(i, _mm_mul_ps(floor4(_mm_div_ps(i, fSize)), fSize));
+        r = _mm_sub_ps(r, _mm_and_ps(_mm_cmpge_ps(r, fSize), fSize));
+        r = _mm_add_ps(r, _mm_and_ps(_mm_cmplt_ps(r, zero), fSize));
+        __m128 r1 = _mm_add_ps(r, one);
+        r1 = _mm_andnot_ps(_mm_cmpge_ps(r1, fSize), r1);
+        i0 = _mm_cvttps_epi32(r);
+        i1 = _mm_cvttps_epi32(r1);
+      }
+    };
+
+    // Four coordinates at a time, the last ones padded
+    alignas(16) int32_t x0[4], x1[4], y0[4], y1[4];
+    for (int32_t i = 0; i < count; i += 4)
+    {
+      const int32_t n = std::min(count - i, 4);
+      __m128 fu, fv;
+      if (n == 4)
+      {
+        fu = _mm_loadu_ps(u + i);
+        fv = _mm_loadu_ps(v + i);
+      }
+      else
+      {
+        float pu[4] = {}, pv[4] = {};
+        std::copy_n(u + i, n, pu);
+        std::copy_n(v + i, n, pv);
+        fu = _mm_loadu_ps(pu);
+        fv = _mm_loadu_ps(pv);
+      }
+
+      const __m128 fx = _mm_sub_ps(_mm_mul_ps(fu, _mm_set1_ps((float)w)), _mm_set1_ps(fOffset));
+      const __m128 fy = _mm_sub_ps(_mm_mul_ps(fv, _mm_set1_ps((float)h)), _mm_set1_ps(fOffset));
+      const __m128 ix = floor4(fx), iy = floor4(fy);
+
+      __m128i vx0, vx1, vy0, vy1;
+      address(ix, w, bMaskX, vx0, vx1);
+      address(iy, h, bMaskY, vy0, vy1);
+      _mm_store_si128((__m128i*)x0, vx0); _mm_store_si128((__m128i*)x1, vx1);
+      _mm_store_si128((__m128i*)y0, vy0); _mm_store_si128((__m128i*)y1, vy1);
+
+      __m128i result;
+      if (!bBilinear)
+      {
+        result = _mm_setr_epi32(fetch(x0[0], y0[0]), fetch(x0[1], y0[1]), fetch(x0[2], y0[2]), fetch(x0[3], y0[3]));
+      }
+      else
+      {
+        const __m128 scale = _mm_set1_ps(256.0f);
+        const __m128i vwx = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(fx, ix), scale));
+        const __m128i vwy = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(fy, iy), scale));
+
+        const __m128i p00 = _mm_setr_epi32(fetch(x0[0], y0[0]), fetch(x0[1], y0[1]), fetch(x0[2], y0[2]), fetch(x0[3], y0[3]));
+        const __m128i p10 = _mm_setr_epi32(fetch(x1[0], y0[0]), fetch(x1[1], y0[1]), fetch(x1[2], y0[2]), fetch(x1[3], y0[3]));
+        const __m128i p01 = _mm_setr_epi32(fetch(x0[0], y1[0]), fetch(x0[1], y1[1]), fetch(x0[2], y1[2]), fetch(x0[3], y1[3]));
+        const __m128i p11 = _mm_setr_epi32(fetch(x1[0], y1[0]), fetch(x1[1], y1[1]), fetch(x1[2], y1[2]), fetch(x1[3], y1[3]));
+
+        // Weight of each coordinate in all four channels of its pixel, 16 bits
+        // per channel with two pixels in a register
+        auto spread = [](__m128i weights, __m128i& lo, __m128i& hi)
+        {
+          const __m128i w16 = _mm_packs_epi32(weights, weights);
+          const __m128i pairs = _mm_unpacklo_epi16(w16, w16);
+          lo = _mm_unpacklo_epi32(pairs, pairs);
+          hi = _mm_unpackhi_epi32(pairs, pairs);
+        };
+
+        // (a * (256 - t) + b * t + 128) >> 8 stays below 65536
+        auto lerp = [](__m128i a, __m128i b, __m128i t)
+        {
+          const __m128i s = _mm_sub_epi16(_mm_set1_epi16(256), t);
+          const __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(a, s), _mm_mullo_epi16(b, t)), _mm_set1_epi16(128));
+          return _mm_srli_epi16(sum, 8);
+        };
+
+        __m128i wxLo, wxHi, wyLo, wyHi;
+        spread(vwx, wxLo, wxHi);
+        spread(vwy, wyLo, wyHi);
+
+        const __m128i z = _mm_setzero_si128();
+        const __m128i lo = lerp(
+          lerp(_mm_unpacklo_epi8(p00, z), _mm_unpacklo_epi8(p10, z), wxLo),
+          lerp(_mm_unpacklo_epi8(p01, z), _mm_unpacklo_epi8(p11, z), wxLo), wyLo);
+        const __m128i hi = lerp(
+          lerp(_mm_unpackhi_epi8(p00, z), _mm_unpackhi_epi8(p10, z), wxHi),
+          lerp(_mm_unpackhi_epi8(p01, z), _mm_unpackhi_epi8(p11, z), wxHi), wyHi);
+        result = _mm_packus_epi16(lo, hi);
+      }
+
+      if (n == 4)
+        _mm_storeu_si128((__m128i*)(out + i), result);
+      else
+      {
+        Pixel block[4];
+        _mm_storeu_si128((__m128i*)block, result);
+        std::copy_n(block, n, out + i);
+      }
+    }
+#else
+    auto address = [&](float f, int32_t size, int32_t& i0, int32_t& i1)
+    {
+      if (!bWrap)
+      {
+        i0 = (int32_t)std::min(std::max(f, 0.0f), (float)(size - 1));
+        i1 = (int32_t)std::min(std::max(f + 1.0f, 0.0f), (float)(size - 1));
+      }
+      else
+      {
+        i0 = (int32_t)(f - std::floor(f / size) * size);
+        i0 = i0 >= size ? i0 - size : (i0 < 0 ? i0 + size : i0);
+        i1 = i0 + 1 == size ? 0 : i0 + 1;
+      }
+    };
+
+    auto lerp = [](uint32_t a, uint32_t b, uint32_t t) { return (a * (256 - t) + b * t + 128) >> 8; };
+
+    for (int32_t i = 0; i < count; i++)
+    {
+      const float fx = u[i] * w - fOffset, fy = v[i] * h - fOffset;
+      const float ix = std::floor(fx), iy = std::floor(fy);
+
+      int32_t x0, x1, y0, y1;
+      address(ix, w, x0, x1);
+      address(iy, h, y0, y1);
+
+      if (!bBilinear)
+      {
+        out[i].n = fetch(x0, y0);
+        continue;
+      }
+
+      const uint32_t wx = (uint32_t)((fx - ix) * 256.0f), wy = (uint32_t)((fy - iy) * 256.0f);
+      const Pixel p00(fetch(x0, y0)), p10(fetch(x1, y0)), p01(fetch(x0, y1)), p11(fetch(x1, y1));
+
+      auto channel = [&](uint8_t c00, uint8_t c10, uint8_t c01, uint8_t c11)
+      {
+        return (uint8_t)lerp(lerp(c00, c10, wx), lerp(c01, c11, wx), wy);
+      };
+
+      out[i] = Pixel(channel(p00.r, p10.r, p01.r, p11.r), channel(p00.g, p10.g, p01.g, p11.g),
+        channel(p00.b, p10.b, p01.b, p11.b), channel(p00.a, p10.a, p01.a, p11.a));
+    }
+#endif
+  }
+
+  void Sprite::LerpPixels(Pixel* a, const Pixel* b, int32_t count, uint32_t weight)
+  {
+    int32_t i = 0;
+
+#if defined(T_PGE_SSE2)
+    const __m128i t = _mm_set1_epi16((short)weight), s = _mm_set1_epi16((short)(256 - weight));
+    const __m128i half = _mm_set1_epi16(128), z = _mm_setzero_si128();
+
+    for (; i < (count & ~3); i += 4)
+    {
+      const __m128i pa = _mm_loadu_si128((const __m128i*)(a + i)), pb = _mm_loadu_si128((const __m128i*)(b + i));
+      const __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, z), s), _mm_mullo_epi16(_mm_unpacklo_epi8(pb, z), t)), half), 8);
+      const __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, z), s), _mm_mullo_epi16(_mm_unpackhi_epi8(pb, z), t)), half), 8);
+      _mm_storeu_si128((__m128i*)(a + i), _mm_packus_epi16(lo, hi));
+    }
 #endif
 
-    // This check is too expensive
-    //if (x >= 0 && x < width && y >= 0 && y < height)
-    //{
-      pColData[y*width + x] = p;
-      return true;
-    //}
-    //else
-    //  return false;
+    for (; i < count; i++)
+    {
+      auto lerp = [&](uint8_t ca, uint8_t cb) { return (uint8_t)((ca * (256 - weight) + cb * weight + 128) >> 8); };
+      a[i] = Pixel(lerp(a[i].r, b[i].r), lerp(a[i].g, b[i].g), lerp(a[i].b, b[i].b), lerp(a[i].a, b[i].a));
+    }
   }
 
-  Pixel Sprite::Sample(float x, float y)
+  Pixel* Sprite::GetData()
   {
-    int32_t sx = std::min((int32_t)((x * (float)width)), width - 1);
-    int32_t sy = std::min((int32_t)((y * (float)height)), height - 1);
-    return GetPixel(sx, sy);
+    if (bFillPending) ResolvePendingFill();
+    return pColData;
   }
 
-  Pixel Sprite::SampleBL(float u, float v)
+  void Sprite::EnableDepth(bool bEnable)
   {
-    u = u * width - 0.5f;
-    v = v * height - 0.5f;
-    int x = (int)floor(u); // cast to int rounds toward zero, not downward
-    int y = (int)floor(v); // Thanks @joshinils
-    float u_ratio = u - x;
-    float v_ratio = v - y;
-    float u_opposite = 1 - u_ratio;
-    float v_opposite = 1 - v_ratio;
+    if (!bEnable)
+    {
+      SurfacePool::Free(pDepthData, (size_t)width * height * sizeof(float));
+      pDepthData = nullptr;
+    }
+    else if (!pDepthData)
+    {
+      pDepthData = (float*)SurfacePool::Allocate((size_t)width * height * sizeof(float));
+      std::fill_n(pDepthData, width * height, 1.0f);
+    }
+  }
 
-    tDX::Pixel p1 = GetPixel(std::max(x, 0), std::max(y, 0));
-    tDX::Pixel p2 = GetPixel(std::min(x + 1, (int)width - 1), std::max(y, 0));
-    tDX::Pixel p3 = GetPixel(std::max(x, 0), std::min(y + 1, (int)height - 1));
-    tDX::Pixel p4 = GetPixel(std::min(x + 1, (int)width - 1), std::min(y + 1, (int)height - 1));
+  float* Sprite::GetDepthData() { return pDepthData; }
 
-    return tDX::Pixel(
-      (uint8_t)((p1.r * u_opposite + p2.r * u_ratio) * v_opposite + (p3.r * u_opposite + p4.r * u_ratio) * v_ratio),
-      (uint8_t)((p1.g * u_opposite + p2.g * u_ratio) * v_opposite + (p3.g * u_opposite + p4.g * u_ratio) * v_ratio),
-      (uint8_t)((p1.b * u_opposite + p2.b * u_ratio) * v_opposite + (p3.b * u_opposite + p4.b * u_ratio) * v_ratio));
+  void Sprite::MarkDirty(int32_t x, int32_t y, int32_t w, int32_t h)
+  {
+    if (vDirtyRows.empty()) return;
+
+    int32_t x2 = std::min(x + w, width);
+    int32_t y2 = std::min(y + h, height);
+    x = std::max(x, 0);
+    y = std::max(y, 0);
+    if (x >= x2) return;
+
+    for (; y < y2; y++)
+    {
+      DirtySpan& row = vDirtyRows[y];
+      row.x0 = std::min(row.x0, x);
+      row.x1 = std::max(row.x1, x2);
+    }
+  }
+
+  void Sprite::GetDirtySpan(int32_t y, int32_t& x0, int32_t& x1) const
+  {
+    if (vDirtyRows.empty())
+    {
+      x0 = 0; x1 = width;
+      return;
+    }
+
+    x0 = vDirtyRows[y].x0;
+    x1 = vDirtyRows[y].x1;
+  }
+
+  void Sprite::ResetDirty()
+  {
+    vDirtyRows.assign(height, DirtySpan{ width, 0 });
   }
 
-  Pixel* Sprite::GetData() { return pColData; }
+  void Sprite::PremultiplyAlpha()
+  {
+    if (bPremultiplied || !GetData()) return;
+
+    // Blank pixels padding TILED storage stay blank
+    for (size_t i = 0; i < StoragePixels(layoutData); i++)
+    {
+      Pixel& p = pColData[i];
+      p = Pixel((uint8_t)((p.r * p.a + 127) / 255), (uint8_t)((p.g * p.a + 127) / 255), (uint8_t)((p.b * p.a + 127) / 255), p.a);
+    }
+
+    bPremultiplied = true;
+    MarkDirty(0, 0, width, height);
+  }
+
+  bool Sprite::IsPremultiplied() const
+  {
+    return bPremultiplied;
+  }
 
   //==========================================================
   // Resource Packs - Allows you to store files in one large
@@ -820,78 +2709,297 @@ namespace tDX
       ofs.write((char*)&nPathSize, sizeof(uint32_t));
       ofs.write(e.first.c_str(), nPathSize);
 
-      // Write the file entry properties
-      ofs.write((char*)&e.second.nSize, sizeof(uint32_t));
-      ofs.write((char*)&e.second.nOffset, sizeof(uint32_t));
-    }
+      // Write the file entry properties
+      ofs.write((char*)&e.second.nSize, sizeof(uint32_t));
+      ofs.write((char*)&e.second.nOffset, sizeof(uint32_t));
+    }
+
+    // 2) Write the individual Data
+    std::streampos offset = ofs.tellp();
+    nIndexSize = (uint32_t)offset;
+    for (auto &e : mapFiles)
+    {
+      // Store beginning of file offset within resource pack file
+      e.second.nOffset = (uint32_t)offset;
+
+      // Load the file to be added
+      std::vector<char> vBuffer(e.second.nSize);
+      std::ifstream i(e.first, std::ifstream::binary);
+      i.read(vBuffer.data(), e.second.nSize);
+      i.close();
+
+      // Write the loaded file into resource pack file
+      ofs.write(vBuffer.data(), e.second.nSize);
+      offset += e.second.nSize;
+    }
+
+    // 3) Scramble Index
+    std::stringstream oss;
+    oss.write((char*)&nMapSize, sizeof(uint32_t));
+    for (auto &e : mapFiles)
+    {
+      // Write the path of the file
+      size_t nPathSize = e.first.size();
+      oss.write((char*)&nPathSize, sizeof(uint32_t));
+      oss.write(e.first.c_str(), nPathSize);
+
+      // Write the file entry properties
+      oss.write((char*)&e.second.nSize, sizeof(uint32_t));
+      oss.write((char*)&e.second.nOffset, sizeof(uint32_t));
+    }
+    std::string sIndexString = scramble(oss.str(), sKey);
+
+    // 4) Rewrite Map (it has been updated with offsets now)
+    // at start of file
+    ofs.seekp(std::ios::beg);
+    ofs.write((char*)&nIndexSize, sizeof(uint32_t));
+    ofs.write(sIndexString.c_str(), nIndexSize);
+    ofs.close();
+    return true;
+  }
+
+  ResourceBuffer ResourcePack::GetFileBuffer(const std::string& sFile)
+  {
+    return ResourceBuffer(baseFile, mapFiles[sFile].nOffset, mapFiles[sFile].nSize);
+  }
+
+  bool ResourcePack::Loaded()
+  {
+    return baseFile.is_open();
+  }
+
+  const std::string ResourcePack::scramble(const std::string& data, const std::string& key)
+  {
+    size_t c = 0; std::string o;
+    for (auto s : data)	o += std::string(1, s ^ key[(c++) % key.size()]);
+    return o;
+  };
+
+  std::string ResourcePack::makeposix(const std::string& path)
+  {
+    std::string o;
+    for (auto s : path) o += std::string(1, s == '\\' ? '/' : s);
+    return o;
+  };
+
+  //==========================================================
+  // Profiling - Rolling per zone timings of the frame
+
+  ProfileZone::ProfileZone(const std::string& sZoneName, const bool* pEnabled)
+  {
+    sName = sZoneName;
+    bEnabled = pEnabled;
+    vSamples.reserve(nWindowSize);
+  }
+
+  void ProfileZone::AddSample(float fMicroseconds)
+  {
+    if (vSamples.size() < nWindowSize)
+      vSamples.push_back(fMicroseconds);
+    else
+      vSamples[nNext] = fMicroseconds;
+
+    nNext = (nNext + 1) % nWindowSize;
+  }
+
+  float ProfileZone::Percentile(float p) const
+  {
+    if (vSamples.empty()) return 0.0f;
+
+    std::vector<float> sorted = vSamples;
+    size_t rank = (size_t)std::ceil(p / 100.0f * (float)sorted.size());
+    rank = std::min(std::max(rank, (size_t)1), sorted.size()) - 1;
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+  }
+
+  float ProfileZone::Min() const
+  {
+    return vSamples.empty() ? 0.0f : *std::min_element(vSamples.begin(), vSamples.end());
+  }
+
+  float ProfileZone::Max() const
+  {
+    return vSamples.empty() ? 0.0f : *std::max_element(vSamples.begin(), vSamples.end());
+  }
+
+  uint32_t ProfileZone::Samples() const
+  {
+    return (uint32_t)vSamples.size();
+  }
+
+  ProfileScope::ProfileScope(ProfileZone* zone)
+  {
+    if (zone && *zone->bEnabled)
+    {
+      pZone = zone;
+      tStart = std::chrono::steady_clock::now();
+    }
+  }
+
+  ProfileScope::~ProfileScope()
+  {
+    if (pZone)
+    {
+      std::chrono::duration<float, std::micro> elapsed = std::chrono::steady_clock::now() - tStart;
+      pZone->AddSample(elapsed.count());
+    }
+  }
+
+  ProfileZone* Profiler::Zone(const std::string& sName)
+  {
+    for (auto& zone : vZones)
+      if (zone->sName == sName)
+        return zone.get();
+
+    vZones.push_back(std::make_unique<ProfileZone>(sName, &bEnabled));
+    return vZones.back().get();
+  }
+
+  void Profiler::Enable(bool bEnable)
+  {
+    bEnabled = bEnable;
+  }
+
+  bool Profiler::Enabled() const
+  {
+    return bEnabled;
+  }
+
+  void Profiler::Report(std::ostream& os) const
+  {
+    os << "zone                 samples    min[us]    p50[us]    p99[us]    max[us]\n";
+    for (auto& zone : vZones)
+    {
+      if (zone->Samples() == 0) continue;
+
+      char line[128];
+      snprintf(line, sizeof(line), "%-20s %7u %10.1f %10.1f %10.1f %10.1f\n", zone->sName.c_str(), zone->Samples(),
+        zone->Min(), zone->Percentile(50.0f), zone->Percentile(99.0f), zone->Max());
+      os << line;
+    }
+  }
+
+  bool Profiler::SaveCSV(const std::string& sFile) const
+  {
+    std::ofstream ofs(sFile);
+    if (!ofs.is_open()) return false;
+
+    ofs << "zone,samples,min_us,p50_us,p99_us,max_us\n";
+    for (auto& zone : vZones)
+    {
+      if (zone->Samples() == 0) continue;
+
+      ofs << zone->sName << "," << zone->Samples() << "," << zone->Min() << "," << zone->Percentile(50.0f) << ","
+        << zone->Percentile(99.0f) << "," << zone->Max() << "\n";
+    }
+
+    return true;
+  }
+
+  //==========================================================
+  // Thread Pool - Workers sleep until a parallel loop is started
+
+  ThreadPool::ThreadPool(uint32_t nThreads)
+  {
+    if (nThreads == 0)
+      nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (uint32_t i = 1; i < nThreads; i++)
+      vWorkers.emplace_back(&ThreadPool::Worker, this);
+  }
 
-    // 2) Write the individual Data
-    std::streampos offset = ofs.tellp();
-    nIndexSize = (uint32_t)offset;
-    for (auto &e : mapFiles)
+  ThreadPool::~ThreadPool()
+  {
     {
-      // Store beginning of file offset within resource pack file
-      e.second.nOffset = (uint32_t)offset;
+      std::lock_guard<std::mutex> lock(mtxState);
+      bStop = true;
+    }
+    cvWork.notify_all();
 
-      // Load the file to be added
-      std::vector<char> vBuffer(e.second.nSize);
-      std::ifstream i(e.first, std::ifstream::binary);
-      i.read(vBuffer.data(), e.second.nSize);
-      i.close();
+    for (auto& worker : vWorkers)
+      worker.join();
+  }
 
-      // Write the loaded file into resource pack file
-      ofs.write(vBuffer.data(), e.second.nSize);
-      offset += e.second.nSize;
-    }
+  uint32_t ThreadPool::Threads() const
+  {
+    return (uint32_t)vWorkers.size() + 1;
+  }
 
-    // 3) Scramble Index
-    std::stringstream oss;
-    oss.write((char*)&nMapSize, sizeof(uint32_t));
-    for (auto &e : mapFiles)
+  void ThreadPool::ParallelFor(uint32_t nTaskCount, const std::function<void(uint32_t)>& task)
+  {
+    if (vWorkers.empty() || nTaskCount <= 1)
     {
-      // Write the path of the file
-      size_t nPathSize = e.first.size();
-      oss.write((char*)&nPathSize, sizeof(uint32_t));
-      oss.write(e.first.c_str(), nPathSize);
+      for (uint32_t i = 0; i < nTaskCount; i++)
+        task(i);
+      return;
+    }
 
-      // Write the file entry properties
-      oss.write((char*)&e.second.nSize, sizeof(uint32_t));
-      oss.write((char*)&e.second.nOffset, sizeof(uint32_t));
+    {
+      std::lock_guard<std::mutex> lock(mtxState);
+      pTask = &task;
+      nTasks = nTaskCount;
+      nNextTask = 0;
+      nBusyWorkers = (uint32_t)vWorkers.size();
+      nGeneration++;
     }
-    std::string sIndexString = scramble(oss.str(), sKey);
+    cvWork.notify_all();
 
-    // 4) Rewrite Map (it has been updated with offsets now)
-    // at start of file
-    ofs.seekp(std::ios::beg);
-    ofs.write((char*)&nIndexSize, sizeof(uint32_t));
-    ofs.write(sIndexString.c_str(), nIndexSize);
-    ofs.close();
-    return true;
+    RunTasks();
+
+    // Every worker has to check in, so none of them can still hold the task
+    std::unique_lock<std::mutex> lock(mtxState);
+    cvDone.wait(lock, [&]() { return nBusyWorkers == 0; });
+    pTask = nullptr;
   }
 
-  ResourceBuffer ResourcePack::GetFileBuffer(const std::string& sFile)
+  void ThreadPool::RunTasks()
   {
-    return ResourceBuffer(baseFile, mapFiles[sFile].nOffset, mapFiles[sFile].nSize);
+    for (uint32_t i = nNextTask++; i < nTasks; i = nNextTask++)
+      (*pTask)(i);
   }
 
-  bool ResourcePack::Loaded()
+  void ThreadPool::Worker()
   {
-    return baseFile.is_open();
+    uint64_t nSeen = 0;
+
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mtxState);
+        cvWork.wait(lock, [&]() { return bStop || nGeneration != nSeen; });
+        if (bStop) return;
+        nSeen = nGeneration;
+      }
+
+      RunTasks();
+
+      std::lock_guard<std::mutex> lock(mtxState);
+      if (--nBusyWorkers == 0)
+        cvDone.notify_one();
+    }
   }
 
-  const std::string ResourcePack::scramble(const std::string& data, const std::string& key)
+  //==========================================================
+  // Command List
+
+  void CommandList::Clear()
   {
-    size_t c = 0; std::string o;
-    for (auto s : data)	o += std::string(1, s ^ key[(c++) % key.size()]);
-    return o;
-  };
+    vCommands.clear();
+    vPixelModes.clear();
+    vTextures.clear();
+    vSprites.clear();
+  }
 
-  std::string ResourcePack::makeposix(const std::string& path)
+  bool CommandList::Empty() const
   {
-    std::string o;
-    for (auto s : path) o += std::string(1, s == '\\' ? '/' : s);
-    return o;
-  };
+    return vCommands.empty();
+  }
+
+  size_t CommandList::Size() const
+  {
+    return vCommands.size();
+  }
 
   //==========================================================
 
@@ -899,6 +3007,12 @@ namespace tDX
   {
     sAppName = "Undefined";
     tDX::PGEX::pge = this;
+
+    pZoneFrame = profiler.Zone("frame");
+    pZoneInput = profiler.Zone("input");
+    pZoneUpdate = profiler.Zone("update");
+    pZoneUpload = profiler.Zone("upload");
+    pZonePresent = profiler.Zone("present");
   }
 
   tDX::rcode PixelGameEngine::Construct(uint32_t screen_w, uint32_t screen_h, uint32_t pixel_w, uint32_t pixel_h, bool full_screen, bool vsync)
@@ -931,17 +3045,373 @@ namespace tDX
 
   void PixelGameEngine::SetScreenSize(int w, int h)
   {
-    delete pDefaultDrawTarget;
+    tDX_FlushTiles();
+
+    // Resized in place, so the depth buffer stays enabled
     nScreenWidth = w;
     nScreenHeight = h;
-    pDefaultDrawTarget = new Sprite(nScreenWidth, nScreenHeight);
+    pDefaultDrawTarget->Resize(nScreenWidth, nScreenHeight);
+    pDrawTarget = nullptr;
     SetDrawTarget(nullptr);
 
     tDX_UpdateViewport();
   }
 
+  void PixelGameEngine::EnableProfiling(const std::string& sCsvFile)
+  {
+    sProfileFile = sCsvFile;
+    profiler.Enable(true);
+  }
+
+  ProfileZone* PixelGameEngine::GetProfileZone(const std::string& sName)
+  {
+    return profiler.Zone(sName);
+  }
+
+  Profiler& PixelGameEngine::GetProfiler()
+  {
+    return profiler;
+  }
+
+  void PixelGameEngine::tDX_FinishProfiling()
+  {
+    if (!profiler.Enabled())
+      return;
+
+    profiler.Report(std::cout);
+
+    if (!sProfileFile.empty() && !profiler.SaveCSV(sProfileFile))
+      std::cout << "Failed to save profile to " << sProfileFile << std::endl;
+  }
+
+  void PixelGameEngine::SetRenderThreads(uint32_t nThreads, int32_t nSize)
+  {
+    tDX_FlushTiles();
+
+    if (nThreads == 0)
+      nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    // Multiple of the rasterizer's 8x8 blocks, so a block never spans two tiles
+    nRenderThreads = nThreads;
+    nTileSize = std::max((nSize + 7) & ~7, 8);
+
+    if (nRenderThreads > 1)
+      pThreadPool.reset(new ThreadPool(nRenderThreads));
+    else
+      pThreadPool.reset();
+
+    if (bTiling)
+      BeginTiles();
+  }
+
+  void PixelGameEngine::BeginTiles()
+  {
+    tDX_FlushTiles();
+
+    bTiling = pThreadPool && pDrawTarget;
+    if (!bTiling) return;
+
+    nTilesX = (pDrawTarget->width + nTileSize - 1) / nTileSize;
+    nTilesY = (pDrawTarget->height + nTileSize - 1) / nTileSize;
+    vTileBins.resize(nTilesX * nTilesY);
+  }
+
+  void PixelGameEngine::EndTiles()
+  {
+    tDX_FlushTiles();
+    bTiling = false;
+  }
+
+  void PixelGameEngine::BeginRecording(CommandList& list)
+  {
+    list.Clear();
+    pRecording = &list;
+    tDX_RecordState();
+  }
+
+  void PixelGameEngine::EndRecording()
+  {
+    pRecording = nullptr;
+  }
+
+  // Keeps the current draw target and pixel mode, unless the list already
+  // switched to them last
+  void PixelGameEngine::tDX_RecordState()
+  {
+    if (!pRecording) return;
+
+    Sprite* target = pDrawTarget == pDefaultDrawTarget ? nullptr : pDrawTarget;
+    const DrawCommand* pTarget = nullptr;
+    const DrawCommand* pMode = nullptr;
+    for (auto it = pRecording->vCommands.rbegin(); it != pRecording->vCommands.rend() && !(pTarget && pMode); ++it)
+    {
+      if (!pTarget && it->type == DrawCommand::TARGET) pTarget = &*it;
+      if (!pMode && it->type == DrawCommand::PIXEL_MODE) pMode = &*it;
+    }
+
+    if (!pTarget || pTarget->target != target)
+    {
+      DrawCommand cmd = {};
+      cmd.type = DrawCommand::TARGET;
+      cmd.target = target;
+      pRecording->vCommands.push_back(cmd);
+    }
+
+    // Custom functions cannot be compared, they are always kept
+    if (!pMode || nPixelMode == Pixel::Mode::CUSTOM || pMode->x1 != (int32_t)nPixelMode || pMode->vz[0] != fBlendFactor)
+    {
+      DrawCommand cmd = {};
+      cmd.type = DrawCommand::PIXEL_MODE;
+      cmd.x1 = (int32_t)nPixelMode;
+      cmd.vz[0] = fBlendFactor;
+      if (nPixelMode == Pixel::Mode::CUSTOM)
+      {
+        cmd.pattern = (uint32_t)pRecording->vPixelModes.size();
+        pRecording->vPixelModes.push_back(funcPixelMode);
+      }
+      pRecording->vCommands.push_back(cmd);
+    }
+  }
+
+  void PixelGameEngine::Replay(const CommandList& list)
+  {
+    // A list cannot be replayed into itself
+    if (&list == pRecording) return;
+
+    Sprite* pOldTarget = pDrawTarget;
+    Pixel::Mode nOldMode = nPixelMode;
+    float fOldBlend = fBlendFactor;
+    auto funcOldMode = funcPixelMode;
+
+    for (const DrawCommand& cmd : list.vCommands)
+    {
+      switch (cmd.type)
+      {
+      case DrawCommand::SPAN:
+        FillSpan(cmd.x1, cmd.y1, cmd.x2, cmd.col[0]);
+        break;
+      case DrawCommand::LINE:
+        DrawLine(cmd.x1, cmd.y1, cmd.x2, cmd.y2, cmd.col[0], cmd.pattern);
+        break;
+      case DrawCommand::TRIANGLE:
+        tDX_FillTriangle(cmd.vx, cmd.vy, cmd.vz, cmd.col, cmd.bSmooth, cmd.target ? &list.vTextures[cmd.pattern] : nullptr);
+        break;
+      case DrawCommand::CLEAR:
+        Clear(cmd.x1, cmd.y1, cmd.x2, cmd.y2, cmd.col[0]);
+        break;
+      case DrawCommand::CLEAR_DEPTH:
+        ClearDepth(cmd.x1, cmd.y1, cmd.x2, cmd.y2, cmd.vz[0]);
+        break;
+      case DrawCommand::PIXEL:
+        Draw(cmd.x1, cmd.y1, cmd.col[0]);
+        break;
+      case DrawCommand::TARGET:
+        SetDrawTarget(cmd.target);
+        break;
+      case DrawCommand::SPRITE:
+        DrawPartialSprite(cmd.x1, cmd.y1, &list.vSprites[cmd.ox], 0, 0, cmd.x2, cmd.y2, cmd.pattern);
+        break;
+      case DrawCommand::PIXEL_MODE:
+        if ((Pixel::Mode)cmd.x1 == Pixel::Mode::CUSTOM)
+          SetSpanShader(list.vPixelModes[cmd.pattern]);
+        else
+          SetPixelMode((Pixel::Mode)cmd.x1);
+        SetPixelBlend(cmd.vz[0]);
+        break;
+      }
+    }
+
+    SetDrawTarget(pOldTarget);
+    if (nOldMode == Pixel::Mode::CUSTOM)
+      SetSpanShader(funcOldMode);
+    else
+      SetPixelMode(nOldMode);
+    SetPixelBlend(fOldBlend);
+  }
+
+  PixelGameEngine::RasterState PixelGameEngine::tDX_TargetState() const
+  {
+    RasterState rs;
+    rs.target = pDrawTarget;
+    if (pDrawTarget)
+    {
+      rs.x1 = pDrawTarget->width;
+      rs.y1 = pDrawTarget->height;
+    }
+    return rs;
+  }
+
+  void PixelGameEngine::tDX_DeferCommand(const DrawCommand& cmd, int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+  {
+    if (pRecording)
+      pRecording->vCommands.push_back(cmd);
+    else
+      tDX_BinCommand(cmd, x0, y0, x1, y1);
+  }
+
+  void PixelGameEngine::tDX_BinCommand(const DrawCommand& cmd, int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+  {
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, pDrawTarget->width);
+    y1 = std::min(y1, pDrawTarget->height);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    // Marked here, the tiles are drawn by the workers
+    if (cmd.type != DrawCommand::CLEAR_DEPTH)
+      tDX_MarkDirty(x0, y0, x1, y1);
+
+    uint32_t nCommand = (uint32_t)vTileCommands.size();
+    vTileCommands.push_back(cmd);
+
+    for (int32_t ty = y0 / nTileSize; ty <= (y1 - 1) / nTileSize; ty++)
+      for (int32_t tx = x0 / nTileSize; tx <= (x1 - 1) / nTileSize; tx++)
+        vTileBins[ty * nTilesX + tx].push_back(nCommand);
+  }
+
+  void PixelGameEngine::tDX_MarkDirty(int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+  {
+    if (!pDrawTarget) return;
+
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, pDrawTarget->width);
+    y1 = std::min(y1, pDrawTarget->height);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    if (pDrawTarget == pDefaultDrawTarget)
+      nBytesTouched += (uint64_t)(x1 - x0) * (y1 - y0) * sizeof(Pixel);
+
+    pDrawTarget->MarkDirty(x0, y0, x1 - x0, y1 - y0);
+  }
+
+  // Neighbouring dirty rows whose spans overlap are sent as one box, the
+  // texture keeps everything else from the previous frames
+  void PixelGameEngine::tDX_UploadDirty()
+  {
+    Sprite* s = pDefaultDrawTarget;
+    int32_t y = 0;
+
+    while (y < s->height)
+    {
+      int32_t x0, x1;
+      s->GetDirtySpan(y, x0, x1);
+      if (x0 >= x1) { y++; continue; }
+
+      int32_t y0 = y;
+      for (y++; y < s->height; y++)
+      {
+        int32_t rx0, rx1;
+        s->GetDirtySpan(y, rx0, rx1);
+        if (rx0 >= rx1 || rx0 >= x1 || rx1 <= x0) break;
+        x0 = std::min(x0, rx0);
+        x1 = std::max(x1, rx1);
+      }
+
+      nBytesUploaded += (uint64_t)(x1 - x0) * (y - y0) * sizeof(Pixel);
+
+#ifndef T_PGE_HEADLESS
+      // Headless there is nothing to upload to, the bytes are only counted
+      if (!bHeadless)
+      {
+        D3D11_BOX box = { (UINT)x0, (UINT)y0, 0, (UINT)x1, (UINT)y, 1 };
+        m_d3dContext->UpdateSubresource(m_texture.Get(), 0, &box, s->GetData() + y0 * s->width + x0, s->width * sizeof(Pixel), 0);
+      }
+#endif
+    }
+
+    s->ResetDirty();
+  }
+
+  uint64_t PixelGameEngine::GetBytesTouched() const
+  {
+    return nBytesTouched;
+  }
+
+  uint64_t PixelGameEngine::GetBytesUploaded() const
+  {
+    return nBytesUploaded;
+  }
+
+  void PixelGameEngine::tDX_FlushTiles()
+  {
+    // Textures of triangles outside the target were kept without a command
+    if (vTileCommands.empty())
+    {
+      vTileTextures.clear();
+      return;
+    }
+
+    // A pending initial fill of the target happens here, not in all workers at once
+    pDrawTarget->GetData();
+
+    // Each tile is drawn by exactly one thread, which only writes inside it
+    pThreadPool->ParallelFor((uint32_t)vTileBins.size(), [this](uint32_t nTile) { tDX_DrawTile(nTile); });
+
+    vTileCommands.clear();
+    vTileTextures.clear();
+    for (auto& bin : vTileBins)
+      bin.clear();
+  }
+
+  void PixelGameEngine::tDX_DrawTile(uint32_t nTile)
+  {
+    RasterState rs;
+    rs.target = pDrawTarget;
+    rs.x0 = (nTile % nTilesX) * nTileSize;
+    rs.y0 = (nTile / nTilesX) * nTileSize;
+    rs.x1 = std::min(rs.x0 + nTileSize, pDrawTarget->width);
+    rs.y1 = std::min(rs.y0 + nTileSize, pDrawTarget->height);
+
+    // Commands keep their submission order within the tile
+    for (uint32_t i : vTileBins[nTile])
+    {
+      const DrawCommand& cmd = vTileCommands[i];
+      switch (cmd.type)
+      {
+      case DrawCommand::SPAN:
+        tDX_FillSpan(rs, cmd.x1, cmd.y1, cmd.x2, cmd.col[0]);
+        break;
+      case DrawCommand::LINE:
+        tDX_DrawLine(rs, cmd.x1, cmd.y1, cmd.x2, cmd.y2, cmd.col[0], cmd.pattern);
+        break;
+      case DrawCommand::TRIANGLE:
+        tDX_RasterTriangle(rs, cmd.vx, cmd.vy, cmd.vz, cmd.col, cmd.bSmooth, cmd.target ? &vTileTextures[cmd.pattern] : nullptr);
+        break;
+      case DrawCommand::CLEAR:
+        tDX_ClearRect(rs, cmd.x1, cmd.y1, cmd.x2, cmd.y2, cmd.col[0]);
+        break;
+      case DrawCommand::CLEAR_DEPTH:
+        tDX_ClearDepthRect(rs, cmd.x1, cmd.y1, cmd.x2, cmd.y2, cmd.vz[0]);
+        break;
+      case DrawCommand::PIXEL:
+        tDX_Plot(rs, cmd.x1, cmd.y1, cmd.col[0]);
+        break;
+      case DrawCommand::SPRITE:
+        tDX_BlitSprite(rs, cmd.x1, cmd.y1, cmd.target, cmd.ox, cmd.oy, cmd.x2, cmd.y2, cmd.pattern);
+        break;
+      default:
+        // State changes are never binned, they flush the tiles instead
+        break;
+      }
+    }
+  }
+
+  void PixelGameEngine::SetHeadless(uint32_t nFrames, float fFixedElapsedTime)
+  {
+    bHeadless = true;
+    nHeadlessFrames = nFrames;
+    fHeadlessElapsedTime = fFixedElapsedTime;
+  }
+
   tDX::rcode PixelGameEngine::Start()
   {
+    if (bHeadless)
+      return tDX_StartHeadless();
+
+#ifdef T_PGE_HEADLESS
+    return tDX::FAIL;
+#else
     // Create DirectX device
     tDX_DirectXCreateDevice();
 
@@ -1062,86 +3532,50 @@ namespace tDX
       {
         // Handle Timing
         tp2 = std::chrono::system_clock::now();
-        std::chrono::duration<float> elapsedTime = tp2 - tp1;
-        tp1 = tp2;
-
-        // Our time per frame coefficient
-        float fElapsedTime = elapsedTime.count();
-
-        // Handle resize if needed
-        if (bResize)
-        {
-          tDX_DirectXCreateResources();
-          bResize = false;
-        }
-
-        // Handle User Input - Keyboard
-        for (int i = 0; i < 256; i++)
-        {
-          pKeyboardState[i].bPressed = false;
-          pKeyboardState[i].bReleased = false;
-
-          if (pKeyNewState[i] != pKeyOldState[i])
-          {
-            if (pKeyNewState[i])
-            {
-              pKeyboardState[i].bPressed = !pKeyboardState[i].bHeld;
-              pKeyboardState[i].bHeld = true;
-            }
-            else
-            {
-              pKeyboardState[i].bReleased = true;
-              pKeyboardState[i].bHeld = false;
-            }
-          }
-
-          pKeyOldState[i] = pKeyNewState[i];
-        }
-
-        // Handle User Input - Mouse
-        for (int i = 0; i < 5; i++)
-        {
-          pMouseState[i].bPressed = false;
-          pMouseState[i].bReleased = false;
-
-          if (pMouseNewState[i] != pMouseOldState[i])
-          {
-            if (pMouseNewState[i])
-            {
-              pMouseState[i].bPressed = !pMouseState[i].bHeld;
-              pMouseState[i].bHeld = true;
-            }
-            else
-            {
-              pMouseState[i].bReleased = true;
-              pMouseState[i].bHeld = false;
-            }
-          }
+        std::chrono::duration<float> elapsedTime = tp2 - tp1;
+        tp1 = tp2;
+
+        // Our time per frame coefficient
+        float fElapsedTime = elapsedTime.count();
 
-          pMouseOldState[i] = pMouseNewState[i];
+        // Handle resize if needed
+        if (bResize)
+        {
+          tDX_DirectXCreateResources();
+          bResize = false;
         }
 
-        // Cache mouse coordinates so they remain
-        // consistent during frame
-        nMousePosX = nMousePosXcache;
-        nMousePosY = nMousePosYcache;
+        ProfileScope frameScope(pZoneFrame);
 
-        nMouseWheelDelta = nMouseWheelDeltaCache;
-        nMouseWheelDeltaCache = 0;
+        {
+          ProfileScope scope(pZoneInput);
+          tDX_UpdateInputState();
+        }
 
 #ifdef T_DBG_OVERDRAW
         tDX::Sprite::nOverdrawCount = 0;
 #endif
 
         // Handle Frame Update
-        if (!OnUserUpdate(fElapsedTime))
-          bActive = false;
+        {
+          ProfileScope scope(pZoneUpdate);
+          if (!OnUserUpdate(fElapsedTime))
+            bActive = false;
+
+          // Tiles still open are drawn before the frame is shown
+          EndTiles();
+        }
 
-        // TODO: UpdateSubresource is not optimal here, Map would be better
-        m_d3dContext->UpdateSubresource(m_texture.Get(), 0, NULL, pDefaultDrawTarget->GetData(), pDefaultDrawTarget->width * 4, 0);
+        {
+          ProfileScope scope(pZoneUpload);
+          tDX_UploadDirty();
+        }
 
-        m_d3dContext->DrawIndexed(6, 0, 0);
-        m_swapChain->Present(0, 0);
+        {
+          ProfileScope scope(pZonePresent);
+          m_d3dContext->DrawIndexed(6, 0, 0);
+          m_swapChain->Present(0, 0);
+        }
 
         // Update Title Bar
         fFrameTimer += fElapsedTime;
@@ -1167,6 +3601,7 @@ namespace tDX
     }
 
     OnUserDestroy();
+    tDX_FinishProfiling();
 
     // Finish rendering
     ID3D11RenderTargetView* nullViews[] = { nullptr };
@@ -1181,18 +3616,156 @@ namespace tDX
     CoUninitialize();
 
     return tDX::OK;
+#endif
+  }
+
+  tDX::rcode PixelGameEngine::tDX_StartHeadless()
+  {
+    // Same frame loop as the windowed one, but the frame is left in
+    // pDefaultDrawTarget instead of being uploaded and presented
+    bActive = OnUserCreate();
+
+    auto tStart = std::chrono::steady_clock::now();
+    auto tp1 = tStart;
+    auto tp2 = tStart;
+    uint32_t nFramesDone = 0;
+
+    while (bActive && (nHeadlessFrames == 0 || nFramesDone < nHeadlessFrames))
+    {
+      // Handle Timing
+      tp2 = std::chrono::steady_clock::now();
+      std::chrono::duration<float> elapsedTime = tp2 - tp1;
+      tp1 = tp2;
+
+      float fElapsedTime = fHeadlessElapsedTime > 0.0f ? fHeadlessElapsedTime : elapsedTime.count();
+
+      ProfileScope frameScope(pZoneFrame);
+
+      {
+        ProfileScope scope(pZoneInput);
+        tDX_UpdateInputState();
+      }
+
+#ifdef T_DBG_OVERDRAW
+      tDX::Sprite::nOverdrawCount = 0;
+#endif
+
+      // Handle Frame Update
+      {
+        ProfileScope scope(pZoneUpdate);
+        if (!OnUserUpdate(fElapsedTime))
+          bActive = false;
+
+        // Tiles still open are drawn before the frame is shown
+        EndTiles();
+      }
+
+      {
+        ProfileScope scope(pZoneUpload);
+        tDX_UploadDirty();
+      }
+
+      nFramesDone++;
+    }
+
+    std::chrono::duration<double> totalTime = std::chrono::steady_clock::now() - tStart;
+
+    OnUserDestroy();
+
+    double fSeconds = totalTime.count();
+    std::cout << "tucna.net - Pixel Game Engine - " << sAppName << " - headless: " << nFramesDone << " frames in "
+      << fSeconds << " s, FPS: " << (fSeconds > 0.0 ? nFramesDone / fSeconds : 0.0) << std::endl;
+    std::cout << "Bytes touched: " << nBytesTouched << ", uploaded: " << nBytesUploaded << std::endl;
+
+    tDX_FinishProfiling();
+
+    return tDX::OK;
+  }
+
+  void PixelGameEngine::tDX_UpdateInputState()
+  {
+    // Handle User Input - Keyboard
+    for (int i = 0; i < 256; i++)
+    {
+      pKeyboardState[i].bPressed = false;
+      pKeyboardState[i].bReleased = false;
+
+      if (pKeyNewState[i] != pKeyOldState[i])
+      {
+        if (pKeyNewState[i])
+        {
+          pKeyboardState[i].bPressed = !pKeyboardState[i].bHeld;
+          pKeyboardState[i].bHeld = true;
+        }
+        else
+        {
+          pKeyboardState[i].bReleased = true;
+          pKeyboardState[i].bHeld = false;
+        }
+      }
+
+      pKeyOldState[i] = pKeyNewState[i];
+    }
+
+    // Handle User Input - Mouse
+    for (int i = 0; i < 5; i++)
+    {
+      pMouseState[i].bPressed = false;
+      pMouseState[i].bReleased = false;
+
+      if (pMouseNewState[i] != pMouseOldState[i])
+      {
+        if (pMouseNewState[i])
+        {
+          pMouseState[i].bPressed = !pMouseState[i].bHeld;
+          pMouseState[i].bHeld = true;
+        }
+        else
+        {
+          pMouseState[i].bReleased = true;
+          pMouseState[i].bHeld = false;
+        }
+      }
+
+      pMouseOldState[i] = pMouseNewState[i];
+    }
+
+    // Cache mouse coordinates so they remain
+    // consistent during frame
+    nMousePosX = nMousePosXcache;
+    nMousePosY = nMousePosYcache;
+
+    nMouseWheelDelta = nMouseWheelDeltaCache;
+    nMouseWheelDeltaCache = 0;
   }
 
   void PixelGameEngine::SetDrawTarget(Sprite *target)
   {
+    if (!target)
+      target = pDefaultDrawTarget;
+
+    // Spans are drawn into rows. Before Construct there is no default target
+    // and the engine is left without one, as it started.
     if (target)
-      pDrawTarget = target;
-    else
-      pDrawTarget = pDefaultDrawTarget;
+      target->SetLayout(Sprite::Layout::ROW_MAJOR);
+
+    if (target == pDrawTarget)
+      return;
+
+    tDX_FlushTiles();
+    pDrawTarget = target;
+
+    // The tile grid follows the new target
+    if (bTiling)
+      BeginTiles();
+
+    tDX_RecordState();
   }
 
   Sprite* PixelGameEngine::GetDrawTarget()
   {
+    // Whoever asks may read or write the pixels directly
+    tDX_FlushTiles();
     return pDrawTarget;
   }
 
@@ -1259,34 +3832,53 @@ namespace tDX
 
   bool PixelGameEngine::Draw(int32_t x, int32_t y, Pixel p)
   {
-    if (!pDrawTarget) return false;
+    if (pRecording || bTiling)
+    {
+      DrawCommand cmd = {};
+      cmd.type = DrawCommand::PIXEL;
+      cmd.x1 = x; cmd.y1 = y;
+      cmd.col[0] = p;
+      tDX_DeferCommand(cmd, x, y, x + 1, y + 1);
+      return x >= 0 && y >= 0 && x < GetDrawTargetWidth() && y < GetDrawTargetHeight();
+    }
+
+    if (!tDX_Plot(tDX_TargetState(), x, y, p))
+      return false;
+
+    tDX_MarkDirty(x, y, x + 1, y + 1);
+    return true;
+  }
+
+  bool PixelGameEngine::tDX_Plot(const RasterState& rs, int32_t x, int32_t y, Pixel p) const
+  {
+    if (!rs.target) return false;
+    if (x < rs.x0 || x >= rs.x1 || y < rs.y0 || y >= rs.y1) return false;
 
 
     if (nPixelMode == Pixel::Mode::NORMAL)
     {
-      return pDrawTarget->SetPixel(x, y, p);
+      return rs.target->SetPixel(x, y, p);
     }
 
     if (nPixelMode == Pixel::Mode::MASK)
     {
       if (p.a == 255)
-        return pDrawTarget->SetPixel(x, y, p);
+        return rs.target->SetPixel(x, y, p);
     }
 
     if (nPixelMode == Pixel::Mode::ALPHA)
     {
-      Pixel d = pDrawTarget->GetPixel(x, y);
-      float a = (float)(p.a / 255.0f) * fBlendFactor;
-      float c = 1.0f - a;
-      float r = a * (float)p.r + c * (float)d.r;
-      float g = a * (float)p.g + c * (float)d.g;
-      float b = a * (float)p.b + c * (float)d.b;
-      return pDrawTarget->SetPixel(x, y, Pixel((uint8_t)r, (uint8_t)g, (uint8_t)b));
+      Pixel d = rs.target->GetPixel(x, y);
+      return rs.target->SetPixel(x, y, tDX_Blend(p, d, tDX_Div255(p.a * tDX_BlendScale())));
     }
 
     if (nPixelMode == Pixel::Mode::CUSTOM)
     {
-      return pDrawTarget->SetPixel(x, y, funcPixelMode(x, y, p, pDrawTarget->GetPixel(x, y)));
+#ifdef T_DBG_OVERDRAW
+      tDX::Sprite::nOverdrawCount++;
+#endif
+      funcPixelMode(x, y, 1, &p, rs.target->GetData() + y * rs.target->width + x);
+      return true;
     }
 
     return false;
@@ -1397,6 +3989,23 @@ namespace tDX
   }
 
   void PixelGameEngine::DrawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p, uint32_t pattern)
+  {
+    if (pRecording || bTiling)
+    {
+      DrawCommand cmd = {};
+      cmd.type = DrawCommand::LINE;
+      cmd.x1 = x1; cmd.y1 = y1; cmd.x2 = x2; cmd.y2 = y2;
+      cmd.col[0] = p;
+      cmd.pattern = pattern;
+      tDX_DeferCommand(cmd, std::min(x1, x2), std::min(y1, y2), std::max(x1, x2) + 1, std::max(y1, y2) + 1);
+      return;
+    }
+
+    tDX_DrawLine(tDX_TargetState(), x1, y1, x2, y2, p, pattern);
+    tDX_MarkDirty(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2) + 1, std::max(y1, y2) + 1);
+  }
+
+  void PixelGameEngine::tDX_DrawLine(const RasterState& rs, int32_t x1, int32_t y1, int32_t x2, int32_t y2, Pixel p, uint32_t pattern) const
   {
     int x, y, dx, dy, dx1, dy1, px, py, xe, ye, i;
     dx = x2 - x1; dy = y2 - y1;
@@ -1407,20 +4016,50 @@ namespace tDX
       return pattern & 1;
     };
 
+    // Solid lines are written straight to the target when the pixel
+    // mode does not need the destination
+    bool bSolid = pattern == 0xFFFFFFFF;
+    bool bOpaque = nPixelMode == Pixel::Mode::NORMAL || (nPixelMode == Pixel::Mode::MASK && p.a == 255);
+
     // straight lines idea by gurkanctn
     if (dx == 0) // Line is vertical
     {
       if (y2 < y1) std::swap(y1, y2);
+
+      if (bSolid && bOpaque && rs.target)
+      {
+        int32_t w = rs.target->width;
+        if (x1 < rs.x0 || x1 >= rs.x1) return;
+        y1 = std::max(y1, rs.y0);
+        y2 = std::min(y2, rs.y1 - 1);
+
+        Pixel* d = rs.target->GetData() + y1 * w + x1;
+        for (y = y1; y <= y2; y++, d += w)
+          *d = p;
+
+#ifdef T_DBG_OVERDRAW
+        if (y2 >= y1) tDX::Sprite::nOverdrawCount += y2 - y1 + 1;
+#endif
+        return;
+      }
+
       for (y = y1; y <= y2; y++)
-        if (rol()) Draw(x1, y, p);
+        if (rol()) tDX_Plot(rs, x1, y, p);
       return;
     }
 
     if (dy == 0) // Line is horizontal
     {
       if (x2 < x1) std::swap(x1, x2);
+
+      if (bSolid)
+      {
+        tDX_FillSpan(rs, x1, y1, x2 - x1 + 1, p);
+        return;
+      }
+
       for (x = x1; x <= x2; x++)
-        if (rol()) Draw(x, y1, p);
+        if (rol()) tDX_Plot(rs, x, y1, p);
       return;
     }
 
@@ -1438,7 +4077,7 @@ namespace tDX
         x = x2; y = y2; xe = x1;
       }
 
-      if (rol()) Draw(x, y, p);
+      if (rol()) tDX_Plot(rs, x, y, p);
 
       for (i = 0; x < xe; i++)
       {
@@ -1450,7 +4089,7 @@ namespace tDX
           if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) y = y + 1; else y = y - 1;
           px = px + 2 * (dy1 - dx1);
         }
-        if (rol()) Draw(x, y, p);
+        if (rol()) tDX_Plot(rs, x, y, p);
       }
     }
     else
@@ -1464,20 +4103,361 @@ namespace tDX
         x = x2; y = y2; ye = y1;
       }
 
-      if (rol()) Draw(x, y, p);
+      if (rol()) tDX_Plot(rs, x, y, p);
+
+      for (i = 0; y < ye; i++)
+      {
+        y = y + 1;
+        if (py <= 0)
+          py = py + 2 * dx1;
+        else
+        {
+          if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) x = x + 1; else x = x - 1;
+          py = py + 2 * (dx1 - dy1);
+        }
+        if (rol()) tDX_Plot(rs, x, y, p);
+      }
+    }
+  }
+
+  void PixelGameEngine::FillSpan(const tDX::vi2d& pos, int32_t len, Pixel p)
+  {
+    FillSpan(pos.x, pos.y, len, p);
+  }
+
+  void PixelGameEngine::FillSpan(int32_t x, int32_t y, int32_t len, Pixel p)
+  {
+    if (pRecording || bTiling)
+    {
+      DrawCommand cmd = {};
+      cmd.type = DrawCommand::SPAN;
+      cmd.x1 = x; cmd.y1 = y; cmd.x2 = len;
+      cmd.col[0] = p;
+      tDX_DeferCommand(cmd, x, y, x + len, y + 1);
+      return;
+    }
+
+    tDX_FillSpan(tDX_TargetState(), x, y, len, p);
+    tDX_MarkDirty(x, y, x + len, y + 1);
+  }
+
+  void PixelGameEngine::tDX_FillSpan(const RasterState& rs, int32_t x, int32_t y, int32_t len, Pixel p) const
+  {
+    if (!rs.target || y < rs.y0 || y >= rs.y1) return;
+
+    int32_t x2 = std::min(x + len, rs.x1);
+    if (x < rs.x0) x = rs.x0;
+    if (x >= x2) return;
+
+    int32_t count = x2 - x;
+    Pixel* d = rs.target->GetData() + y * rs.target->width + x;
+
+    // Pixel mode is resolved once for the whole span
+    switch (nPixelMode)
+    {
+    case Pixel::Mode::NORMAL:
+      tDX_FillPixels(d, count, p);
+      break;
+
+    case Pixel::Mode::MASK:
+      if (p.a == 255)
+        tDX_FillPixels(d, count, p);
+      break;
+
+    case Pixel::Mode::ALPHA:
+      tDX_BlendPixels(d, count, p, tDX_Div255(p.a * tDX_BlendScale()));
+      break;
+
+    case Pixel::Mode::CUSTOM:
+    {
+      // The shader reads the colour as a span too, handed over in pieces
+      Pixel src[256];
+      tDX_FillPixels(src, std::min(count, 256), p);
+
+      for (int32_t i = 0; i < count; i += 256)
+        funcPixelMode(x + i, y, std::min(count - i, 256), src, d + i);
+      break;
+    }
+    }
+
+#ifdef T_DBG_OVERDRAW
+    tDX::Sprite::nOverdrawCount += count;
+#endif
+  }
+
+  void PixelGameEngine::tDX_FillPixels(Pixel* dst, int32_t count, Pixel p)
+  {
+    int32_t i = 0;
+
+#if defined(T_PGE_AVX2)
+    // Scalar head until the destination is 32 byte aligned, then 32 pixels per step
+    for (; i < count && ((uintptr_t)(dst + i) & 31); i++)
+      dst[i] = p;
+
+    const __m256i v = _mm256_set1_epi32((int)p.n);
+
+    // Fills larger than the cache bypass it, they would only evict useful data
+    if (count - i >= nStreamingFillPixels)
+    {
+      for (; i + 32 <= count; i += 32)
+      {
+        _mm256_stream_si256((__m256i*)(dst + i + 0), v);
+        _mm256_stream_si256((__m256i*)(dst + i + 8), v);
+        _mm256_stream_si256((__m256i*)(dst + i + 16), v);
+        _mm256_stream_si256((__m256i*)(dst + i + 24), v);
+      }
+      _mm_sfence();
+    }
+
+    for (; i + 32 <= count; i += 32)
+    {
+      _mm256_store_si256((__m256i*)(dst + i + 0), v);
+      _mm256_store_si256((__m256i*)(dst + i + 8), v);
+      _mm256_store_si256((__m256i*)(dst + i + 16), v);
+      _mm256_store_si256((__m256i*)(dst + i + 24), v);
+    }
+    for (; i + 8 <= count; i += 8)
+      _mm256_store_si256((__m256i*)(dst + i), v);
+#elif defined(T_PGE_SSE2)
+    // Scalar head until the destination is 16 byte aligned, then 16 pixels per step
+    for (; i < count && ((uintptr_t)(dst + i) & 15); i++)
+      dst[i] = p;
+
+    const __m128i v = _mm_set1_epi32((int)p.n);
+
+    // Fills larger than the cache bypass it, they would only evict useful data
+    if (count - i >= nStreamingFillPixels)
+    {
+      for (; i + 16 <= count; i += 16)
+      {
+        _mm_stream_si128((__m128i*)(dst + i + 0), v);
+        _mm_stream_si128((__m128i*)(dst + i + 4), v);
+        _mm_stream_si128((__m128i*)(dst + i + 8), v);
+        _mm_stream_si128((__m128i*)(dst + i + 12), v);
+      }
+      _mm_sfence();
+    }
+
+    for (; i + 16 <= count; i += 16)
+    {
+      _mm_store_si128((__m128i*)(dst + i + 0), v);
+      _mm_store_si128((__m128i*)(dst + i + 4), v);
+      _mm_store_si128((__m128i*)(dst + i + 8), v);
+      _mm_store_si128((__m128i*)(dst + i + 12), v);
+    }
+    for (; i + 4 <= count; i += 4)
+      _mm_store_si128((__m128i*)(dst + i), v);
+#endif
+
+    for (; i < count; i++)
+      dst[i] = p;
+  }
+
+  uint32_t PixelGameEngine::tDX_Div255(uint32_t x)
+  {
+    // Exact rounded division for x up to 255 * 255 + 255
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+  }
+
+  Pixel PixelGameEngine::tDX_Blend(Pixel src, Pixel dst, uint32_t alpha)
+  {
+    const uint32_t c = 255 - alpha;
+    return Pixel((uint8_t)tDX_Div255(src.r * alpha + dst.r * c), (uint8_t)tDX_Div255(src.g * alpha + dst.g * c), (uint8_t)tDX_Div255(src.b * alpha + dst.b * c));
+  }
+
+  uint32_t PixelGameEngine::tDX_BlendScale() const
+  {
+    return (uint32_t)(fBlendFactor * 255.0f + 0.5f);
+  }
+
+  Pixel PixelGameEngine::tDX_Unpremultiply(Pixel p)
+  {
+    if (p.a == 0 || p.a == 255) return p;
+
+    auto channel = [&](uint8_t c) { return (uint8_t)std::min<uint32_t>((c * 255u + p.a / 2u) / p.a, 255u); };
+    return Pixel(channel(p.r), channel(p.g), channel(p.b), p.a);
+  }
+
+  // The SIMD versions widen every channel to 16 bits, products of two channels
+  // and their rounded division by 255 stay within them
+  void PixelGameEngine::tDX_BlendPixels(Pixel* dst, int32_t count, Pixel p, uint32_t alpha)
+  {
+    if (alpha == 0) return;
+
+    const Pixel opaque(p.r, p.g, p.b);
+    if (alpha == 255)
+    {
+      tDX_FillPixels(dst, count, opaque);
+      return;
+    }
+
+    int32_t i = 0;
+
+#if defined(T_PGE_AVX2)
+    {
+      // Colour times alpha is the same for every pixel, once per channel
+      const __m256i src = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)opaque.n), _mm256_setzero_si256());
+      const __m256i term = _mm256_mullo_epi16(src, _mm256_setr_epi16((short)alpha, (short)alpha, (short)alpha, 0, (short)alpha, (short)alpha, (short)alpha, 0,
+        (short)alpha, (short)alpha, (short)alpha, 0, (short)alpha, (short)alpha, (short)alpha, 0));
+      const __m256i inv = _mm256_set1_epi16((short)(255 - alpha));
+      const __m256i round = _mm256_set1_epi16(128);
+      const __m256i opaqueAlpha = _mm256_set1_epi32((int)0xFF000000);
+
+      auto blend = [&](__m256i d)
+      {
+        __m256i x = _mm256_add_epi16(_mm256_add_epi16(term, _mm256_mullo_epi16(d, inv)), round);
+        return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+      };
+
+      for (; i + 8 <= count; i += 8)
+      {
+        const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        const __m256i lo = blend(_mm256_unpacklo_epi8(d, _mm256_setzero_si256()));
+        const __m256i hi = blend(_mm256_unpackhi_epi8(d, _mm256_setzero_si256()));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(_mm256_packus_epi16(lo, hi), opaqueAlpha));
+      }
+    }
+#endif
+
+#if defined(T_PGE_SSE2)
+    {
+      const __m128i src = _mm_unpacklo_epi8(_mm_set1_epi32((int)opaque.n), _mm_setzero_si128());
+      const __m128i term = _mm_mullo_epi16(src, _mm_setr_epi16((short)alpha, (short)alpha, (short)alpha, 0, (short)alpha, (short)alpha, (short)alpha, 0));
+      const __m128i inv = _mm_set1_epi16((short)(255 - alpha));
+      const __m128i round = _mm_set1_epi16(128);
+      const __m128i opaqueAlpha = _mm_set1_epi32((int)0xFF000000);
+
+      auto blend = [&](__m128i d)
+      {
+        __m128i x = _mm_add_epi16(_mm_add_epi16(term, _mm_mullo_epi16(d, inv)), round);
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+      };
+
+      for (; i + 4 <= count; i += 4)
+      {
+        const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        const __m128i lo = blend(_mm_unpacklo_epi8(d, _mm_setzero_si128()));
+        const __m128i hi = blend(_mm_unpackhi_epi8(d, _mm_setzero_si128()));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_packus_epi16(lo, hi), opaqueAlpha));
+      }
+    }
+#endif
+
+    for (; i < count; i++)
+      dst[i] = tDX_Blend(p, dst[i], alpha);
+  }
+
+  void PixelGameEngine::tDX_BlendRow(Pixel* dst, const Pixel* src, int32_t count, uint32_t nBlend, bool bPremultiplied)
+  {
+    int32_t i = 0;
+
+#if defined(T_PGE_AVX2)
+    {
+      const __m256i blend = _mm256_set1_epi16((short)nBlend);
+      const __m256i c255 = _mm256_set1_epi16(255);
+      const __m256i round = _mm256_set1_epi16(128);
+      const __m256i maxSum = _mm256_set1_epi16((short)(255 * 255));
+      const __m256i alphaMask = _mm256_set1_epi32((int)0xFF000000);
+
+      auto div255 = [&](__m256i x)
+      {
+        x = _mm256_add_epi16(x, round);
+        return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+      };
+
+      // Two pixels of four 16 bit channels, alpha copied to all channels of its pixel.
+      // Premultiplied colour above its alpha adds light, the sum then saturates
+      // and is clamped to 255 * 255 so div255 cannot wrap, like the scalar clamp.
+      auto blend2 = [&](__m256i s, __m256i d)
+      {
+        const __m256i a = div255(_mm256_mullo_epi16(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF), blend));
+        const __m256i scale = bPremultiplied ? blend : a;
+        const __m256i sum = _mm256_adds_epu16(_mm256_mullo_epi16(s, scale), _mm256_mullo_epi16(d, _mm256_sub_epi16(c255, a)));
+        return div255(_mm256_min_epu16(sum, maxSum));
+      };
+
+      for (; i + 8 <= count; i += 8)
+      {
+        const __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+
+        // Rows of sprites are mostly fully transparent or opaque pixels
+        const __m256i a = _mm256_and_si256(s, alphaMask);
+        if (!bPremultiplied && _mm256_testz_si256(a, a))
+          continue;
+        if (nBlend == 255 && _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, alphaMask)) == -1)
+        {
+          _mm256_storeu_si256((__m256i*)(dst + i), s);
+          continue;
+        }
+
+        const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        const __m256i lo = blend2(_mm256_unpacklo_epi8(s, _mm256_setzero_si256()), _mm256_unpacklo_epi8(d, _mm256_setzero_si256()));
+        const __m256i hi = blend2(_mm256_unpackhi_epi8(s, _mm256_setzero_si256()), _mm256_unpackhi_epi8(d, _mm256_setzero_si256()));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(_mm256_packus_epi16(lo, hi), alphaMask));
+      }
+    }
+#endif
+
+#if defined(T_PGE_SSE2)
+    {
+      const __m128i blend = _mm_set1_epi16((short)nBlend);
+      const __m128i c255 = _mm_set1_epi16(255);
+      const __m128i round = _mm_set1_epi16(128);
+      const __m128i maxSum = _mm_set1_epi16((short)(255 * 255));
+      const __m128i alphaMask = _mm_set1_epi32((int)0xFF000000);
+
+      auto div255 = [&](__m128i x)
+      {
+        x = _mm_add_epi16(x, round);
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+      };
+
+      // SSE2 has no unsigned 16 bit min, the excess over 255 * 255 is subtracted instead
+      auto blend2 = [&](__m128i s, __m128i d)
+      {
+        const __m128i a = div255(_mm_mullo_epi16(_mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF), blend));
+        const __m128i scale = bPremultiplied ? blend : a;
+        const __m128i sum = _mm_adds_epu16(_mm_mullo_epi16(s, scale), _mm_mullo_epi16(d, _mm_sub_epi16(c255, a)));
+        return div255(_mm_sub_epi16(sum, _mm_subs_epu16(sum, maxSum)));
+      };
 
-      for (i = 0; y < ye; i++)
+      for (; i + 4 <= count; i += 4)
       {
-        y = y + 1;
-        if (py <= 0)
-          py = py + 2 * dx1;
-        else
+        const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+
+        const __m128i a = _mm_and_si128(s, alphaMask);
+        if (!bPremultiplied && _mm_movemask_epi8(_mm_cmpeq_epi32(a, _mm_setzero_si128())) == 0xFFFF)
+          continue;
+        if (nBlend == 255 && _mm_movemask_epi8(_mm_cmpeq_epi32(a, alphaMask)) == 0xFFFF)
         {
-          if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) x = x + 1; else x = x - 1;
-          py = py + 2 * (dx1 - dy1);
+          _mm_storeu_si128((__m128i*)(dst + i), s);
+          continue;
         }
-        if (rol()) Draw(x, y, p);
+
+        const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        const __m128i lo = blend2(_mm_unpacklo_epi8(s, _mm_setzero_si128()), _mm_unpacklo_epi8(d, _mm_setzero_si128()));
+        const __m128i hi = blend2(_mm_unpackhi_epi8(s, _mm_setzero_si128()), _mm_unpackhi_epi8(d, _mm_setzero_si128()));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_packus_epi16(lo, hi), alphaMask));
+      }
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+      const Pixel s = src[i];
+      const uint32_t a = tDX_Div255(s.a * nBlend);
+
+      if (!bPremultiplied)
+      {
+        dst[i] = tDX_Blend(s, dst[i], a);
+        continue;
       }
+
+      const Pixel d = dst[i];
+      const uint32_t c = 255 - a;
+      auto channel = [&](uint8_t sc, uint8_t dc) { return (uint8_t)std::min<uint32_t>(tDX_Div255(sc * nBlend + dc * c), 255u); };
+      dst[i] = Pixel(channel(s.r, d.r), channel(s.g, d.g), channel(s.b, d.b));
     }
   }
 
@@ -1523,8 +4503,7 @@ namespace tDX
 
     auto drawline = [&](int sx, int ex, int ny)
     {
-      for (int i = sx; i <= ex; i++)
-        Draw(i, ny, p);
+      FillSpan(sx, ny, ex - sx + 1, p);
     };
 
     while (y0 >= x0)
@@ -1554,15 +4533,114 @@ namespace tDX
 
   void PixelGameEngine::Clear(Pixel p)
   {
+    if (pRecording || bTiling)
+    {
+      Clear(0, 0, GetDrawTargetWidth(), GetDrawTargetHeight(), p);
+      return;
+    }
+
+    // Every pixel is overwritten, a pending initial fill would be wasted
     int pixels = GetDrawTargetWidth() * GetDrawTargetHeight();
+    GetDrawTarget()->DiscardContents();
     Pixel* m = GetDrawTarget()->GetData();
-    for (int i = 0; i < pixels; i++)
-      m[i] = p;
+    tDX_FillPixels(m, pixels, p);
+    tDX_MarkDirty(0, 0, GetDrawTargetWidth(), GetDrawTargetHeight());
 #ifdef T_DBG_OVERDRAW
     tDX::Sprite::nOverdrawCount += pixels;
 #endif
   }
 
+  void PixelGameEngine::Clear(const tDX::vi2d& pos, const tDX::vi2d& size, Pixel p)
+  {
+    Clear(pos.x, pos.y, size.x, size.y, p);
+  }
+
+  void PixelGameEngine::Clear(int32_t x, int32_t y, int32_t w, int32_t h, Pixel p)
+  {
+    if (pRecording || bTiling)
+    {
+      DrawCommand cmd = {};
+      cmd.type = DrawCommand::CLEAR;
+      cmd.x1 = x; cmd.y1 = y; cmd.x2 = w; cmd.y2 = h;
+      cmd.col[0] = p;
+      tDX_DeferCommand(cmd, x, y, x + w, y + h);
+      return;
+    }
+
+    tDX_ClearRect(tDX_TargetState(), x, y, w, h, p);
+    tDX_MarkDirty(x, y, x + w, y + h);
+  }
+
+  void PixelGameEngine::tDX_ClearRect(const RasterState& rs, int32_t x, int32_t y, int32_t w, int32_t h, Pixel p) const
+  {
+    if (!rs.target) return;
+
+    int32_t x2 = std::min(x + w, rs.x1);
+    int32_t y2 = std::min(y + h, rs.y1);
+    x = std::max(x, rs.x0);
+    y = std::max(y, rs.y0);
+    if (x >= x2 || y >= y2) return;
+
+    int32_t width = rs.target->width;
+    Pixel* m = rs.target->GetData() + y * width;
+
+    // Full rows are one contiguous block
+    if (x == 0 && x2 == width)
+      tDX_FillPixels(m, (y2 - y) * width, p);
+    else
+      for (int32_t j = y; j < y2; j++, m += width)
+        tDX_FillPixels(m + x, x2 - x, p);
+
+#ifdef T_DBG_OVERDRAW
+    tDX::Sprite::nOverdrawCount += (x2 - x) * (y2 - y);
+#endif
+  }
+
+  void PixelGameEngine::ClearDepth(float fDepth)
+  {
+    if (!pDrawTarget || !pDrawTarget->GetDepthData()) return;
+
+    if (pRecording || bTiling)
+    {
+      ClearDepth(0, 0, pDrawTarget->width, pDrawTarget->height, fDepth);
+      return;
+    }
+
+    std::fill_n(pDrawTarget->GetDepthData(), pDrawTarget->width * pDrawTarget->height, fDepth);
+  }
+
+  void PixelGameEngine::ClearDepth(int32_t x, int32_t y, int32_t w, int32_t h, float fDepth)
+  {
+    if (pRecording || bTiling)
+    {
+      DrawCommand cmd = {};
+      cmd.type = DrawCommand::CLEAR_DEPTH;
+      cmd.x1 = x; cmd.y1 = y; cmd.x2 = w; cmd.y2 = h;
+      cmd.vz[0] = fDepth;
+      tDX_DeferCommand(cmd, x, y, x + w, y + h);
+      return;
+    }
+
+    tDX_ClearDepthRect(tDX_TargetState(), x, y, w, h, fDepth);
+  }
+
+  void PixelGameEngine::tDX_ClearDepthRect(const RasterState& rs, int32_t x, int32_t y, int32_t w, int32_t h, float fDepth) const
+  {
+    if (!rs.target || !rs.target->GetDepthData()) return;
+
+    int32_t x2 = std::min(x + w, rs.x1);
+    int32_t y2 = std::min(y + h, rs.y1);
+    x = std::max(x, rs.x0);
+    y = std::max(y, rs.y0);
+    if (x >= x2 || y >= y2) return;
+
+    int32_t width = rs.target->width;
+    float* m = rs.target->GetDepthData() + y * width;
+
+    for (int32_t j = y; j < y2; j++, m += width)
+      std::fill(m + x, m + x2, fDepth);
+  }
+
   void PixelGameEngine::FillRect(const tDX::vi2d& pos, const tDX::vi2d& size, Pixel p)
   {
     FillRect(pos.x, pos.y, size.x, size.y, p);
@@ -1583,9 +4661,8 @@ namespace tDX
     if (y2 < 0) y2 = 0;
     if (y2 >= (int32_t)GetDrawTargetHeight()) y2 = (int32_t)GetDrawTargetHeight();
 
-    for (int i = x; i < x2; i++)
-      for (int j = y; j < y2; j++)
-        Draw(i, j, p);
+    for (int j = y; j < y2; j++)
+      FillSpan(x, j, x2 - x, p);
   }
 
   void PixelGameEngine::DrawTriangle(const tDX::vi2d& pos1, const tDX::vi2d& pos2, const tDX::vi2d& pos3, Pixel p)
@@ -1609,7 +4686,7 @@ namespace tDX
   void PixelGameEngine::FillTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, Pixel p)
   {
     auto SWAP = [](int &x, int &y) { int t = x; x = y; y = t; };
-    auto drawline = [&](int sx, int ex, int ny) { for (int i = sx; i <= ex; i++) Draw(i, ny, p); };
+    auto drawline = [&](int sx, int ex, int ny) { FillSpan(sx, ny, ex - sx + 1, p); };
 
     int t1x, t2x, y, minx, maxx, t1xp, t2xp;
     bool changed1 = false;
@@ -1695,55 +4772,541 @@ namespace tDX
     dy1 = (int)(y3 - y2);
     t1x = x2;
 
-    if (dy1 > dx1) {   // swap values
-      SWAP(dy1, dx1);
-      changed1 = true;
-    }
-    else changed1 = false;
+    if (dy1 > dx1) {   // swap values
+      SWAP(dy1, dx1);
+      changed1 = true;
+    }
+    else changed1 = false;
+
+    e1 = (int)(dx1 >> 1);
+
+    for (int i = 0; i <= dx1; i++) {
+      t1xp = 0; t2xp = 0;
+      if (t1x < t2x) { minx = t1x; maxx = t2x; }
+      else { minx = t2x; maxx = t1x; }
+      // process first line until y value is about to change
+      while (i < dx1) {
+        e1 += dy1;
+        while (e1 >= dx1) {
+          e1 -= dx1;
+          if (changed1) { t1xp = signx1; break; }//t1x += signx1;
+          else          goto next3;
+        }
+        if (changed1) break;
+        else   	   	  t1x += signx1;
+        if (i < dx1) i++;
+      }
+    next3:
+      // process second line until y value is about to change
+      while (t2x != x3) {
+        e2 += dy2;
+        while (e2 >= dx2) {
+          e2 -= dx2;
+          if (changed2) t2xp = signx2;
+          else          goto next4;
+        }
+        if (changed2)     break;
+        else              t2x += signx2;
+      }
+    next4:
+
+      if (minx > t1x) minx = t1x;
+      if (minx > t2x) minx = t2x;
+      if (maxx < t1x) maxx = t1x;
+      if (maxx < t2x) maxx = t2x;
+      drawline(minx, maxx, y);
+      if (!changed1) t1x += signx1;
+      t1x += t1xp;
+      if (!changed2) t2x += signx2;
+      t2x += t2xp;
+      y += 1;
+      if (y > y3) return;
+    }
+  }
+
+  void PixelGameEngine::FillTriangle(const tDX::vf2d& pos1, float z1, const tDX::vf2d& pos2, float z2, const tDX::vf2d& pos3, float z3, Pixel p)
+  {
+    const float x[3] = { pos1.x, pos2.x, pos3.x };
+    const float y[3] = { pos1.y, pos2.y, pos3.y };
+    const float z[3] = { z1, z2, z3 };
+    const Pixel c[3] = { p, p, p };
+    tDX_FillTriangle(x, y, z, c, false);
+  }
+
+  void PixelGameEngine::FillTriangle(const tDX::vf2d& pos1, float z1, Pixel p1, const tDX::vf2d& pos2, float z2, Pixel p2, const tDX::vf2d& pos3, float z3, Pixel p3)
+  {
+    const float x[3] = { pos1.x, pos2.x, pos3.x };
+    const float y[3] = { pos1.y, pos2.y, pos3.y };
+    const float z[3] = { z1, z2, z3 };
+    const Pixel c[3] = { p1, p2, p3 };
+    tDX_FillTriangle(x, y, z, c, true);
+  }
+
+  void PixelGameEngine::FillTexturedTriangle(const TexturedVertex& v1, const TexturedVertex& v2, const TexturedVertex& v3, Sprite* texture, Sprite::Filter filter, Pixel tint)
+  {
+    // A pending fill happens now, the tiles only read the texture
+    if (texture == nullptr || !texture->GetData())
+      return;
+
+    const float x[3] = { v1.x, v2.x, v3.x };
+    const float y[3] = { v1.y, v2.y, v3.y };
+    const float z[3] = { v1.z, v2.z, v3.z };
+    const Pixel c[3] = { tint, tint, tint };
+    const TriangleTexture tex = { texture, filter, { v1.u, v2.u, v3.u }, { v1.v, v2.v, v3.v }, { v1.w, v2.w, v3.w } };
+    tDX_FillTriangle(x, y, z, c, false, &tex);
+  }
+
+  void PixelGameEngine::tDX_FillTriangle(const float* vx, const float* vy, const float* vz, const Pixel* vc, bool bSmooth, const TriangleTexture* pTexture)
+  {
+    // Bounds clamped before the conversion, the rasterizer rejects what is too far out
+    auto bound = [](float v) { return (int32_t)std::floor(std::min(std::max(v, -32768.0f), 32768.0f)); };
+    const int32_t x0 = bound(std::min(std::min(vx[0], vx[1]), vx[2]));
+    const int32_t y0 = bound(std::min(std::min(vy[0], vy[1]), vy[2]));
+    const int32_t x1 = bound(std::max(std::max(vx[0], vx[1]), vx[2])) + 1;
+    const int32_t y1 = bound(std::max(std::max(vy[0], vy[1]), vy[2])) + 1;
+
+    if (!pRecording && !bTiling)
+    {
+      tDX_RasterTriangle(tDX_TargetState(), vx, vy, vz, vc, bSmooth, pTexture);
+      tDX_MarkDirty(x0, y0, x1, y1);
+      return;
+    }
+
+    DrawCommand cmd = {};
+    cmd.type = DrawCommand::TRIANGLE;
+    cmd.bSmooth = bSmooth;
+    for (int i = 0; i < 3; i++)
+    {
+      cmd.vx[i] = vx[i]; cmd.vy[i] = vy[i]; cmd.vz[i] = vz[i];
+      cmd.col[i] = vc[i];
+    }
+    if (pTexture)
+    {
+      std::vector<TriangleTexture>& vTextures = pRecording ? pRecording->vTextures : vTileTextures;
+      cmd.target = pTexture->sprite;
+      cmd.pattern = (uint32_t)vTextures.size();
+      vTextures.push_back(*pTexture);
+    }
+
+    tDX_DeferCommand(cmd, x0, y0, x1, y1);
+  }
+
+  // Half-space rasterizer: coverage comes from three edge functions evaluated
+  // in 28.4 fixed point, walked in 8x8 blocks. Blocks outside one edge are
+  // skipped, blocks inside all of them are filled without per pixel tests.
+  // Textured blocks collect their visible pixels first and sample them at once.
+  void PixelGameEngine::tDX_RasterTriangle(const RasterState& rs, const float* vx, const float* vy, const float* vz, const Pixel* vc, bool bSmooth, const TriangleTexture* pTexture) const
+  {
+    if (!rs.target) return;
+
+    // Further out the edge functions would overflow, clip before (also rejects NaN)
+    for (int i = 0; i < 3; i++)
+      if (!(std::fabs(vx[i]) < 32768.0f && std::fabs(vy[i]) < 32768.0f)) return;
+
+    // Vertices snapped to 1/16 of a pixel
+    int32_t X[3], Y[3];
+    for (int i = 0; i < 3; i++)
+    {
+      X[i] = (int32_t)std::lround(vx[i] * 16.0f);
+      Y[i] = (int32_t)std::lround(vy[i] * 16.0f);
+    }
+
+    int64_t area = (int64_t)(X[1] - X[0]) * (Y[2] - Y[0]) - (int64_t)(Y[1] - Y[0]) * (X[2] - X[0]);
+    if (area == 0) return;
+
+    // Both windings are drawn, everything below expects a positive area
+    int v[3] = { 0, 1, 2 };
+    if (area < 0) { std::swap(v[1], v[2]); area = -area; }
+
+    // Edge k runs from v[k] to v[k + 1], E(P) = A * (Px - Xa) + B * (Py - Ya) + bias
+    // is >= 0 inside. The bias implements the top-left fill rule, pixels exactly on
+    // a shared edge belong to one of the two triangles only.
+    int64_t A[3], B[3], E0[3];
+    const int32_t width = rs.target->width;
+
+    int32_t minX = std::min(std::min(X[0], X[1]), X[2]);
+    int32_t maxX = std::max(std::max(X[0], X[1]), X[2]);
+    int32_t minY = std::min(std::min(Y[0], Y[1]), Y[2]);
+    int32_t maxY = std::max(std::max(Y[0], Y[1]), Y[2]);
+
+    // Pixels whose centre can be covered
+    minX = (minX - 8 + 15) >> 4;
+    minY = (minY - 8 + 15) >> 4;
+
+    // Attributes are taken relative to the unclipped corner, so every tile
+    // interpolates exactly the same values
+    const int32_t originX = minX, originY = minY;
+
+    minX = std::max(minX, rs.x0);
+    maxX = std::min((maxX - 8) >> 4, rs.x1 - 1);
+    minY = std::max(minY, rs.y0);
+    maxY = std::min((maxY - 8) >> 4, rs.y1 - 1);
+    if (minX > maxX || minY > maxY) return;
+
+    // Blocks start on a multiple of 8, so they never straddle two tiles
+    const int32_t startX = minX & ~7;
+    const int32_t startY = minY & ~7;
+
+    for (int k = 0; k < 3; k++)
+    {
+      int a = v[k], b = v[(k + 1) % 3];
+      int32_t dx = X[b] - X[a];
+      int32_t dy = Y[b] - Y[a];
+      bool bTopLeft = dy < 0 || (dy == 0 && dx > 0);
+
+      A[k] = -dy;
+      B[k] = dx;
+      E0[k] = A[k] * ((int64_t)startX * 16 + 8 - X[a]) + B[k] * ((int64_t)startY * 16 + 8 - Y[a]) + (bTopLeft ? 0 : -1);
+    }
+
+    // Attributes are planes over the screen, a(x,y) = a0 + dadx * x + dady * y at pixel centres
+    const float fArea = (float)area / 256.0f;
+    const float x0 = X[v[0]] / 16.0f, y0 = Y[v[0]] / 16.0f;
+    const float dx1 = X[v[1]] / 16.0f - x0, dy1 = Y[v[1]] / 16.0f - y0;
+    const float dx2 = X[v[2]] / 16.0f - x0, dy2 = Y[v[2]] / 16.0f - y0;
+
+    struct Plane { float a, dadx, dady; };
+    auto plane = [&](float a0, float a1, float a2)
+    {
+      Plane pl;
+      pl.dadx = ((a1 - a0) * dy2 - (a2 - a0) * dy1) / fArea;
+      pl.dady = ((a2 - a0) * dx1 - (a1 - a0) * dx2) / fArea;
+      pl.a = a0 + pl.dadx * (originX + 0.5f - x0) + pl.dady * (originY + 0.5f - y0);
+      return pl;
+    };
+
+    const Plane pz = plane(vz[v[0]], vz[v[1]], vz[v[2]]);
+    Plane pc[4] = {};
+    if (bSmooth)
+    {
+      pc[0] = plane(vc[v[0]].r, vc[v[1]].r, vc[v[2]].r);
+      pc[1] = plane(vc[v[0]].g, vc[v[1]].g, vc[v[2]].g);
+      pc[2] = plane(vc[v[0]].b, vc[v[1]].b, vc[v[2]].b);
+      pc[3] = plane(vc[v[0]].a, vc[v[1]].a, vc[v[2]].a);
+    }
+
+    // u/w, v/w and 1/w are linear on the screen, unlike u and v
+    Plane pu = {}, pv = {}, pw = {};
+    if (pTexture)
+    {
+      const TriangleTexture& t = *pTexture;
+      pu = plane(t.u[v[0]] * t.w[v[0]], t.u[v[1]] * t.w[v[1]], t.u[v[2]] * t.w[v[2]]);
+      pv = plane(t.v[v[0]] * t.w[v[0]], t.v[v[1]] * t.w[v[1]], t.v[v[2]] * t.w[v[2]]);
+      pw = plane(t.w[v[0]], t.w[v[1]], t.w[v[2]]);
+    }
+
+    Pixel* pixels = rs.target->GetData();
+    float* depth = rs.target->GetDepthData();
+    const Pixel flat = vc[0];
+    const bool bFast = !pTexture && !bSmooth && (nPixelMode == Pixel::Mode::NORMAL || (nPixelMode == Pixel::Mode::MASK && flat.a == 255));
+
+    // Writes the pixels of one block row selected by mask, depth testing them first
+    auto shadeRow = [&](int32_t x, int32_t y, uint32_t mask, float z)
+    {
+      const float dzdx = pz.dadx;
+      Pixel* d = pixels + y * width + x;
+      float* zb = depth ? depth + y * width + x : nullptr;
+
+#if defined(T_PGE_SSE2)
+      // Whole row inside the clip rectangle, 8 lanes as two registers
+      if (x + 8 <= rs.x1 && (zb || bFast))
+      {
+        const __m128i bitsLo = _mm_setr_epi32(1, 2, 4, 8);
+        const __m128i bitsHi = _mm_setr_epi32(16, 32, 64, 128);
+        const __m128 step = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+        const __m128 zLo = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(step, _mm_set1_ps(dzdx)));
+        const __m128 zHi = _mm_add_ps(zLo, _mm_set1_ps(4.0f * dzdx));
+
+        if (zb)
+        {
+          __m128 oldLo = _mm_loadu_ps(zb), oldHi = _mm_loadu_ps(zb + 4);
+          mask &= (uint32_t)(_mm_movemask_ps(_mm_cmplt_ps(zLo, oldLo)) | _mm_movemask_ps(_mm_cmplt_ps(zHi, oldHi)) << 4);
+          if (!mask) return;
+
+          const __m128i m = _mm_set1_epi32((int)mask);
+          __m128 mLo = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(m, bitsLo), bitsLo));
+          __m128 mHi = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(m, bitsHi), bitsHi));
+          _mm_storeu_ps(zb, _mm_or_ps(_mm_and_ps(mLo, zLo), _mm_andnot_ps(mLo, oldLo)));
+          _mm_storeu_ps(zb + 4, _mm_or_ps(_mm_and_ps(mHi, zHi), _mm_andnot_ps(mHi, oldHi)));
+          zb = nullptr;
+        }
+
+        if (bFast)
+        {
+          const __m128i m = _mm_set1_epi32((int)mask);
+          const __m128i col = _mm_set1_epi32((int)flat.n);
+#ifdef T_DBG_OVERDRAW
+          for (uint32_t n = mask; n; n &= n - 1) tDX::Sprite::nOverdrawCount++;
+#endif
+          if (mask == 0xFF)
+          {
+            _mm_storeu_si128((__m128i*)d, col);
+            _mm_storeu_si128((__m128i*)(d + 4), col);
+            return;
+          }
+
+          __m128i mLo = _mm_cmpeq_epi32(_mm_and_si128(m, bitsLo), bitsLo);
+          __m128i mHi = _mm_cmpeq_epi32(_mm_and_si128(m, bitsHi), bitsHi);
+          __m128i oldLo = _mm_loadu_si128((__m128i*)d), oldHi = _mm_loadu_si128((__m128i*)(d + 4));
+          _mm_storeu_si128((__m128i*)d, _mm_or_si128(_mm_and_si128(mLo, col), _mm_andnot_si128(mLo, oldLo)));
+          _mm_storeu_si128((__m128i*)(d + 4), _mm_or_si128(_mm_and_si128(mHi, col), _mm_andnot_si128(mHi, oldHi)));
+          return;
+        }
+      }
+#endif
+
+      for (int32_t i = 0; i < 8; i++)
+      {
+        if (!(mask & (1u << i))) continue;
+
+        float zi = z + dzdx * i;
+        if (zb)
+        {
+          if (!(zi < zb[i])) continue;
+          zb[i] = zi;
+        }
+
+        if (bFast)
+        {
+          d[i] = flat;
+#ifdef T_DBG_OVERDRAW
+          tDX::Sprite::nOverdrawCount++;
+#endif
+        }
+        else if (!bSmooth)
+          tDX_Plot(rs, x + i, y, flat);
+        else
+        {
+          // Plane values at this pixel, clamped as they may overshoot slightly at the edges
+          auto channel = [&](const Plane& pl) { return (uint8_t)std::min(std::max(pl.a + pl.dadx * (x + i - originX) + pl.dady * (y - originY), 0.0f), 255.0f); };
+          tDX_Plot(rs, x + i, y, Pixel(channel(pc[0]), channel(pc[1]), channel(pc[2]), channel(pc[3])));
+        }
+      }
+    };
+
+    // Pixels of one block selected by the row masks: depth tests them, samples the
+    // ones left in one batch and writes them in the pixel mode
+    uint32_t blockMask[8] = {};
+    auto shadeTexturedBlock = [&](int32_t bx, int32_t by, int32_t rows, float zRow)
+    {
+      Sprite* texture = pTexture->sprite;
+      float texU[64], texV[64];
+      Pixel texels[64];
+
+      if (depth)
+        for (int32_t r = 0; r < rows; r++, zRow += pz.dady)
+        {
+          float* zb = depth + (by + r) * width + bx;
+          for (int32_t i = 0; i < 8; i++)
+          {
+            if (!(blockMask[r] & (1u << i))) continue;
+
+            const float zi = zRow + pz.dadx * i;
+            if (zi < zb[i]) zb[i] = zi;
+            else blockMask[r] &= ~(1u << i);
+          }
+        }
+
+      // Perspective correct coordinates, stepped from the block's first pixel
+      const float fx = (float)(bx - originX), fy = (float)(by - originY);
+      const float u0 = pu.a + pu.dadx * fx + pu.dady * fy;
+      const float v0 = pv.a + pv.dadx * fx + pv.dady * fy;
+      const float w0 = pw.a + pw.dadx * fx + pw.dady * fy;
+
+      int32_t n = 0;
+      for (int32_t r = 0; r < rows; r++)
+      {
+        const float uRow = u0 + pu.dady * r, vRow = v0 + pv.dady * r, wRow = w0 + pw.dady * r;
+
+        if (blockMask[r] == 0xFF)
+        {
+          for (int32_t i = 0; i < 8; i++)
+          {
+            const float invW = 1.0f / (wRow + pw.dadx * i);
+            texU[n + i] = (uRow + pu.dadx * i) * invW;
+            texV[n + i] = (vRow + pv.dadx * i) * invW;
+          }
+          n += 8;
+          continue;
+        }
+
+        for (int32_t i = 0; i < 8; i++)
+        {
+          if (!(blockMask[r] & (1u << i))) continue;
+
+          const float invW = 1.0f / (wRow + pw.dadx * i);
+          texU[n] = (uRow + pu.dadx * i) * invW;
+          texV[n] = (vRow + pv.dadx * i) * invW;
+          n++;
+        }
+      }
+
+      if (n == 0) return;
+
+      // Texels per pixel from the derivatives of u and v at the block's centre
+      float lod = 0.0f;
+      if (texture->GetMipLevels() > 1)
+      {
+        const float cx = fx + 4.0f, cy = fy + 4.0f;
+        const float w = pw.a + pw.dadx * cx + pw.dady * cy;
+        const float uCentre = (pu.a + pu.dadx * cx + pu.dady * cy) / w;
+        const float vCentre = (pv.a + pv.dadx * cx + pv.dady * cy) / w;
+
+        const float dudx = (pu.dadx - uCentre * pw.dadx) / w * texture->width, dvdx = (pv.dadx - vCentre * pw.dadx) / w * texture->height;
+        const float dudy = (pu.dady - uCentre * pw.dady) / w * texture->width, dvdy = (pv.dady - vCentre * pw.dady) / w * texture->height;
+        const float rho2 = std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+
+        // Also false for NaN, left by a block centre beyond the horizon
+        if (w > 0.0f && rho2 > 1.0f)
+          lod = 0.5f * std::log2(rho2);
+      }
+
+      texture->SampleBatch(texU, texV, n, texels, pTexture->filter, lod);
+
+      const bool bPremultiplied = texture->IsPremultiplied();
+      const bool bTint = flat != tDX::WHITE;
+      n = 0;
+      for (int32_t r = 0; r < rows; r++)
+        for (int32_t i = 0; i < 8; i++)
+        {
+          if (!(blockMask[r] & (1u << i))) continue;
+
+          Pixel p = texels[n++];
+          if (bPremultiplied) p = tDX_Unpremultiply(p);
+          if (bTint) p = Pixel((uint8_t)tDX_Div255(p.r * flat.r), (uint8_t)tDX_Div255(p.g * flat.g), (uint8_t)tDX_Div255(p.b * flat.b), (uint8_t)tDX_Div255(p.a * flat.a));
+
+          if (nPixelMode == Pixel::Mode::NORMAL)
+          {
+            pixels[(by + r) * width + bx + i] = p;
+#ifdef T_DBG_OVERDRAW
+            tDX::Sprite::nOverdrawCount++;
+#endif
+          }
+          else
+            tDX_Plot(rs, bx + i, by + r, p);
+        }
+    };
+
+    // Lowest and highest edge value within a block relative to its first pixel
+    int64_t reachLo[3], reachHi[3];
+    for (int k = 0; k < 3; k++)
+    {
+      reachLo[k] = std::min<int64_t>(A[k] * 7 * 16, 0) + std::min<int64_t>(B[k] * 7 * 16, 0);
+      reachHi[k] = std::max<int64_t>(A[k] * 7 * 16, 0) + std::max<int64_t>(B[k] * 7 * 16, 0);
+    }
+
+    for (int32_t by = startY; by <= maxY; by += 8)
+    {
+      const int32_t rowEnd = std::min(by + 7, maxY);
+
+      int64_t e[3];
+      for (int k = 0; k < 3; k++)
+        e[k] = E0[k] + B[k] * ((int64_t)(by - startY) * 16) - A[k] * 8 * 16;
+
+      // Neighbouring blocks that are fully covered and need no depth test are
+      // filled together as spans, which are as fast as the flat fills
+      int32_t runStart = -1, runEnd = -1;
+      auto flushRun = [&]()
+      {
+        if (runStart < 0) return;
+        for (int32_t y = by; y <= rowEnd; y++)
+          tDX_FillPixels(pixels + y * width + runStart, runEnd - runStart, flat);
+#ifdef T_DBG_OVERDRAW
+        tDX::Sprite::nOverdrawCount += (runEnd - runStart) * (rowEnd - by + 1);
+#endif
+        runStart = -1;
+      };
+
+      bool bEntered = false;
+
+      for (int32_t bx = startX; bx <= maxX; bx += 8)
+      {
+        // Edge values at the block's first pixel centre
+        bool bSkip = false;
+        uint32_t nTest = 0;
+
+        for (int k = 0; k < 3; k++)
+        {
+          e[k] += A[k] * 8 * 16;
+
+          if (e[k] + reachHi[k] < 0) bSkip = true;
+          else if (e[k] + reachLo[k] < 0) nTest |= 1u << k;
+        }
+
+        // The blocks touched by a triangle are contiguous along a row
+        if (bSkip)
+        {
+          if (bEntered) break;
+          continue;
+        }
+
+        bEntered = true;
+
+        // Columns past the right side of the bounding box
+        const uint32_t nColumns = (uint32_t)std::min(maxX - bx + 1, 8);
+        const uint32_t colMask = (1u << nColumns) - 1;
+
+        if (nTest == 0 && !depth && bFast)
+        {
+          if (runStart < 0) runStart = bx;
+          runEnd = bx + (int32_t)nColumns;
+          continue;
+        }
 
-    e1 = (int)(dx1 >> 1);
+        flushRun();
 
-    for (int i = 0; i <= dx1; i++) {
-      t1xp = 0; t2xp = 0;
-      if (t1x < t2x) { minx = t1x; maxx = t2x; }
-      else { minx = t2x; maxx = t1x; }
-      // process first line until y value is about to change
-      while (i < dx1) {
-        e1 += dy1;
-        while (e1 >= dx1) {
-          e1 -= dx1;
-          if (changed1) { t1xp = signx1; break; }//t1x += signx1;
-          else          goto next3;
+        // Only edges crossing the block are tested, their values here fit in 32 bits
+        int32_t rowE[3], stepX[3], stepY[3];
+        for (int k = 0; k < 3; k++)
+        {
+          rowE[k] = (nTest & (1u << k)) ? (int32_t)e[k] : 0;
+          stepX[k] = (int32_t)(A[k] * 16);
+          stepY[k] = (int32_t)(B[k] * 16);
         }
-        if (changed1) break;
-        else   	   	  t1x += signx1;
-        if (i < dx1) i++;
-      }
-    next3:
-      // process second line until y value is about to change
-      while (t2x != x3) {
-        e2 += dy2;
-        while (e2 >= dx2) {
-          e2 -= dx2;
-          if (changed2) t2xp = signx2;
-          else          goto next4;
+
+        const float zBlock = pz.a + pz.dadx * (bx - originX) + pz.dady * (by - originY);
+        float zRow = zBlock;
+
+        for (int32_t y = by; y <= rowEnd; y++)
+        {
+          uint32_t mask = colMask;
+
+          for (int k = 0; k < 3 && mask; k++)
+          {
+            if (!(nTest & (1u << k))) continue;
+
+#if defined(T_PGE_SSE2)
+            // Sign bits of the 8 edge values are the pixels outside
+            const int32_t s = stepX[k];
+            const __m128i eLo = _mm_add_epi32(_mm_set1_epi32(rowE[k]), _mm_setr_epi32(0, s, 2 * s, 3 * s));
+            const __m128i eHi = _mm_add_epi32(eLo, _mm_set1_epi32(4 * s));
+            uint32_t outside = (uint32_t)(_mm_movemask_ps(_mm_castsi128_ps(eLo)) | _mm_movemask_ps(_mm_castsi128_ps(eHi)) << 4);
+            mask &= ~outside;
+#else
+            uint32_t inside = 0;
+            int32_t ev = rowE[k];
+            for (int32_t i = 0; i < 8; i++, ev += stepX[k])
+              inside |= (uint32_t)(ev >= 0) << i;
+            mask &= inside;
+#endif
+          }
+
+          if (pTexture)
+            blockMask[y - by] = mask;
+          else if (mask)
+            shadeRow(bx, y, mask, zRow);
+
+          for (int k = 0; k < 3; k++)
+            rowE[k] += stepY[k];
+          zRow += pz.dady;
         }
-        if (changed2)     break;
-        else              t2x += signx2;
+
+        if (pTexture)
+          shadeTexturedBlock(bx, by, rowEnd - by + 1, zBlock);
       }
-    next4:
 
-      if (minx > t1x) minx = t1x;
-      if (minx > t2x) minx = t2x;
-      if (maxx < t1x) maxx = t1x;
-      if (maxx < t2x) maxx = t2x;
-      drawline(minx, maxx, y);
-      if (!changed1) t1x += signx1;
-      t1x += t1xp;
-      if (!changed2) t2x += signx2;
-      t2x += t2xp;
-      y += 1;
-      if (y > y3) return;
+      // Also after leaving the loop early
+      flushRun();
     }
   }
 
@@ -1757,20 +5320,7 @@ namespace tDX
     if (sprite == nullptr)
       return;
 
-    if (scale > 1)
-    {
-      for (int32_t i = 0; i < sprite->width; i++)
-        for (int32_t j = 0; j < sprite->height; j++)
-          for (uint32_t is = 0; is < scale; is++)
-            for (uint32_t js = 0; js < scale; js++)
-              Draw(x + (i*scale) + is, y + (j*scale) + js, sprite->GetPixel(i, j));
-    }
-    else
-    {
-      for (int32_t i = 0; i < sprite->width; i++)
-        for (int32_t j = 0; j < sprite->height; j++)
-          Draw(x + i, y + j, sprite->GetPixel(i, j));
-    }
+    DrawPartialSprite(x, y, sprite, 0, 0, sprite->width, sprite->height, scale);
   }
 
   void PixelGameEngine::DrawPartialSprite(const tDX::vi2d& pos, Sprite *sprite, const tDX::vi2d& sourcepos, const tDX::vi2d& size, uint32_t scale)
@@ -1780,23 +5330,348 @@ namespace tDX
 
   void PixelGameEngine::DrawPartialSprite(int32_t x, int32_t y, Sprite *sprite, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale)
   {
-    if (sprite == nullptr)
+    if (sprite == nullptr || w <= 0 || h <= 0)
+      return;
+
+    // Scale 0 draws like 1, as it always did
+    scale = std::max(scale, 1u);
+
+    if (tDX_CanBlit(sprite, ox, oy, w, h))
+    {
+      const int32_t x1 = x + w * (int32_t)scale, y1 = y + h * (int32_t)scale;
+
+      if (pRecording || bTiling)
+      {
+        // A pending fill happens now, the tiles only read the sprite
+        sprite->GetData();
+
+        DrawCommand cmd = {};
+        cmd.type = DrawCommand::SPRITE;
+        cmd.x1 = x; cmd.y1 = y; cmd.x2 = w; cmd.y2 = h;
+        cmd.ox = ox; cmd.oy = oy;
+        cmd.pattern = scale;
+        cmd.target = sprite;
+
+        // Tiles are drawn in the same frame, a list keeps the pixels read now
+        if (pRecording)
+        {
+          cmd.ox = (int32_t)pRecording->vSprites.size();
+          cmd.oy = 0;
+          cmd.target = nullptr;
+          pRecording->vSprites.push_back(tDX_CopyArea(sprite, ox, oy, w, h));
+        }
+
+        tDX_DeferCommand(cmd, x, y, x1, y1);
+        return;
+      }
+
+      tDX_BlitSprite(tDX_TargetState(), x, y, sprite, ox, oy, w, h, scale);
+      tDX_MarkDirty(x, y, x1, y1);
       return;
+    }
+
+    // Areas reaching outside the sprite, where it would draw blank pixels or
+    // wrap around, go pixel by pixel with straight alpha
+    auto source = [&](int32_t i, int32_t j) { Pixel p = sprite->GetPixel(i, j); return sprite->IsPremultiplied() ? tDX_Unpremultiply(p) : p; };
+
+    for (int32_t j = 0; j < h * (int32_t)scale; j++)
+      for (int32_t i = 0; i < w * (int32_t)scale; i++)
+        Draw(x + i, y + j, source(ox + i / (int32_t)scale, oy + j / (int32_t)scale));
+  }
+
+  bool PixelGameEngine::tDX_CanBlit(Sprite* sprite, int32_t ox, int32_t oy, int32_t w, int32_t h) const
+  {
+    if (!pDrawTarget || !sprite->GetData())
+      return false;
+
+    // Inside the sprite every sample mode reads the same pixels. Outside it NORMAL
+    // sampling reads blank pixels, which only MASK and ALPHA leave out.
+    if (ox >= 0 && oy >= 0 && ox + w <= sprite->width && oy + h <= sprite->height)
+      return true;
+
+    return sprite->GetSampleMode() == Sprite::Mode::NORMAL && (nPixelMode == Pixel::Mode::MASK || nPixelMode == Pixel::Mode::ALPHA);
+  }
+
+  Sprite PixelGameEngine::tDX_CopyArea(Sprite* sprite, int32_t ox, int32_t oy, int32_t w, int32_t h)
+  {
+    Sprite copy(w, h);
+    copy.DiscardContents();
+    // Only sets the flag, every pixel is written below
+    if (sprite->IsPremultiplied())
+      copy.PremultiplyAlpha();
+
+    // Outside the sprite the blank pixels NORMAL sampling reads
+    Pixel* pData = copy.GetData();
+    const bool bInside = ox >= 0 && oy >= 0 && ox + w <= sprite->width && oy + h <= sprite->height;
+    for (int32_t j = 0; j < h; j++)
+      if (bInside)
+        sprite->CopyRow(ox, oy + j, w, pData + j * w);
+      else
+        for (int32_t i = 0; i < w; i++)
+          pData[j * w + i] = sprite->GetPixel(ox + i, oy + j);
 
-    if (scale > 1)
+    return copy;
+  }
+
+  void PixelGameEngine::tDX_BlitSprite(const RasterState& rs, int32_t x, int32_t y, Sprite* sprite, int32_t ox, int32_t oy, int32_t w, int32_t h, uint32_t scale) const
+  {
+    if (!rs.target) return;
+    const int32_t s = (int32_t)scale;
+
+    // The part of the source inside the sprite, tDX_CanBlit made sure the rest
+    // draws nothing. It is clipped to the target once.
+    const int32_t sx0 = std::max(ox, 0), sy0 = std::max(oy, 0);
+    const int32_t sx1 = std::min(ox + w, sprite->width), sy1 = std::min(oy + h, sprite->height);
+    const int32_t dx0 = x + (sx0 - ox) * s, dy0 = y + (sy0 - oy) * s;
+    const int32_t cx0 = std::max(dx0, rs.x0), cy0 = std::max(dy0, rs.y0);
+    const int32_t cx1 = std::min(x + (sx1 - ox) * s, rs.x1), cy1 = std::min(y + (sy1 - oy) * s, rs.y1);
+    if (cx0 >= cx1 || cy0 >= cy1) return;
+
+    const Pixel* pData = sprite->GetData();
+    const bool bRows = sprite->GetLayout() == Sprite::Layout::ROW_MAJOR;
+    // Premultiplied colour is only blended as such, the other modes get straight alpha
+    const bool bPremultiplied = sprite->IsPremultiplied();
+    const bool bConvert = bPremultiplied && nPixelMode != Pixel::Mode::ALPHA;
+    Pixel* pTarget = rs.target->GetData();
+    const int32_t nTargetWidth = rs.target->width;
+
+    // Unscaled rows stored in order are read in place
+    if (s == 1 && bRows && !bConvert)
     {
-      for (int32_t i = 0; i < w; i++)
-        for (int32_t j = 0; j < h; j++)
-          for (uint32_t is = 0; is < scale; is++)
-            for (uint32_t js = 0; js < scale; js++)
-              Draw(x + (i*scale) + is, y + (j*scale) + js, sprite->GetPixel(i + ox, j + oy));
+      for (int32_t cy = cy0; cy < cy1; cy++)
+      {
+        const Pixel* src = pData + (size_t)(sy0 + cy - dy0) * sprite->width + sx0 + cx0 - dx0;
+        tDX_WriteRow(pTarget + cy * nTargetWidth + cx0, src, cx0, cy, cx1 - cx0, bPremultiplied);
+      }
+      return;
     }
-    else
+
+    // Others are gathered into bands of up to 256 columns through a table of
+    // source columns. A source row is read once for all target rows it covers.
+    Pixel row[256];
+    int32_t columns[256];
+
+    for (int32_t bx = cx0; bx < cx1; bx += 256)
+    {
+      const int32_t n = std::min(cx1 - bx, 256);
+      for (int32_t i = 0; i < n; i++)
+        columns[i] = sx0 + (bx + i - dx0) / s;
+
+      int32_t nSourceRow = -1;
+      for (int32_t cy = cy0; cy < cy1; cy++)
+      {
+        const int32_t sy = sy0 + (cy - dy0) / s;
+        if (sy != nSourceRow)
+        {
+          if (s == 1)
+            sprite->CopyRow(columns[0], sy, n, row);
+          else if (bRows)
+          {
+            const Pixel* src = pData + (size_t)sy * sprite->width;
+            for (int32_t i = 0; i < n; i++)
+              row[i] = src[columns[i]];
+          }
+          else
+          {
+            for (int32_t i = 0; i < n; i++)
+              row[i] = pData[sprite->Offset(columns[i], sy)];
+          }
+
+          if (bConvert)
+            for (int32_t i = 0; i < n; i++)
+              row[i] = tDX_Unpremultiply(row[i]);
+
+          nSourceRow = sy;
+        }
+
+        tDX_WriteRow(pTarget + cy * nTargetWidth + bx, row, bx, cy, n, bPremultiplied);
+      }
+    }
+  }
+
+  void PixelGameEngine::tDX_WriteRow(Pixel* dst, const Pixel* src, int32_t x, int32_t y, int32_t count, bool bPremultiplied) const
+  {
+    switch (nPixelMode)
+    {
+    case Pixel::Mode::NORMAL:
+      std::memcpy(dst, src, count * sizeof(Pixel));
+      break;
+
+    case Pixel::Mode::MASK:
+      tDX_MaskRow(dst, src, count);
+      break;
+
+    case Pixel::Mode::ALPHA:
+      tDX_BlendRow(dst, src, count, tDX_BlendScale(), bPremultiplied);
+      break;
+
+    case Pixel::Mode::CUSTOM:
+      funcPixelMode(x, y, count, src, dst);
+      break;
+    }
+
+#ifdef T_DBG_OVERDRAW
+    tDX::Sprite::nOverdrawCount += count;
+#endif
+  }
+
+  void PixelGameEngine::tDX_MaskRow(Pixel* dst, const Pixel* src, int32_t count)
+  {
+    int32_t i = 0;
+
+#if defined(T_PGE_AVX2)
+    {
+      const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+
+      for (; i + 8 <= count; i += 8)
+      {
+        const __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        const __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(s, opaque), opaque);
+        const int bits = _mm256_movemask_epi8(m);
+
+        // Rows of sprites are mostly fully transparent or opaque pixels
+        if (bits == 0)
+          continue;
+        if (bits == -1)
+        {
+          _mm256_storeu_si256((__m256i*)(dst + i), s);
+          continue;
+        }
+
+        const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(d, s, m));
+      }
+    }
+#endif
+
+#if defined(T_PGE_SSE2)
     {
-      for (int32_t i = 0; i < w; i++)
-        for (int32_t j = 0; j < h; j++)
-          Draw(x + i, y + j, sprite->GetPixel(i + ox, j + oy));
+      const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+
+      for (; i + 4 <= count; i += 4)
+      {
+        const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        const __m128i m = _mm_cmpeq_epi32(_mm_and_si128(s, opaque), opaque);
+        const int bits = _mm_movemask_epi8(m);
+
+        if (bits == 0)
+          continue;
+        if (bits == 0xFFFF)
+        {
+          _mm_storeu_si128((__m128i*)(dst + i), s);
+          continue;
+        }
+
+        const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, d)));
+      }
     }
+#endif
+
+    for (; i < count; i++)
+      if (src[i].a == 255)
+        dst[i] = src[i];
+  }
+
+  void PixelGameEngine::DrawAffineSprite(const float m[6], Sprite *sprite, Sprite::Filter filter)
+  {
+    if (sprite == nullptr || !pDrawTarget || !sprite->GetData())
+      return;
+
+    const float det = m[0] * m[4] - m[1] * m[3];
+    if (det == 0.0f)
+      return;
+
+    // Target to sprite coordinates
+    const float a = m[4] / det, b = -m[1] / det, c = -m[3] / det, d = m[0] / det;
+    const float e = -(a * m[2] + b * m[5]), f = -(c * m[2] + d * m[5]);
+
+    // Bounding box of the corners, on the target
+    const float fw = (float)sprite->width, fh = (float)sprite->height;
+    const float cornerX[4] = { m[2], m[0] * fw + m[2], m[1] * fh + m[2], m[0] * fw + m[1] * fh + m[2] };
+    const float cornerY[4] = { m[5], m[3] * fw + m[5], m[4] * fh + m[5], m[3] * fw + m[4] * fh + m[5] };
+    auto clamp = [](float v, int32_t nMax) { return (int32_t)std::min(std::max(v, 0.0f), (float)nMax); };
+
+    const int32_t x0 = clamp(std::floor(*std::min_element(cornerX, cornerX + 4)), pDrawTarget->width);
+    const int32_t x1 = clamp(std::ceil(*std::max_element(cornerX, cornerX + 4)), pDrawTarget->width);
+    const int32_t y0 = clamp(std::floor(*std::min_element(cornerY, cornerY + 4)), pDrawTarget->height);
+    const int32_t y1 = clamp(std::ceil(*std::max_element(cornerY, cornerY + 4)), pDrawTarget->height);
+    if (x0 >= x1 || y0 >= y1)
+      return;
+
+    // log2 of the sprite pixels per target pixel picks the mip level
+    const float lod = 0.5f * std::log2(std::fabs(a * d - b * c));
+    const bool bDefer = pRecording || bTiling;
+    const bool bPremultiplied = sprite->IsPremultiplied();
+    const bool bConvert = bPremultiplied && (bDefer || nPixelMode != Pixel::Mode::ALPHA);
+
+    float u[256], v[256];
+    Pixel row[256];
+
+    for (int32_t y = y0; y < y1; y++)
+      for (int32_t bx = x0; bx < x1; bx += 256)
+      {
+        // Sprite coordinates at the pixel centres of up to 256 columns
+        const int32_t n = std::min(x1 - bx, 256);
+        const float u0 = a * (bx + 0.5f) + b * (y + 0.5f) + e;
+        const float v0 = c * (bx + 0.5f) + d * (y + 0.5f) + f;
+
+        // Only the columns landing inside the sprite are drawn
+        float lo = 0.0f, hi = (float)n;
+        auto inside = [&](float p0, float dp, float size)
+        {
+          if (dp == 0.0f)
+          {
+            if (p0 < 0.0f || p0 >= size) hi = 0.0f;
+            return;
+          }
+
+          float t0 = -p0 / dp, t1 = (size - p0) / dp;
+          if (dp < 0.0f) std::swap(t0, t1);
+          lo = std::max(lo, t0);
+          hi = std::min(hi, t1);
+        };
+        inside(u0, a, fw);
+        inside(v0, c, fh);
+        if (lo >= hi)
+          continue;
+
+        const int32_t i0 = (int32_t)std::ceil(lo), i1 = std::min((int32_t)std::ceil(hi), n);
+        const int32_t count = i1 - i0;
+        if (count <= 0)
+          continue;
+
+        for (int32_t i = 0; i < count; i++)
+        {
+          u[i] = (u0 + (float)(i0 + i) * a) / fw;
+          v[i] = (v0 + (float)(i0 + i) * c) / fh;
+        }
+
+        sprite->SampleBatch(u, v, count, row, filter, lod);
+
+        if (bConvert)
+          for (int32_t i = 0; i < count; i++)
+            row[i] = tDX_Unpremultiply(row[i]);
+
+        // Recorded and binned pixels go one by one
+        if (bDefer)
+        {
+          for (int32_t i = 0; i < count; i++)
+            Draw(bx + i0 + i, y, row[i]);
+        }
+        else
+          tDX_WriteRow(pDrawTarget->GetData() + y * pDrawTarget->width + bx + i0, row, bx + i0, y, count, bPremultiplied);
+      }
+
+    if (!bDefer)
+      tDX_MarkDirty(x0, y0, x1, y1);
+  }
+
+  void PixelGameEngine::DrawRotatedSprite(const tDX::vf2d& pos, Sprite *sprite, float fAngle, const tDX::vf2d& center, float fScale, Sprite::Filter filter)
+  {
+    const float c = std::cos(fAngle) * fScale, s = std::sin(fAngle) * fScale;
+    const float m[6] = { c, -s, pos.x - (c * center.x - s * center.y), s, c, pos.y - (s * center.x + c * center.y) };
+    DrawAffineSprite(m, sprite, filter);
   }
 
   void PixelGameEngine::DrawString(const tDX::vi2d& pos, const std::string& sText, Pixel col, uint32_t scale)
@@ -1806,50 +5681,189 @@ namespace tDX
 
   void PixelGameEngine::DrawString(int32_t x, int32_t y, const std::string& sText, Pixel col, uint32_t scale)
   {
-    int32_t sx = 0;
-    int32_t sy = 0;
+    DrawString(x, y, sText.c_str(), col, scale);
+  }
+
+  void PixelGameEngine::DrawString(int32_t x, int32_t y, const char* sText, Pixel col, uint32_t scale)
+  {
     Pixel::Mode m = nPixelMode;
     if (col.a != 255)
       SetPixelMode(Pixel::Mode::ALPHA);
     else
       SetPixelMode(Pixel::Mode::MASK);
 
-    for (auto c : sText)
+    if (bTextCache)
     {
-      if (c == '\n')
-      {
-        sx = 0; sy += 8 * scale;
-      }
-      else
-      {
-        int32_t ox = (c - 32) % 16;
-        int32_t oy = (c - 32) / 16;
+      for (const TextRun& run : tDX_LayoutText(sText).vRuns)
+        for (uint32_t s = 0; s < scale; s++)
+          FillSpan(x + run.x * (int32_t)scale, y + run.y * (int32_t)scale + s, run.len * (int32_t)scale, col);
+    }
+    else
+    {
+      int32_t sx = 0;
+      int32_t sy = 0;
 
-        if (scale > 1)
+      for (; *sText; sText++)
+      {
+        if (*sText == '\n')
         {
-          for (uint32_t i = 0; i < 8; i++)
-            for (uint32_t j = 0; j < 8; j++)
-              if (fontSprite->GetPixel(i + ox * 8, j + oy * 8).r > 0)
-                for (uint32_t is = 0; is < scale; is++)
-                  for (uint32_t js = 0; js < scale; js++)
-                    Draw(x + sx + (i*scale) + is, y + sy + (j*scale) + js, col);
+          sx = 0; sy += 8 * scale;
         }
         else
         {
-          for (uint32_t i = 0; i < 8; i++)
-            for (uint32_t j = 0; j < 8; j++)
-              if (fontSprite->GetPixel(i + ox * 8, j + oy * 8).r > 0)
-                Draw(x + sx + i, y + sy + j, col);
+          tDX_DrawGlyph(x + sx, y + sy, tDX_Glyph(*sText), col, scale);
+          sx += 8 * scale;
         }
-        sx += 8 * scale;
       }
     }
+
     SetPixelMode(m);
   }
 
+  void PixelGameEngine::EnableTextCache(bool bEnable)
+  {
+    bTextCache = bEnable;
+    if (!bTextCache)
+      mapTextLayouts.clear();
+  }
+
+  uint64_t PixelGameEngine::tDX_Glyph(char c) const
+  {
+    // Characters outside the font draw nothing but still take up their space
+    uint8_t n = (uint8_t)c;
+    return n >= 32 && n < 128 ? nFontGlyphs[n - 32] : 0;
+  }
+
+  void PixelGameEngine::tDX_DrawGlyph(int32_t x, int32_t y, uint64_t glyph, Pixel col, uint32_t scale)
+  {
+    if (!glyph) return;
+
+    // Opaque glyphs drawn right away and entirely inside the target are
+    // written a row of 8 pixels at a time under the row's mask
+    if (scale == 1 && col.a == 255 && !pRecording && !bTiling && pDrawTarget &&
+      x >= 0 && y >= 0 && x + 8 <= pDrawTarget->width && y + 8 <= pDrawTarget->height)
+    {
+      const int32_t width = pDrawTarget->width;
+      Pixel* d = pDrawTarget->GetData() + y * width + x;
+
+#if defined(T_PGE_SSE2)
+      const __m128i bitsLo = _mm_setr_epi32(1, 2, 4, 8);
+      const __m128i bitsHi = _mm_setr_epi32(16, 32, 64, 128);
+      const __m128i colour = _mm_set1_epi32((int)col.n);
+#endif
+
+      for (int32_t j = 0; j < 8; j++, d += width)
+      {
+        const uint32_t bits = (uint32_t)(glyph >> (j * 8)) & 0xFF;
+        if (!bits) continue;
+
+#if defined(T_PGE_SSE2)
+        const __m128i m = _mm_set1_epi32((int)bits);
+        const __m128i mLo = _mm_cmpeq_epi32(_mm_and_si128(m, bitsLo), bitsLo);
+        const __m128i mHi = _mm_cmpeq_epi32(_mm_and_si128(m, bitsHi), bitsHi);
+        const __m128i oldLo = _mm_loadu_si128((__m128i*)d), oldHi = _mm_loadu_si128((__m128i*)(d + 4));
+        _mm_storeu_si128((__m128i*)d, _mm_or_si128(_mm_and_si128(mLo, colour), _mm_andnot_si128(mLo, oldLo)));
+        _mm_storeu_si128((__m128i*)(d + 4), _mm_or_si128(_mm_and_si128(mHi, colour), _mm_andnot_si128(mHi, oldHi)));
+#else
+        for (int32_t i = 0; i < 8; i++)
+          if (bits & (1u << i)) d[i] = col;
+#endif
+
+#ifdef T_DBG_OVERDRAW
+        for (uint32_t n = bits; n; n &= n - 1) tDX::Sprite::nOverdrawCount++;
+#endif
+      }
+
+      tDX_MarkDirty(x, y, x + 8, y + 8);
+      return;
+    }
+
+    // Otherwise every run of set bits is a span, which blends, clips and defers as needed
+    for (int32_t j = 0; j < 8; j++)
+    {
+      const uint32_t bits = (uint32_t)(glyph >> (j * 8)) & 0xFF;
+
+      for (int32_t i = 0; i < 8;)
+      {
+        if (!(bits & (1u << i))) { i++; continue; }
+
+        int32_t start = i;
+        while (i < 8 && (bits & (1u << i))) i++;
+
+        for (uint32_t s = 0; s < scale; s++)
+          FillSpan(x + start * (int32_t)scale, y + j * (int32_t)scale + s, (i - start) * (int32_t)scale, col);
+      }
+    }
+  }
+
+  // Runs of one pixel row continue across neighbouring glyphs, so a string
+  // becomes a few long spans per row
+  const PixelGameEngine::TextLayout& PixelGameEngine::tDX_LayoutText(const char* sText)
+  {
+    // FNV-1a, the text itself is compared on a hit
+    uint64_t nHash = 14695981039346656037ull;
+    for (const char* c = sText; *c; c++)
+      nHash = (nHash ^ (uint8_t)*c) * 1099511628211ull;
+
+    auto it = mapTextLayouts.find(nHash);
+    if (it != mapTextLayouts.end() && it->second.sText == sText)
+      return it->second;
+
+    // Texts that keep changing would grow the cache forever
+    if (mapTextLayouts.size() >= 1024)
+      mapTextLayouts.clear();
+
+    TextLayout& layout = mapTextLayouts[nHash];
+    layout.sText = sText;
+    layout.vRuns.clear();
+
+    const char* line = sText;
+    for (int32_t ly = 0; ; ly += 8)
+    {
+      const char* end = line;
+      while (*end && *end != '\n') end++;
+
+      for (int32_t j = 0; j < 8; j++)
+      {
+        int32_t start = -1;
+        int32_t px = 0;
+
+        for (const char* c = line; c < end; c++)
+        {
+          const uint32_t bits = (uint32_t)(tDX_Glyph(*c) >> (j * 8)) & 0xFF;
+
+          for (int32_t i = 0; i < 8; i++, px++)
+          {
+            bool bSet = (bits & (1u << i)) != 0;
+            if (bSet && start < 0)
+              start = px;
+            else if (!bSet && start >= 0)
+            {
+              layout.vRuns.push_back({ start, ly + j, px - start });
+              start = -1;
+            }
+          }
+        }
+
+        if (start >= 0)
+          layout.vRuns.push_back({ start, ly + j, px - start });
+      }
+
+      if (!*end) break;
+      line = end + 1;
+    }
+
+    return layout;
+  }
+
   void PixelGameEngine::SetPixelMode(Pixel::Mode m)
   {
+    if (m == nPixelMode)
+      return;
+
+    tDX_FlushTiles();
     nPixelMode = m;
+    tDX_RecordState();
   }
 
   Pixel::Mode PixelGameEngine::GetPixelMode()
@@ -1859,15 +5873,26 @@ namespace tDX
 
   void PixelGameEngine::SetPixelMode(std::function<tDX::Pixel(const int x, const int y, const tDX::Pixel&, const tDX::Pixel&)> pixelMode)
   {
-    funcPixelMode = pixelMode;
+    SetPixelShader(std::move(pixelMode));
+  }
+
+  void PixelGameEngine::SetSpanShader(SpanShader shader)
+  {
+    tDX_FlushTiles();
+    funcPixelMode = std::move(shader);
     nPixelMode = Pixel::Mode::CUSTOM;
+    tDX_RecordState();
   }
 
   void PixelGameEngine::SetPixelBlend(float fBlend)
   {
+    fBlend = std::min(std::max(fBlend, 0.0f), 1.0f);
+    if (fBlend == fBlendFactor)
+      return;
+
+    tDX_FlushTiles();
     fBlendFactor = fBlend;
-    if (fBlendFactor < 0.0f) fBlendFactor = 0.0f;
-    if (fBlendFactor > 1.0f) fBlendFactor = 1.0f;
+    tDX_RecordState();
   }
 
   // User must override these functions as required. I have not made
@@ -1912,9 +5937,11 @@ namespace tDX
     nWindowHeight = y;
     tDX_UpdateViewport();
 
+#ifndef T_PGE_HEADLESS
     // If device already exists recreate resources
     if (m_d3dDevice)
       bResize = true;
+#endif
   }
 
   void PixelGameEngine::tDX_UpdateMouseWheel(int32_t delta)
@@ -1945,6 +5972,7 @@ namespace tDX
       nMousePosYcache = 0;
   }
 
+#ifdef _WIN32
   // Thanks @MaGetzUb for this, which allows sprites to be defined
   // at construction, by initialising the GDI subsystem
   static class GDIPlusStartup
@@ -1957,6 +5985,7 @@ namespace tDX
       Gdiplus::GdiplusStartup(&token, &startupInput, NULL);
     };
   } gdistartup;
+#endif
 
   void PixelGameEngine::tDX_ConstructFontSheet()
   {
@@ -1995,8 +6024,20 @@ namespace tDX
         if (++py == 48) { px++; py = 0; }
       }
     }
+
+    for (int c = 0; c < 96; c++)
+    {
+      int32_t ox = (c % 16) * 8;
+      int32_t oy = (c / 16) * 8;
+
+      for (int32_t j = 0; j < 8; j++)
+        for (int32_t i = 0; i < 8; i++)
+          if (fontSprite->GetPixel(ox + i, oy + j).r > 0)
+            nFontGlyphs[c] |= 1ull << (j * 8 + i);
+    }
   }
 
+#ifndef T_PGE_HEADLESS
   HWND PixelGameEngine::tDX_WindowCreate()
   {
     WNDCLASS wc = {};
@@ -2252,6 +6293,7 @@ namespace tDX
     }
     return DefWindowProc(hWnd, uMsg, wParam, lParam);
   }
+#endif
 
 
   // Need a couple of statics as these are singleton instances
@@ -2261,7 +6303,7 @@ namespace tDX
   std::map<size_t, uint8_t> PixelGameEngine::mapKeys;
   tDX::PixelGameEngine* tDX::PGEX::pge = nullptr;
 #ifdef T_DBG_OVERDRAW
-  int tDX::Sprite::nOverdrawCount = 0;
+  std::atomic<int> tDX::Sprite::nOverdrawCount{ 0 };
 #endif
   //=============================================================
 }
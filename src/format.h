@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// The number TextBuffer::appendFixed prints, scaled by 10^precision, with the
+// sign in the lowest bit so -0.00 and 0.00 differ just like their text. Two
+// values print the same text exactly when their keys are equal. Precision is 0 to 6.
+inline int64_t QuantizeFixed(float value, int precision)
+{
+  static constexpr double scale[] = { 1.0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+
+  const double scaled = (double)value * scale[precision < 0 ? 0 : precision > 6 ? 6 : precision];
+
+  // Infinity, NaN and values too big for exact doubles are keyed by their bits
+  if (!(std::fabs(scaled) < 1e15))
+  {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return INT64_MIN + bits;
+  }
+
+  // A float times a power of ten up to 10^6 is exact in a double, so rounding
+  // it to even gives the same digits as printf
+  return std::llrint(std::fabs(scaled)) * 2 + (std::signbit(value) ? 1 : 0);
+}
+
+// Text built in place without iostreams or allocations, input that does not
+// fit is cut off
+template <size_t N>
+class TextBuffer
+{
+public:
+  void clear() { m_length = 0; m_text[0] = '\0'; }
+
+  const char* c_str() const { return m_text; }
+  size_t size() const { return m_length; }
+
+  TextBuffer& append(char c)
+  {
+    if (m_length < N)
+    {
+      m_text[m_length++] = c;
+      m_text[m_length] = '\0';
+    }
+
+    return *this;
+  }
+
+  TextBuffer& append(const char* text)
+  {
+    while (*text && m_length < N)
+      m_text[m_length++] = *text++;
+
+    m_text[m_length] = '\0';
+    return *this;
+  }
+
+  // Right aligned in width columns with precision decimals, the same text as
+  // setw(width) << fixed << setprecision(precision) << value
+  TextBuffer& appendFixed(float value, int width, int precision)
+  {
+    precision = precision < 0 ? 0 : precision > 6 ? 6 : precision;
+    const int64_t key = QuantizeFixed(value, precision);
+
+    if (key < 0)
+    {
+      char text[64];
+      std::snprintf(text, sizeof(text), "%*.*f", width, precision, value);
+      return append(text);
+    }
+
+    // Digits are collected backwards, the magnitude fits in 50 bits
+    char digits[32];
+    int n = 0;
+    int64_t magnitude = key / 2;
+
+    for (int i = 0; i < precision; i++, magnitude /= 10)
+      digits[n++] = (char)('0' + magnitude % 10);
+
+    if (precision > 0)
+      digits[n++] = '.';
+
+    do
+    {
+      digits[n++] = (char)('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude > 0);
+
+    if (key & 1)
+      digits[n++] = '-';
+
+    for (int i = n; i < width; i++)
+      append(' ');
+
+    while (n > 0)
+      append(digits[--n]);
+
+    return *this;
+  }
+
+private:
+  char m_text[N + 1] = {};
+  size_t m_length = 0;
+};
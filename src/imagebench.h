@@ -0,0 +1,556 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "engine/tPixelGameEngine.h"
+
+// Encoders for the images the decoders of Sprite are checked against. They
+// write every filter, block type and pixel format, not small files.
+namespace encode
+{
+  // Bits of a DEFLATE stream, least significant first
+  class BitWriter
+  {
+  public:
+    void put(uint32_t value, int count)
+    {
+      for (int i = 0; i < count; i++)
+      {
+        if (m_count == 0) m_bytes.push_back(0);
+        m_bytes.back() |= (uint8_t)(((value >> i) & 1) << m_count);
+        m_count = (m_count + 1) & 7;
+      }
+    }
+
+    // Huffman codes go from their top bit on
+    void putCode(uint32_t code, int length)
+    {
+      for (int i = length - 1; i >= 0; i--)
+        put((code >> i) & 1, 1);
+    }
+
+    void align() { m_count = 0; }
+    std::vector<uint8_t>& bytes() { return m_bytes; }
+
+  private:
+    std::vector<uint8_t> m_bytes;
+    int m_count = 0;
+  };
+
+  // Canonical codes of a set of code lengths
+  inline std::vector<uint32_t> huffmanCodes(const std::vector<uint8_t>& lengths)
+  {
+    uint32_t count[16] = {}, next[16] = {};
+    for (uint8_t length : lengths)
+      count[length]++;
+    count[0] = 0;
+
+    for (int length = 1; length < 16; length++)
+      next[length] = (next[length - 1] + count[length - 1]) << 1;
+
+    std::vector<uint32_t> codes(lengths.size());
+    for (size_t i = 0; i < lengths.size(); i++)
+      if (lengths[i])
+        codes[i] = next[lengths[i]]++;
+    return codes;
+  }
+
+  enum class Blocks { Stored, Fixed, Dynamic };
+
+  // zlib stream of data. Fixed and dynamic blocks hold greedy LZ77 matches, the
+  // dynamic codes are complete sets that differ from the fixed ones.
+  inline std::vector<uint8_t> zlib(const std::vector<uint8_t>& data, Blocks blocks)
+  {
+    BitWriter bits;
+    bits.put(0x78, 8);
+    bits.put(0x01, 8);
+
+    if (blocks == Blocks::Stored)
+    {
+      // Small blocks, so that images span several
+      size_t offset = 0;
+      do
+      {
+        const size_t length = std::min<size_t>(data.size() - offset, 1000);
+        bits.put(offset + length == data.size(), 1);
+        bits.put(0, 2);
+        bits.align();
+        bits.put((uint32_t)length, 16);
+        bits.put((uint32_t)~length & 0xFFFF, 16);
+        for (size_t i = 0; i < length; i++)
+          bits.put(data[offset + i], 8);
+        offset += length;
+      } while (offset < data.size());
+    }
+    else
+    {
+      std::vector<uint8_t> literalLengths(288), distanceLengths(30);
+      bits.put(1, 1);
+
+      if (blocks == Blocks::Fixed)
+      {
+        bits.put(1, 2);
+        std::fill(literalLengths.begin(), literalLengths.begin() + 144, (uint8_t)8);
+        std::fill(literalLengths.begin() + 144, literalLengths.begin() + 256, (uint8_t)9);
+        std::fill(literalLengths.begin() + 256, literalLengths.begin() + 280, (uint8_t)7);
+        std::fill(literalLengths.begin() + 280, literalLengths.end(), (uint8_t)8);
+        std::fill(distanceLengths.begin(), distanceLengths.end(), (uint8_t)5);
+      }
+      else
+      {
+        literalLengths.resize(286);
+        std::fill(literalLengths.begin(), literalLengths.begin() + 256, (uint8_t)9);
+        std::fill(literalLengths.begin() + 256, literalLengths.begin() + 258, (uint8_t)5);
+        std::fill(literalLengths.begin() + 258, literalLengths.end(), (uint8_t)6);
+        std::fill(distanceLengths.begin(), distanceLengths.begin() + 2, (uint8_t)4);
+        std::fill(distanceLengths.begin() + 2, distanceLengths.end(), (uint8_t)5);
+
+        // The code lengths of both sets run length coded, by a code of eight
+        // 3 bit symbols: lengths 0, 4, 5, 6 and 9 and the repeat codes 16, 17, 18
+        static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+        std::vector<uint8_t> codeLengthLengths(19);
+        for (int symbol : { 0, 4, 5, 6, 9, 16, 17, 18 })
+          codeLengthLengths[symbol] = 3;
+        const std::vector<uint32_t> codeLengthCodes = huffmanCodes(codeLengthLengths);
+
+        bits.put(2, 2);
+        bits.put(286 - 257, 5);
+        bits.put(30 - 1, 5);
+        bits.put(19 - 4, 4);
+        for (int i = 0; i < 19; i++)
+          bits.put(codeLengthLengths[order[i]], 3);
+
+        std::vector<uint8_t> all(literalLengths);
+        all.insert(all.end(), distanceLengths.begin(), distanceLengths.end());
+
+        for (size_t i = 0; i < all.size();)
+        {
+          size_t run = 1;
+          while (i + run < all.size() && all[i + run] == all[i] && run < 7)
+            run++;
+
+          bits.putCode(codeLengthCodes[all[i]], 3);
+          if (run >= 4)
+          {
+            bits.putCode(codeLengthCodes[16], 3);
+            bits.put((uint32_t)run - 4, 2);
+          }
+          else
+            run = 1;
+          i += run;
+        }
+      }
+
+      const std::vector<uint32_t> literalCodes = huffmanCodes(literalLengths), distanceCodes = huffmanCodes(distanceLengths);
+
+      static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+      static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+      static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+      static const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+      auto literal = [&](uint32_t symbol) { bits.putCode(literalCodes[symbol], literalLengths[symbol]); };
+
+      // Last position of every 3 byte hash, matches are verified
+      std::vector<int64_t> head(1 << 15, -1);
+      auto hash = [&](size_t i) { return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & 0x7FFF; };
+
+      for (size_t i = 0; i < data.size();)
+      {
+        size_t length = 0, distance = 0;
+        if (i + 3 <= data.size())
+        {
+          const int64_t candidate = head[hash(i)];
+          head[hash(i)] = (int64_t)i;
+
+          if (candidate >= 0 && i - (size_t)candidate <= 32768)
+          {
+            const size_t limit = std::min<size_t>(258, data.size() - i);
+            while (length < limit && data[(size_t)candidate + length] == data[i + length])
+              length++;
+            distance = i - (size_t)candidate;
+          }
+        }
+
+        if (length < 3)
+        {
+          literal(data[i++]);
+          continue;
+        }
+
+        int l = 28;
+        while (lengthBase[l] > length) l--;
+        literal(257 + l);
+        bits.put((uint32_t)(length - lengthBase[l]), lengthExtra[l]);
+
+        int d = 29;
+        while (distanceBase[d] > distance) d--;
+        bits.putCode(distanceCodes[d], distanceLengths[d]);
+        bits.put((uint32_t)(distance - distanceBase[d]), distanceExtra[d]);
+
+        i += length;
+      }
+
+      literal(256);
+    }
+
+    // Adler-32, not checked by the decoder but part of the stream
+    uint32_t a = 1, b = 0;
+    for (uint8_t byte : data)
+    {
+      a = (a + byte) % 65521;
+      b = (b + a) % 65521;
+    }
+
+    std::vector<uint8_t>& out = bits.bytes();
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out.push_back((uint8_t)((b << 16 | a) >> shift));
+    return out;
+  }
+
+  // Samples of an image in the layout of PNG and the pixels it decodes to
+  struct PngImage
+  {
+    uint32_t width, height;
+    uint8_t colour, depth;
+    bool interlaced;
+    std::vector<uint16_t> samples;
+    std::vector<tDX::Pixel> palette;
+    bool transparentKey = false;
+    uint16_t key[3] = {};
+  };
+
+  inline uint32_t pngChannels(uint8_t colour) { return colour == 2 ? 3 : colour == 4 ? 2 : colour == 6 ? 4 : 1; }
+
+  // filter 0 to 4 for all rows, 5 for each row its own
+  inline std::vector<uint8_t> png(const PngImage& image, int filter, Blocks blocks)
+  {
+    const uint32_t channels = pngChannels(image.colour);
+    const size_t pixelBits = channels * image.depth;
+    const size_t bpp = std::max<size_t>(pixelBits / 8, 1);
+
+    // Rows of a pass packed and filtered one after the other
+    std::vector<uint8_t> raw;
+    auto addPass = [&](uint32_t x0, uint32_t y0, uint32_t dx, uint32_t dy)
+    {
+      const uint32_t w = (image.width - x0 + dx - 1) / dx, h = (image.height - y0 + dy - 1) / dy;
+      if (x0 >= image.width || y0 >= image.height || w == 0 || h == 0) return;
+
+      const size_t rowBytes = (w * pixelBits + 7) / 8;
+      std::vector<uint8_t> previous(rowBytes), row(rowBytes);
+
+      for (uint32_t j = 0; j < h; j++)
+      {
+        std::fill(row.begin(), row.end(), (uint8_t)0);
+        for (uint32_t i = 0; i < w * channels; i++)
+        {
+          const uint32_t x = x0 + (i / channels) * dx, y = y0 + j * dy;
+          const uint16_t sample = image.samples[((size_t)y * image.width + x) * channels + i % channels];
+
+          if (image.depth == 16)
+          {
+            row[i * 2] = (uint8_t)(sample >> 8);
+            row[i * 2 + 1] = (uint8_t)sample;
+          }
+          else
+          {
+            const size_t bit = i * image.depth;
+            row[bit / 8] |= (uint8_t)(sample << (8 - image.depth - bit % 8));
+          }
+        }
+
+        const int rowFilter = filter == 5 ? (int)(j % 5) : filter;
+        raw.push_back((uint8_t)rowFilter);
+        for (size_t i = 0; i < rowBytes; i++)
+        {
+          const int a = i >= bpp ? row[i - bpp] : 0, b = previous[i], c = i >= bpp ? previous[i - bpp] : 0;
+          const int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+          const int predictor[5] = { 0, a, b, (a + b) / 2, pa <= pb && pa <= pc ? a : pb <= pc ? b : c };
+          raw.push_back((uint8_t)(row[i] - predictor[rowFilter]));
+        }
+
+        previous.swap(row);
+      }
+    };
+
+    if (image.interlaced)
+    {
+      addPass(0, 0, 8, 8); addPass(4, 0, 8, 8); addPass(0, 4, 4, 8); addPass(2, 0, 4, 4);
+      addPass(0, 2, 2, 4); addPass(1, 0, 2, 2); addPass(0, 1, 1, 2);
+    }
+    else
+      addPass(0, 0, 1, 1);
+
+    std::vector<uint8_t> file = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    auto chunk = [&](const char* type, const std::vector<uint8_t>& body)
+    {
+      const uint32_t length = (uint32_t)body.size();
+      const uint8_t header[8] = { (uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length,
+        (uint8_t)type[0], (uint8_t)type[1], (uint8_t)type[2], (uint8_t)type[3] };
+      file.insert(file.end(), header, header + 8);
+      file.insert(file.end(), body.begin(), body.end());
+
+      uint32_t crc = 0xFFFFFFFF;
+      auto crcByte = [&](uint8_t byte)
+      {
+        crc ^= byte;
+        for (int k = 0; k < 8; k++)
+          crc = crc >> 1 ^ (0xEDB88320 & (0 - (crc & 1)));
+      };
+      for (int i = 4; i < 8; i++) crcByte(header[i]);
+      for (uint8_t byte : body) crcByte(byte);
+      crc = ~crc;
+      file.insert(file.end(), { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc });
+    };
+
+    chunk("IHDR", { (uint8_t)(image.width >> 24), (uint8_t)(image.width >> 16), (uint8_t)(image.width >> 8), (uint8_t)image.width,
+      (uint8_t)(image.height >> 24), (uint8_t)(image.height >> 16), (uint8_t)(image.height >> 8), (uint8_t)image.height,
+      image.depth, image.colour, 0, 0, (uint8_t)image.interlaced });
+
+    if (image.colour == 3)
+    {
+      std::vector<uint8_t> colours, alphas;
+      for (const tDX::Pixel& p : image.palette)
+      {
+        colours.insert(colours.end(), { p.r, p.g, p.b });
+        alphas.push_back(p.a);
+      }
+      chunk("PLTE", colours);
+      chunk("tRNS", alphas);
+    }
+    else if (image.transparentKey)
+    {
+      std::vector<uint8_t> key;
+      for (uint32_t i = 0; i < (image.colour == 0 ? 1u : 3u); i++)
+        key.insert(key.end(), { (uint8_t)(image.key[i] >> 8), (uint8_t)image.key[i] });
+      chunk("tRNS", key);
+    }
+
+    // Split in two IDAT chunks, which are one stream
+    const std::vector<uint8_t> compressed = zlib(raw, blocks);
+    const size_t half = compressed.size() / 2;
+    chunk("IDAT", std::vector<uint8_t>(compressed.begin(), compressed.begin() + half));
+    chunk("IDAT", std::vector<uint8_t>(compressed.begin() + half, compressed.end()));
+    chunk("IEND", {});
+    return file;
+  }
+
+  inline std::vector<tDX::Pixel> pngPixels(const PngImage& image)
+  {
+    const uint32_t channels = pngChannels(image.colour);
+    const uint32_t maximum = (1u << image.depth) - 1;
+    auto to8 = [&](uint32_t v) { return (uint8_t)(image.depth == 16 ? v >> 8 : v * 255 / maximum); };
+
+    std::vector<tDX::Pixel> pixels(image.width * image.height);
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+      const uint16_t* s = &image.samples[i * channels];
+      switch (image.colour)
+      {
+      case 0: pixels[i] = tDX::Pixel(to8(s[0]), to8(s[0]), to8(s[0]), image.transparentKey && s[0] == image.key[0] ? 0 : 255); break;
+      case 2:
+      {
+        const bool transparent = image.transparentKey && s[0] == image.key[0] && s[1] == image.key[1] && s[2] == image.key[2];
+        pixels[i] = tDX::Pixel(to8(s[0]), to8(s[1]), to8(s[2]), transparent ? 0 : 255);
+        break;
+      }
+      case 3: pixels[i] = image.palette[s[0]]; break;
+      case 4: pixels[i] = tDX::Pixel(to8(s[0]), to8(s[0]), to8(s[0]), to8(s[1])); break;
+      default: pixels[i] = tDX::Pixel(to8(s[0]), to8(s[1]), to8(s[2]), to8(s[3])); break;
+      }
+    }
+    return pixels;
+  }
+
+  // Every operation of QOI, runs limited to 62 pixels
+  inline std::vector<uint8_t> qoi(uint32_t width, uint32_t height, uint8_t channels, const std::vector<tDX::Pixel>& pixels)
+  {
+    std::vector<uint8_t> out = { 'q', 'o', 'i', 'f',
+      (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+      (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height, channels, 0 };
+
+    tDX::Pixel seen[64];
+    std::fill_n(seen, 64, tDX::Pixel(0, 0, 0, 0));
+    tDX::Pixel previous(0, 0, 0, 255);
+    uint32_t run = 0;
+
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+      const tDX::Pixel p = pixels[i];
+      if (p == previous)
+      {
+        if (++run == 62 || i + 1 == pixels.size())
+        {
+          out.push_back((uint8_t)(0xC0 | (run - 1)));
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run)
+      {
+        out.push_back((uint8_t)(0xC0 | (run - 1)));
+        run = 0;
+      }
+
+      const int index = (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64;
+      if (seen[index] == p)
+        out.push_back((uint8_t)index);
+      else
+      {
+        seen[index] = p;
+        const int dr = (int8_t)(p.r - previous.r), dg = (int8_t)(p.g - previous.g), db = (int8_t)(p.b - previous.b);
+
+        if (p.a != previous.a)
+          out.insert(out.end(), { 0xFF, p.r, p.g, p.b, p.a });
+        else if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+          out.push_back((uint8_t)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+        else if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7)
+          out.insert(out.end(), { (uint8_t)(0x80 | (dg + 32)), (uint8_t)((dr - dg + 8) << 4 | (db - dg + 8)) });
+        else
+          out.insert(out.end(), { 0xFE, p.r, p.g, p.b });
+      }
+
+      previous = p;
+    }
+
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+    return out;
+  }
+}
+
+// Encodes images of every PNG colour type and bit depth, with every filter,
+// block type and Adam7, and QOI images, decodes them with
+// Sprite::LoadFromMemory and compares the pixels. Prints the failures and the
+// decode times of a large image, returns false if one of them decodes wrong.
+inline bool RunImageBenchmark()
+{
+  std::mt19937 rng(1);
+  bool ok = true;
+
+  auto decodes = [&](const std::vector<uint8_t>& file, uint32_t width, uint32_t height, const std::vector<tDX::Pixel>& expected)
+  {
+    tDX::Sprite sprite;
+    if (sprite.LoadFromMemory(file.data(), file.size()) != tDX::OK || sprite.width != (int32_t)width || sprite.height != (int32_t)height)
+      return false;
+    return std::equal(expected.begin(), expected.end(), sprite.GetData());
+  };
+
+  // Smooth with some noise, so that the filters and matches have work to do
+  auto makePng = [&](uint32_t width, uint32_t height, uint8_t colour, uint8_t depth, bool interlaced)
+  {
+    encode::PngImage image = { width, height, colour, depth, interlaced, {}, {} };
+    const uint32_t channels = encode::pngChannels(colour);
+    const uint32_t maximum = colour == 3 ? std::min((1u << depth), 256u) - 1 : (1u << depth) - 1;
+
+    for (uint32_t y = 0; y < height; y++)
+      for (uint32_t x = 0; x < width; x++)
+        for (uint32_t c = 0; c < channels; c++)
+        {
+          const uint32_t gradient = (x * (c + 1) * 5 + y * 3) * (maximum + 1) / (width * 8 + height * 3);
+          image.samples.push_back((uint16_t)std::min<uint32_t>(gradient + (rng() % 8 == 0 ? rng() % 3 : 0), maximum));
+        }
+
+    if (colour == 3)
+      for (uint32_t i = 0; i <= maximum; i++)
+        image.palette.push_back(tDX::Pixel((uint8_t)rng(), (uint8_t)rng(), (uint8_t)rng(), (uint8_t)rng()));
+    else if (colour == 0 || colour == 2)
+    {
+      image.transparentKey = true;
+      for (uint32_t c = 0; c < channels; c++)
+        image.key[c] = image.samples[((height / 2) * width + width / 2) * channels + c];
+    }
+
+    return image;
+  };
+
+  const struct { uint8_t colour, depth; } formats[] =
+  {
+    { 0, 1 }, { 0, 2 }, { 0, 4 }, { 0, 8 }, { 0, 16 }, { 2, 8 }, { 2, 16 },
+    { 3, 1 }, { 3, 2 }, { 3, 4 }, { 3, 8 }, { 4, 8 }, { 4, 16 }, { 6, 8 }, { 6, 16 },
+  };
+  const char* filterNames[] = { "None", "Sub", "Up", "Average", "Paeth", "mixed" };
+  const char* blockNames[] = { "stored", "fixed", "dynamic" };
+
+  int tests = 0, failures = 0;
+  for (const auto& format : formats)
+    for (bool interlaced : { false, true })
+      for (int filter = 0; filter < 6; filter++)
+        for (int blocks = 0; blocks < 3; blocks++)
+        {
+          const encode::PngImage image = makePng(61, 37, format.colour, format.depth, interlaced);
+          tests++;
+          if (!decodes(encode::png(image, filter, (encode::Blocks)blocks), image.width, image.height, encode::pngPixels(image)))
+          {
+            std::printf("  PNG colour type %d, %d bits%s, %s filter, %s blocks decodes wrong\n", format.colour, format.depth,
+              interlaced ? ", Adam7" : "", filterNames[filter], blockNames[blocks]);
+            failures++;
+          }
+        }
+
+  // Random walks of runs, small steps, repeats and jumps
+  auto makeQoi = [&](uint32_t width, uint32_t height, uint8_t channels)
+  {
+    std::vector<tDX::Pixel> pixels;
+    tDX::Pixel p(100, 100, 100, 255);
+    for (uint32_t i = 0; i < width * height; i++)
+    {
+      switch (rng() % 6)
+      {
+      case 0: p = tDX::Pixel((uint8_t)rng(), (uint8_t)rng(), (uint8_t)rng(), channels == 4 ? (uint8_t)rng() : 255); break;
+      case 1: p.r += (uint8_t)(rng() % 4 - 2); p.g += (uint8_t)(rng() % 4 - 2); p.b += (uint8_t)(rng() % 4 - 2); break;
+      case 2: { const uint8_t d = (uint8_t)(rng() % 61 - 30); p.r += (uint8_t)(d + rng() % 16 - 8); p.g += d; p.b += (uint8_t)(d + rng() % 16 - 8); break; }
+      case 3: if (!pixels.empty()) p = pixels[pixels.size() - 1 - rng() % std::min<size_t>(pixels.size(), 50)]; break;
+      default: break;
+      }
+      pixels.push_back(p);
+    }
+    return pixels;
+  };
+
+  for (const uint8_t channels : { 3, 4 })
+    for (const uint32_t size : { 1u, 9u, 64u, 200u })
+    {
+      const std::vector<tDX::Pixel> pixels = makeQoi(size, size / 2 + 1, channels);
+      tests++;
+      if (!decodes(encode::qoi(size, size / 2 + 1, channels, pixels), size, size / 2 + 1, pixels))
+      {
+        std::printf("  QOI with %d channels, %ux%u decodes wrong\n", channels, size, size / 2 + 1);
+        failures++;
+      }
+    }
+
+  std::printf("Image round trips: %d of %d decode correctly\n", tests - failures, tests);
+  ok = failures == 0;
+
+  // Nanoseconds per pixel of decoding a large image, the best of a few tries
+  constexpr uint32_t size = 1024;
+  auto time = [&](const char* name, const std::vector<uint8_t>& file)
+  {
+    double best = 1e30;
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+      tDX::Sprite sprite;
+      const auto start = std::chrono::steady_clock::now();
+      sprite.LoadFromMemory(file.data(), file.size());
+      const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count() / (size * size));
+    }
+
+    std::printf("  %-28s %7.2f ns %8zu KB\n", name, best, file.size() / 1024);
+  };
+
+  std::printf("Decoding %ux%u RGBA, per pixel\n", size, size);
+  const encode::PngImage image = makePng(size, size, 6, 8, false);
+  time("PNG, Paeth, dynamic", encode::png(image, 4, encode::Blocks::Dynamic));
+  time("PNG, Paeth, stored", encode::png(image, 4, encode::Blocks::Stored));
+  time("QOI", encode::qoi(size, size, 4, encode::pngPixels(image)));
+
+  std::printf(ok ? "All results match\n" : "Some results do not match\n");
+
+  return ok;
+}
@@ -1,11 +1,18 @@
 #include <array>
-#include <iomanip>
-#include <sstream>
+#include <random>
 
 #define T_PGE_APPLICATION
 #include "engine/tPixelGameEngine.h"
 
-#define PI 3.14159265358979323846f
+#include "src/format.h"
+#include "src/imagebench.h"
+#include "src/math.h"
+#include "src/mathbench.h"
+#include "src/mesh.h"
+#include "src/pipeline.h"
+#include "src/scene.h"
+#include "src/spritebench.h"
+#include "src/transform.h"
 
 using namespace std;
 
@@ -15,122 +22,106 @@ namespace g
   constexpr uint32_t screenHeight = 380;
 };
 
-using float4x4 = array<array<float, 4>, 4>;
-
-struct float4 { float x, y, z, w; };
-struct float3 { float x, y, z; };
-struct float2 { float x, y; };
-
-// Utils methods
-float toRad(float deg) { return deg * PI / 180.0f; }
-float dot(const float4& v1, const float4& v2) { return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z + v1.w * v2.w; }
-float dot(const float3& v1, const float3& v2) { return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z; }
-
-float3 cross(const float3& v1, const float3& v2)
-{
-  return { v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x };
-}
-
-float3 normalize(const float3& v1)
+class MatrixDemo : public tDX::PixelGameEngine
 {
-  float length = sqrt(v1.x * v1.x + v1.y * v1.y + v1.z * v1.z);
-
-  float3 normalized =
+public:
+  MatrixDemo()
   {
-    v1.x / length,
-    v1.y / length,
-    v1.z / length,
-  };
+    sAppName = "3D matrix demo";
 
-  return normalized;
-}
+    m_mesh.positions.resize(m_cube.size());
+    for (size_t i = 0; i < m_cube.size(); i++)
+      m_mesh.positions.set(i, m_cube[i]);
 
-// Operator overloading
+    for (const auto& face : m_cubeFaces)
+      AddPolygon(m_mesh, face.data(), face.size());
 
-float3 operator-(const float3 &v1) { return { -v1.x, -v1.y, -v1.z }; }
-float3 operator-(const float3 &v1, const float3 &v2)
-{
-  float3 difference =
-  {
-    v1.x - v2.x,
-    v1.y - v2.y,
-    v1.z - v2.z,
-  };
+    BuildEdgeList(m_mesh);
+    ComputeFaceNormals(m_mesh);
+    ComputeBoundingSphere(m_mesh);
+  }
 
-  return difference;
-}
+  // Wireframe, depth buffered solid faces, or solid faces filled by the integer
+  // scanline FillTriangle without depth test for comparison, or depth buffered
+  // textured faces
+  enum class RenderMode { Wireframe, Solid, Scanline, Textured };
 
-float4x4 operator*(const float4x4& m1, const float4x4& m2)
-{
-  const float4 row_11 = { m1[0][0], m1[0][1], m1[0][2], m1[0][3] };
-  const float4 row_21 = { m1[1][0], m1[1][1], m1[1][2], m1[1][3] };
-  const float4 row_31 = { m1[2][0], m1[2][1], m1[2][2], m1[2][3] };
-  const float4 row_41 = { m1[3][0], m1[3][1], m1[3][2], m1[3][3] };
+  void SetRenderMode(RenderMode mode)
+  {
+    m_renderMode = mode;
+  }
 
-  const float4 col_12 = { m2[0][0], m2[1][0], m2[2][0], m2[3][0] };
-  const float4 col_22 = { m2[0][1], m2[1][1], m2[2][1], m2[3][1] };
-  const float4 col_32 = { m2[0][2], m2[1][2], m2[2][2], m2[3][2] };
-  const float4 col_42 = { m2[0][3], m2[1][3], m2[2][3], m2[3][3] };
+  // Replaces the cube by a mesh loaded from an OBJ file
+  bool LoadMesh(const string& file)
+  {
+    Mesh mesh;
+    if (LoadObj(file, mesh) != tDX::OK || mesh.positions.size() == 0)
+      return false;
 
-  float4x4 mul =
-  {{
-    {{ dot(row_11, col_12), dot(row_11, col_22), dot(row_11, col_32), dot(row_11, col_42) }},
-    {{ dot(row_21, col_12), dot(row_21, col_22), dot(row_21, col_32), dot(row_21, col_42) }},
-    {{ dot(row_31, col_12), dot(row_31, col_22), dot(row_31, col_32), dot(row_31, col_42) }},
-    {{ dot(row_41, col_12), dot(row_41, col_22), dot(row_41, col_32), dot(row_41, col_42) }},
-  }};
+    FitToUnitCube(mesh);
+    m_mesh = move(mesh);
 
-  return mul;
-}
-
-float4 operator*(const float4x4& m1, const float4& v1)
-{
-  const float4 row_11 = { m1[0][0], m1[0][1], m1[0][2], m1[0][3] };
-  const float4 row_21 = { m1[1][0], m1[1][1], m1[1][2], m1[1][3] };
-  const float4 row_31 = { m1[2][0], m1[2][1], m1[2][2], m1[2][3] };
-  const float4 row_41 = { m1[3][0], m1[3][1], m1[3][2], m1[3][3] };
+    return true;
+  }
 
-  float4 mul =
+  // Adds copies of the mesh scattered in front of the camera, every second one
+  // circling its predecessor as a child
+  void AddInstances(uint32_t count)
   {
-    dot(row_11, v1),
-    dot(row_21, v1),
-    dot(row_31, v1),
-    dot(row_41, v1),
-  };
-
-  return mul;
-}
-
-float2& operator-=(float2& v1, const float2& v2)
-{
-  v1.x = v1.x - v2.x;
-  v1.y = v1.y - v2.y;
+    mt19937 rng(1);
+    uniform_real_distribution<float> unit(0.0f, 1.0f);
 
-  return v1;
-}
+    int32_t root = -1;
 
-float2 operator+(const float2& v1, const float s1) { return {v1.x + s1, v1.y + s1}; }
-float2 operator+(const float2& v1, const float2& v2) { return {v1.x + v2.x, v1.y + v2.y}; }
+    for (uint32_t i = 0; i < count; i++)
+    {
+      const float4 orientation = AxisAngle({ 0, 1, 0 }, unit(rng) * 6.28318f);
+      const float spin = 0.5f + unit(rng) * 2.0f;
 
-class MatrixDemo : public tDX::PixelGameEngine
-{
-public:
-  MatrixDemo()
-  {
-    sAppName = "3D matrix demo";
+      if (i % 2 == 0)
+        root = (int32_t)m_scene.add({ unit(rng) * 4.0f - 2.0f, unit(rng) * 2.0f - 1.0f, -1.5f - unit(rng) * 3.3f }, orientation, 0.05f + unit(rng) * 0.05f, spin);
+      else
+        m_scene.add({ 0.8f, 0.0f, 0.0f }, orientation, 0.5f, spin, root);
+    }
   }
 
   bool OnUserCreate() override
   {
+    m_zoneGrid = GetProfileZone("grid");
+    m_zone2DView = GetProfileZone("2D view");
+    m_zone3DTransform = GetProfileZone("3D transform");
+    m_zoneMatrixPrint = GetProfileZone("matrix printing");
+    m_zoneTiles = GetProfileZone("tiles");
+    m_zoneScene = GetProfileZone("scene update");
+
+    // Solid faces of the 3D view are depth tested
+    GetDrawTarget()->EnableDepth();
+
+    // Panel titles repeat every frame, their glyph runs are laid out once
+    EnableTextCache();
+
+    // Checkerboard with a border for the textured faces, mipmapped as the faces
+    // shrink far below its size
+    m_texture.Resize(128, 128);
+    for (int32_t y = 0; y < 128; y++)
+      for (int32_t x = 0; x < 128; x++)
+      {
+        const bool border = x < 4 || y < 4 || x >= 124 || y >= 124;
+        const bool light = ((x / 16) ^ (y / 16)) & 1;
+        m_texture.SetPixel(x, y, border ? tDX::Pixel(255, 200, 60) : light ? tDX::Pixel(230, 230, 230) : tDX::Pixel(70, 110, 160));
+      }
+    m_texture.GenerateMipmaps();
+
     return true;
   }
 
   bool OnUserUpdate(float fElapsedTime) override
   {
-    Clear(tDX::BLACK);
-
     // Keyboard control
     const float coeficient = 2.0f * fElapsedTime;
+    const float translationX = m_cubeTranslationX;
+    const float translationZ = m_cubeTranslationZ;
+    const float yaw = m_yaw;
 
     if (GetKey(tDX::D).bHeld) { m_cubeTranslationX += coeficient; }
     if (GetKey(tDX::A).bHeld) { m_cubeTranslationX -= coeficient; }
@@ -138,6 +129,7 @@ public:
     if (GetKey(tDX::S).bHeld) { m_cubeTranslationZ += coeficient; }
     if (GetKey(tDX::E).bHeld) { m_yaw += coeficient * 30; }
     if (GetKey(tDX::Q).bHeld) { m_yaw -= coeficient * 30; }
+    if (GetKey(tDX::R).bPressed) { m_renderMode = (RenderMode)(((int)m_renderMode + 1) % 4); }
 
     m_cubeTranslationZ = max(m_cubeTranslationZ, -5.0f);
     m_cubeTranslationZ = min(m_cubeTranslationZ, -1.0f);
@@ -147,6 +139,127 @@ public:
 
     m_yaw = fmod(m_yaw, 360.0f);
 
+    // Only the transforms computed from moved inputs are computed again
+    if (m_cubeTranslationX != translationX || m_cubeTranslationZ != translationZ)
+      m_translation.invalidate();
+
+    if (m_yaw != yaw)
+      m_rotation.invalidate();
+
+    if (m_scene.size() > 0)
+    {
+      tDX::ProfileScope zone(m_zoneScene);
+
+      RotateInstancesY(m_scene, fElapsedTime);
+      UpdateScene(m_scene);
+    }
+
+    // Binned into screen tiles when more render threads are set
+    BeginTiles();
+
+    {
+      tDX::ProfileScope zone(m_zoneGrid);
+
+      // The grid never changes, it is recorded once and replayed every frame
+      if (m_gridCommands.Empty())
+      {
+        BeginRecording(m_gridCommands);
+        DrawGrid();
+        EndRecording();
+      }
+
+      Replay(m_gridCommands);
+    }
+
+    {
+      tDX::ProfileScope zone(m_zone2DView);
+      Draw2DView();
+    }
+
+    {
+      tDX::ProfileScope zone(m_zone3DTransform);
+      Draw3DView();
+    }
+
+    // Windows borders
+    if (m_borderCommands.Empty())
+    {
+      BeginRecording(m_borderCommands);
+      DrawRect(0, 0, m_windowWidth - 1, m_windowHeight - 1, tDX::WHITE);
+      DrawRect(0, m_windowHeight, m_windowWidth - 1, m_windowHeight - 1, tDX::WHITE);
+      EndRecording();
+    }
+
+    Replay(m_borderCommands);
+
+    {
+      tDX::ProfileScope zone(m_zoneTiles);
+      EndTiles();
+    }
+
+    {
+      tDX::ProfileScope zone(m_zoneMatrixPrint);
+      PrintMatrices();
+    }
+
+    for (TransformNode* node : m_transforms)
+      node->endFrame();
+
+    return true;
+  }
+
+  bool OnUserDestroy() override
+  {
+    cout << "Transform recomputations (total/most in one frame):";
+    for (const TransformNode* node : m_transforms)
+      cout << " " << node->name() << " " << node->counters().total << "/" << node->counters().maxFrame;
+    cout << endl;
+
+    return true;
+  }
+
+private:
+  // A block of printed values, formatted and drawn again only when one of them
+  // changes at the printed precision. Covers the screen rows top to bottom.
+  struct TextPanel
+  {
+    TextPanel(int32_t panelTop, int32_t panelBottom) : top(panelTop), bottom(panelBottom) {}
+
+    int32_t top;
+    int32_t bottom;
+    TextBuffer<256> text;
+    array<int64_t, 20> keys = {};
+    size_t count = 0;
+
+    bool Changed(const float* values, size_t n, int precision)
+    {
+      bool changed = n != count;
+      for (size_t i = 0; i < n; i++)
+      {
+        int64_t key = QuantizeFixed(values[i], precision);
+        changed |= key != keys[i];
+        keys[i] = key;
+      }
+
+      count = n;
+      return changed;
+    }
+  };
+
+  // Transforms of one drawn copy of the mesh
+  struct MeshInstance
+  {
+    float4x4 mvp;
+    // Object to world, normals are turned by it and divided by normalScale
+    // to undo its uniform scale
+    float4x4 normals;
+    float normalScale;
+  };
+
+  void DrawGrid()
+  {
+    Clear(0, 0, m_windowWidth, m_windowHeight, tDX::BLACK);
+
     // Grid
     for (uint8_t row = 0; row < m_gridRows; row++)
       DrawLine(0, row * m_cellSize, m_windowWidth - 1, row * m_cellSize, tDX::VERY_DARK_GREY);
@@ -157,7 +270,10 @@ public:
     // Axes
     DrawLine(0, m_originY, m_windowWidth - 1, m_originY, tDX::DARK_YELLOW);
     DrawLine(m_originX, 0, m_originX, m_windowHeight - 1, tDX::DARK_YELLOW);
+  }
 
+  void Draw2DView()
+  {
     // Camera
     DrawRect(m_originX - 4, m_originY - 5 + 10, 8, 10, tDX::BLUE);
     DrawRect(m_originX - 2, m_originY - 10 + 10, 4, 4, tDX::BLUE);
@@ -183,13 +299,16 @@ public:
 
     float2 centerVertex = leftUp + m_cellSize;
 
+    float s, c;
+    sinCos(toRad(m_yaw), s, c);
+
     for (auto& vertex : m_rectangle)
     {
       vertex -= centerVertex;
 
       float2 rotatedVertex;
-      rotatedVertex.x = vertex.x * cos(toRad(m_yaw)) - vertex.y * sin(toRad(m_yaw));
-      rotatedVertex.y = vertex.x * sin(toRad(m_yaw)) + vertex.y * cos(toRad(m_yaw));
+      rotatedVertex.x = vertex.x * c - vertex.y * s;
+      rotatedVertex.y = vertex.x * s + vertex.y * c;
 
       vertex = rotatedVertex + centerVertex;
     }
@@ -200,178 +319,312 @@ public:
     DrawLine(lround(m_rectangle[3].x), lround(m_rectangle[3].y), lround(m_rectangle[0].x), lround(m_rectangle[0].y), tDX::RED);
 
     DrawCircle(lround(m_rectangle[0].x), lround(m_rectangle[0].y), 2, tDX::YELLOW);
+  }
 
-    // World matrix
-    m_translationMatrix =
-    {{
-      {{ 1, 0, 0, m_cubeTranslationX }},
-      {{ 0, 1, 0, 0                  }},
-      {{ 0, 0, 1, m_cubeTranslationZ }},
-      {{ 0, 0, 0, 1                  }},
-    }};
+  void Draw3DView()
+  {
+    Clear(0, m_windowHeight, m_windowWidth, m_windowHeight, tDX::BLACK);
 
-    m_rotationMatrix =
-    {{
-      {{ cos(toRad(m_yaw))     , 0, -sin(toRad(m_yaw)), 0 }},
-      {{ 0                     , 1, 0                      , 0 }},
-      {{ sin(toRad(m_yaw)), 0, cos(toRad(m_yaw)) , 0 }},
-      {{ 0                     , 0, 0                      , 1 }},
-    }};
+    const float4x4& modelMatrix = m_model.get();
+    const float4x4& mvpMatrix = m_mvp.get();
 
-    m_modelMatrix = m_translationMatrix * m_rotationMatrix;
+    // 3D view
+    const int32_t originX3D = m_windowWidth / 2;
+    const int32_t originY3D = m_windowHeight + m_windowHeight / 2;
 
-    // View matrix
-    float3 zaxis = normalize(m_eye - m_target);
-    float3 xaxis = normalize(cross(m_up, zaxis));
-    float3 yaxis = cross(zaxis, xaxis);
+    DrawLine(0, originY3D, m_windowWidth - 1, originY3D, tDX::DARK_YELLOW);
+    DrawLine(originX3D, m_windowHeight, originX3D, m_windowHeight + m_windowHeight - 1, tDX::DARK_YELLOW);
 
-    m_viewMatrix =
-    { {
-      {{ xaxis.x, xaxis.y, xaxis.z, -dot(xaxis, m_eye) }},
-      {{ yaxis.x, yaxis.y, yaxis.z, -dot(yaxis, m_eye) }},
-      {{ zaxis.x, zaxis.y, zaxis.z, -dot(zaxis, m_eye) }},
-      {{ 0, 0, 0, 1 }}
-    } };
+    // Cube
+    const Viewport viewport = { 0.0f, (float)m_windowHeight, (float)m_windowWidth, (float)m_windowHeight };
 
-    // Projection
-    float fovY = 45.0f;
-    float n = 0.1f;
-    float f = 5.0f;
-    float tan_fovY = tan(toRad(fovY/2.0f));
+    // Whole mesh test against the frustum with its world space bounding sphere
+    const Frustum frustum = ExtractFrustum(m_viewProjection.get());
+    const float4 center = modelMatrix * float4{ m_mesh.center.x, m_mesh.center.y, m_mesh.center.z, 1.0f };
+    const Visibility visibility = TestSphere(frustum, { center.x, center.y, center.z }, m_mesh.radius);
 
-    float yScale = 1.0f / tan(toRad(fovY / 2.0f));
-    float xScale = yScale / m_aspectRatio;
+    if (m_renderMode != RenderMode::Wireframe)
+      ClearDepth(0, m_windowHeight, m_windowWidth, m_windowHeight);
 
-    m_projectionMatrix =
-    {{
-      {{ xScale, 0     , 0      , 0               }},
-      {{ 0     , yScale, 0      , 0               }},
-      {{ 0     , 0     , f/(n-f), n * f / (n - f) }},
-      {{ 0     , 0     , -1     , 0               }}
-    }};
+    const MeshInstance cube = { mvpMatrix, m_rotation.get(), 1.0f };
 
-    m_mvpMatrix = m_projectionMatrix * m_viewMatrix * m_modelMatrix;
+    if (m_renderMode == RenderMode::Wireframe)
+      DrawWireframe(visibility, cube, viewport);
+    else
+      DrawSolid(visibility, cube, viewport);
 
-    // 3D view
-    const int32_t originX3D = m_windowWidth / 2;
-    const int32_t originY3D = m_windowHeight + m_windowHeight / 2;
+    if (m_scene.size() > 0)
+      DrawInstances(frustum, viewport);
 
-    DrawLine(0, originY3D, m_windowWidth - 1, originY3D, tDX::DARK_YELLOW);
-    DrawLine(originX3D, m_windowHeight, originX3D, m_windowHeight + m_windowHeight - 1, tDX::DARK_YELLOW);
+    // First vertex of the mesh
+    float4 firstVertex = mvpMatrix * m_mesh.positions.get(0);
+    m_screenVertex = ToScreen(firstVertex, viewport);
 
-    // Cube
-    array<float4, 8> transformedCube = m_cube;
+    // Rounded first, the marker of radius 2 must not reach into the panel on the
+    // right or the view above, the screen edges clip it
+    const int32_t markerX = (int32_t)lround(m_screenVertex.x), markerY = (int32_t)lround(m_screenVertex.y);
+    if (firstVertex.w > 0 && markerX >= 0 && markerX + 2 < m_windowWidth && markerY - 2 >= m_windowHeight && markerY < (int32_t)g::screenHeight)
+      DrawCircle(markerX, markerY, 2, tDX::YELLOW);
+  }
+
+  // Instances completely inside the frustum are transformed as one vertex stream
+  // and drawn in a single pass, the intersecting ones are clipped one by one
+  void DrawInstances(const Frustum& frustum, const Viewport& viewport)
+  {
+    const float4x4& viewProjection = m_viewProjection.get();
+    const float4 meshCenter = { m_mesh.center.x, m_mesh.center.y, m_mesh.center.z, 1.0f };
+
+    m_visibleInstances.clear();
 
-    for (auto& vertex : transformedCube)
+    for (uint32_t i = 0; i < m_scene.size(); i++)
     {
-      vertex = m_mvpMatrix * vertex;
+      const float4x4& world = m_scene.world[i];
+      const float4 center = world * meshCenter;
+      const float scale = sqrt(world[0][0] * world[0][0] + world[1][0] * world[1][0] + world[2][0] * world[2][0]);
+      const Visibility visibility = TestSphere(frustum, { center.x, center.y, center.z }, m_mesh.radius * scale);
+
+      if (visibility == Visibility::Inside)
+        m_visibleInstances.push_back(i);
+      else if (visibility == Visibility::Intersecting)
+      {
+        const MeshInstance instance = { viewProjection * world, world, 1.0f / scale };
+
+        if (m_renderMode == RenderMode::Wireframe)
+          DrawWireframe(visibility, instance, viewport);
+        else
+          DrawSolid(visibility, instance, viewport);
+      }
+    }
+
+    TransformInstancesToScreen(viewProjection, m_scene.world.data(), m_visibleInstances, m_mesh.positions, viewport, m_instanceVertices);
+
+    const size_t vertexCount = m_mesh.positions.size();
+
+    for (size_t n = 0; n < m_visibleInstances.size(); n++)
+    {
+      if (m_renderMode == RenderMode::Wireframe)
+        DrawScreenEdges(m_instanceVertices, n * vertexCount);
+      else
+      {
+        const float4x4& world = m_scene.world[m_visibleInstances[n]];
+        const float scale = sqrt(world[0][0] * world[0][0] + world[1][0] * world[1][0] + world[2][0] * world[2][0]);
+
+        DrawScreenFaces(m_instanceVertices, n * vertexCount, { {}, world, 1.0f / scale });
+      }
+    }
+  }
+
+  // Mesh edges from screen space vertices starting at first, nothing is clipped.
+  // Every shared edge is drawn once.
+  void DrawScreenEdges(const VertexStream& vertices, size_t first)
+  {
+    const vector<uint32_t>& edges = m_mesh.edges;
+    const float* x = vertices.x.data() + first;
+    const float* y = vertices.y.data() + first;
 
-      vertex.x = vertex.x / vertex.w;
-      vertex.y = vertex.y / vertex.w;
-      vertex.z = vertex.z / vertex.w;
-      vertex.w = 1.0f / vertex.w;
+    for (size_t i = 0; i < edges.size(); i += 2)
+    {
+      uint32_t a = edges[i];
+      uint32_t b = edges[i + 1];
 
-      // Viewport
-      vertex.x = (vertex.x + 1.0f) * (m_windowWidth - 1) * 0.5f + 0.0f; // plus X viewport origin
-      vertex.y = (1.0f - vertex.y) * (m_windowHeight - 1) * 0.5f + m_windowHeight; // plus Y viewport origin
+      DrawLine((int32_t)x[a], (int32_t)y[a], (int32_t)x[b], (int32_t)y[b], tDX::WHITE);
     }
+  }
 
-    tDX::vi2d clipWinPos = { 0, m_windowHeight };
-    tDX::vi2d clipWinSize = { m_windowWidth - 1, m_windowHeight - 1 };
+  void DrawWireframe(Visibility visibility, const MeshInstance& instance, const Viewport& viewport)
+  {
+    const vector<uint32_t>& edges = m_mesh.edges;
 
-    DrawLineClipped(transformedCube[0].x, transformedCube[0].y, transformedCube[1].x, transformedCube[1].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[1].x, transformedCube[1].y, transformedCube[2].x, transformedCube[2].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[2].x, transformedCube[2].y, transformedCube[3].x, transformedCube[3].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[3].x, transformedCube[3].y, transformedCube[0].x, transformedCube[0].y, clipWinPos, clipWinSize, tDX::WHITE);
+    if (visibility == Visibility::Inside)
+    {
+      // Nothing to clip, transform straight to the screen
+      TransformToScreen(instance.mvp, m_mesh.positions, viewport, m_screenVertices);
+      DrawScreenEdges(m_screenVertices, 0);
+    }
+    else if (visibility == Visibility::Intersecting)
+    {
+      // Clip before the divide, so vertices behind the eye cannot produce garbage
+      TransformToClip(instance.mvp, m_mesh.positions, m_clipVertices);
+
+      for (size_t i = 0; i < edges.size(); i += 2)
+      {
+        float4 a = m_clipVertices.get(edges[i]);
+        float4 b = m_clipVertices.get(edges[i + 1]);
+
+        if (!ClipLine(a, b))
+          continue;
+
+        a = ToScreen(a, viewport);
+        b = ToScreen(b, viewport);
+
+        // ToScreen maps the right plane onto the last column of the view, the
+        // clamp only keeps rounding of the clipped ends out of the text panels,
+        // which are not cleared every frame
+        const float right = (float)(m_windowWidth - 1);
+        DrawLine((int32_t)min(a.x, right), (int32_t)a.y, (int32_t)min(b.x, right), (int32_t)b.y, tDX::WHITE);
+      }
+    }
+  }
 
-    DrawLineClipped(transformedCube[4].x, transformedCube[4].y, transformedCube[5].x, transformedCube[5].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[5].x, transformedCube[5].y, transformedCube[6].x, transformedCube[6].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[6].x, transformedCube[6].y, transformedCube[7].x, transformedCube[7].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[7].x, transformedCube[7].y, transformedCube[4].x, transformedCube[4].y, clipWinPos, clipWinSize, tDX::WHITE);
+  // Mesh faces from screen space vertices starting at first, nothing is clipped
+  void DrawScreenFaces(const VertexStream& vertices, size_t first, const MeshInstance& instance)
+  {
+    const vector<uint32_t>& indices = m_mesh.indices;
+    const size_t triangles = indices.size() / 3;
 
-    DrawLineClipped(transformedCube[0].x, transformedCube[0].y, transformedCube[4].x, transformedCube[4].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[1].x, transformedCube[1].y, transformedCube[5].x, transformedCube[5].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[2].x, transformedCube[2].y, transformedCube[6].x, transformedCube[6].y, clipWinPos, clipWinSize, tDX::WHITE);
-    DrawLineClipped(transformedCube[3].x, transformedCube[3].y, transformedCube[7].x, transformedCube[7].y, clipWinPos, clipWinSize, tDX::WHITE);
+    for (size_t t = 0; t < triangles; t++)
+    {
+      const float4 a = vertices.get(first + indices[t * 3 + 0]);
+      const float4 b = vertices.get(first + indices[t * 3 + 1]);
+      const float4 c = vertices.get(first + indices[t * 3 + 2]);
+      const float2* uv = &m_mesh.texCoords[t * 3];
 
-    if (transformedCube[0].x > 0 && transformedCube[0].x < m_windowWidth && transformedCube[0].y > m_windowHeight && transformedCube[0].y < g::screenHeight)
-      DrawCircle(lround(transformedCube[0].x), lround(transformedCube[0].y), 2, tDX::YELLOW);
+      DrawFace(a, b, c, uv[0], uv[1], uv[2], Shade(m_mesh.normals[t], instance));
+    }
+  }
 
-    // Windows borders
-    DrawRect(0, 0, m_windowWidth - 1, m_windowHeight - 1, tDX::WHITE);
-    DrawRect(0, m_windowHeight, m_windowWidth - 1, m_windowHeight - 1, tDX::WHITE);
+  void DrawSolid(Visibility visibility, const MeshInstance& instance, const Viewport& viewport)
+  {
+    const vector<uint32_t>& indices = m_mesh.indices;
+    const size_t triangles = indices.size() / 3;
 
-    // Print matrices
-    float4 worldVertex = m_modelMatrix * m_cube[0];
-    float4 viewVertex = m_viewMatrix * worldVertex;
-    float4 projVertex = m_projectionMatrix * viewVertex;
+    if (visibility == Visibility::Inside)
+    {
+      TransformToScreen(instance.mvp, m_mesh.positions, viewport, m_screenVertices);
+      DrawScreenFaces(m_screenVertices, 0, instance);
+    }
+    else if (visibility == Visibility::Intersecting)
+    {
+      TransformToClip(instance.mvp, m_mesh.positions, m_clipVertices);
 
-    stringstream modelMatrixToPrint;
+      array<float4, 9> polygon;
+      array<float2, 9> polygonUV;
 
-    modelMatrixToPrint << fixed << setprecision(2) <<
-      setw(6) << m_modelMatrix[0][0] << setw(6) << m_modelMatrix[0][1] << setw(6) << m_modelMatrix[0][2] << setw(6) << m_modelMatrix[0][3] << "    |" << setw(5) << worldVertex.x << "|" << '\n' <<
-      setw(6) << m_modelMatrix[1][0] << setw(6) << m_modelMatrix[1][1] << setw(6) << m_modelMatrix[1][2] << setw(6) << m_modelMatrix[1][3] << "    |" << setw(5) << worldVertex.y << "|" << '\n' <<
-      setw(6) << m_modelMatrix[2][0] << setw(6) << m_modelMatrix[2][1] << setw(6) << m_modelMatrix[2][2] << setw(6) << m_modelMatrix[2][3] << "    |" << setw(5) << worldVertex.z << "|" << '\n' <<
-      setw(6) << m_modelMatrix[3][0] << setw(6) << m_modelMatrix[3][1] << setw(6) << m_modelMatrix[3][2] << setw(6) << m_modelMatrix[3][3] << "    |" << setw(5) << worldVertex.w << "|" << '\n';
+      for (size_t t = 0; t < triangles; t++)
+      {
+        size_t count = ClipTriangle(m_clipVertices.get(indices[t * 3 + 0]), m_clipVertices.get(indices[t * 3 + 1]), m_clipVertices.get(indices[t * 3 + 2]),
+          &m_mesh.texCoords[t * 3], polygon, polygonUV);
+        if (count < 3)
+          continue;
 
-    DrawString(310, 10, "Model to world");
-    DrawString(300, 25, modelMatrixToPrint.str());
+        for (size_t i = 0; i < count; i++)
+          polygon[i] = ToScreen(polygon[i], viewport);
 
-    stringstream lookAtToPrint;
+        const tDX::Pixel colour = Shade(m_mesh.normals[t], instance);
 
-    lookAtToPrint << fixed << setprecision(2) <<
-      "  Eye    " << setw(6) << m_eye.x << setw(6) << m_eye.y << setw(6) << m_eye.z << '\n' <<
-      "  Target " << setw(6) << m_target.x << setw(6) << m_target.y << setw(6) << m_target.z << '\n' <<
-      "  Up     " << setw(6) << m_up.x << setw(6) << m_up.y << setw(6) << m_up.z << '\n';
+        for (size_t i = 2; i < count; i++)
+          DrawFace(polygon[0], polygon[i - 1], polygon[i], polygonUV[0], polygonUV[i - 1], polygonUV[i], colour);
+      }
+    }
+  }
 
-    DrawString(310, 70, "LookAt input data", tDX::GREY);
-    DrawString(300, 85, lookAtToPrint.str(), tDX::GREY);
+  // Draws a screen space triangle unless it faces away from the camera. The
+  // texture coordinates are only used by textured faces, which are tinted by colour.
+  void DrawFace(const float4& a, const float4& b, const float4& c, const float2& uvA, const float2& uvB, const float2& uvC, tDX::Pixel colour)
+  {
+    // Counter-clockwise faces turn clockwise on the screen as its y points down
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (area <= 0.0f)
+      return;
 
-    stringstream viewMatrixToPrint;
+    if (m_renderMode == RenderMode::Textured)
+    {
+      // The screen vertices keep 1/w in w
+      FillTexturedTriangle({ a.x, a.y, a.z, a.w, uvA.x, uvA.y }, { b.x, b.y, b.z, b.w, uvB.x, uvB.y }, { c.x, c.y, c.z, c.w, uvC.x, uvC.y },
+        &m_texture, tDX::Sprite::Filter::TRILINEAR, colour);
+    }
+    else if (m_renderMode == RenderMode::Solid)
+      FillTriangle({ a.x, a.y }, a.z, { b.x, b.y }, b.z, { c.x, c.y }, c.z, colour);
+    else
+      FillTriangle((int32_t)a.x, (int32_t)a.y, (int32_t)b.x, (int32_t)b.y, (int32_t)c.x, (int32_t)c.y, colour);
+  }
 
-    viewMatrixToPrint << fixed << setprecision(2) <<
-      setw(6) << m_viewMatrix[0][0] << setw(6) << m_viewMatrix[0][1] << setw(6) << m_viewMatrix[0][2] << setw(6) << m_viewMatrix[0][3] << "    |" << setw(5) << viewVertex.x << "|" << '\n' <<
-      setw(6) << m_viewMatrix[1][0] << setw(6) << m_viewMatrix[1][1] << setw(6) << m_viewMatrix[1][2] << setw(6) << m_viewMatrix[1][3] << "    |" << setw(5) << viewVertex.y << "|" << '\n' <<
-      setw(6) << m_viewMatrix[2][0] << setw(6) << m_viewMatrix[2][1] << setw(6) << m_viewMatrix[2][2] << setw(6) << m_viewMatrix[2][3] << "    |" << setw(5) << viewVertex.z << "|" << '\n' <<
-      setw(6) << m_viewMatrix[3][0] << setw(6) << m_viewMatrix[3][1] << setw(6) << m_viewMatrix[3][2] << setw(6) << m_viewMatrix[3][3] << "    |" << setw(5) << viewVertex.w << "|" << '\n';
+  // Lambert shading of an object space normal with an ambient term
+  tDX::Pixel Shade(const float3& normal, const MeshInstance& instance)
+  {
+    float4 n = instance.normals * float4{ normal.x, normal.y, normal.z, 0.0f };
+    float intensity = 0.2f + 0.8f * max(0.0f, dot(float3{ n.x, n.y, n.z }, m_lightDirection) * instance.normalScale);
 
-    DrawString(310, 130, "world to View");
-    DrawString(300, 145, viewMatrixToPrint.str());
+    return tDX::Pixel((uint8_t)(200 * intensity), (uint8_t)(220 * intensity), (uint8_t)(255 * intensity));
+  }
 
-    stringstream projectionMatrixToPrint;
+  // Matrix with the product of a vertex, 4 rows of text
+  template <size_t N>
+  static void AppendMatrix(TextBuffer<N>& text, const float4x4& matrix, const float4* vertex)
+  {
+    const float column[4] = { vertex ? vertex->x : 0, vertex ? vertex->y : 0, vertex ? vertex->z : 0, vertex ? vertex->w : 0 };
 
-    projectionMatrixToPrint << fixed << setprecision(2) <<
-      setw(6) << m_projectionMatrix[0][0] << setw(6) << m_projectionMatrix[0][1] << setw(6) << m_projectionMatrix[0][2] << setw(6) << m_projectionMatrix[0][3] << "    |" << setw(5) << projVertex.x << "|" << '\n' <<
-      setw(6) << m_projectionMatrix[1][0] << setw(6) << m_projectionMatrix[1][1] << setw(6) << m_projectionMatrix[1][2] << setw(6) << m_projectionMatrix[1][3] << "    |" << setw(5) << projVertex.y << "|" << '\n' <<
-      setw(6) << m_projectionMatrix[2][0] << setw(6) << m_projectionMatrix[2][1] << setw(6) << m_projectionMatrix[2][2] << setw(6) << m_projectionMatrix[2][3] << "    |" << setw(5) << projVertex.z << "|" << '\n' <<
-      setw(6) << m_projectionMatrix[3][0] << setw(6) << m_projectionMatrix[3][1] << setw(6) << m_projectionMatrix[3][2] << setw(6) << m_projectionMatrix[3][3] << "    |" << setw(5) << projVertex.w << "|" << '\n';
+    for (int row = 0; row < 4; row++)
+    {
+      for (int col = 0; col < 4; col++)
+        text.appendFixed(matrix[row][col], 6, 2);
 
-    DrawString(310, 190, "view to Projection");
-    DrawString(300, 205, projectionMatrixToPrint.str());
+      if (vertex)
+        text.append("    |").appendFixed(column[row], 5, 2).append('|');
 
-    stringstream mvpMatrixToPrint;
+      text.append('\n');
+    }
+  }
+
+  // Clears the panel's part of the screen and prints its title and text
+  void DrawPanel(const TextPanel& panel, const char* title, tDX::Pixel colour)
+  {
+    Clear(m_windowWidth, panel.top, g::screenWidth - m_windowWidth, panel.bottom - panel.top, tDX::BLACK);
+    DrawString(310, panel.top + 10, title, colour);
+    DrawString(300, panel.top + 25, panel.text.c_str(), colour);
+  }
+
+  void PrintMatrixPanel(TextPanel& panel, const char* title, const float4x4& matrix, const float4* vertex, tDX::Pixel colour = tDX::WHITE)
+  {
+    float values[20];
+    copy(&matrix[0][0], &matrix[0][0] + 16, values);
+    if (vertex)
+      copy(&vertex->x, &vertex->x + 4, values + 16);
 
-    mvpMatrixToPrint << fixed << setprecision(2) <<
-      setw(6) << m_mvpMatrix[0][0] << setw(6) << m_mvpMatrix[0][1] << setw(6) << m_mvpMatrix[0][2] << setw(6) << m_mvpMatrix[0][3] << '\n' <<
-      setw(6) << m_mvpMatrix[1][0] << setw(6) << m_mvpMatrix[1][1] << setw(6) << m_mvpMatrix[1][2] << setw(6) << m_mvpMatrix[1][3] << '\n' <<
-      setw(6) << m_mvpMatrix[2][0] << setw(6) << m_mvpMatrix[2][1] << setw(6) << m_mvpMatrix[2][2] << setw(6) << m_mvpMatrix[2][3] << '\n' <<
-      setw(6) << m_mvpMatrix[3][0] << setw(6) << m_mvpMatrix[3][1] << setw(6) << m_mvpMatrix[3][2] << setw(6) << m_mvpMatrix[3][3] << '\n';
+    if (!panel.Changed(values, vertex ? 20 : 16, 2))
+      return;
 
-    DrawString(310, 250, "MVP matrix", tDX::GREY);
-    DrawString(300, 265, mvpMatrixToPrint.str(), tDX::GREY);
+    panel.text.clear();
+    AppendMatrix(panel.text, matrix, vertex);
+    DrawPanel(panel, title, colour);
+  }
 
-    stringstream cubePointPrint;
+  void PrintMatrices()
+  {
+    const float4 screenVertex = m_screenVertex;
 
-    cubePointPrint << fixed << setprecision(1) <<
-      setw(7) << transformedCube[0].x << setw(7) << transformedCube[0].y << setw(5) << transformedCube[0].z << setw(5) << transformedCube[0].w << '\n';
+    // Print matrices
+    float4 worldVertex = m_model.get() * m_mesh.positions.get(0);
+    float4 viewVertex = m_view.get() * worldVertex;
+    float4 projVertex = m_projection.get() * viewVertex;
 
-    DrawString(310, 310, "Cube vertex in screen space");
-    DrawString(300, 325, cubePointPrint.str());
+    PrintMatrixPanel(m_panels[0], "Model to world", m_model.get(), &worldVertex);
 
-    return true;
+    const float lookAt[9] = { m_eye.x, m_eye.y, m_eye.z, m_target.x, m_target.y, m_target.z, m_up.x, m_up.y, m_up.z };
+    if (m_panels[1].Changed(lookAt, 9, 2))
+    {
+      TextBuffer<256>& text = m_panels[1].text;
+      text.clear();
+      text.append("  Eye    ").appendFixed(m_eye.x, 6, 2).appendFixed(m_eye.y, 6, 2).appendFixed(m_eye.z, 6, 2).append('\n');
+      text.append("  Target ").appendFixed(m_target.x, 6, 2).appendFixed(m_target.y, 6, 2).appendFixed(m_target.z, 6, 2).append('\n');
+      text.append("  Up     ").appendFixed(m_up.x, 6, 2).appendFixed(m_up.y, 6, 2).appendFixed(m_up.z, 6, 2).append('\n');
+      DrawPanel(m_panels[1], "LookAt input data", tDX::GREY);
+    }
+
+    PrintMatrixPanel(m_panels[2], "world to View", m_view.get(), &viewVertex);
+    PrintMatrixPanel(m_panels[3], "view to Projection", m_projection.get(), &projVertex);
+    PrintMatrixPanel(m_panels[4], "MVP matrix", m_mvp.get(), nullptr, tDX::GREY);
+
+    const float screen[4] = { screenVertex.x, screenVertex.y, screenVertex.z, screenVertex.w };
+    if (m_panels[5].Changed(screen, 4, 1))
+    {
+      TextBuffer<256>& text = m_panels[5].text;
+      text.clear();
+      text.appendFixed(screenVertex.x, 7, 1).appendFixed(screenVertex.y, 7, 1).appendFixed(screenVertex.z, 5, 1).appendFixed(screenVertex.w, 5, 1).append('\n');
+      DrawPanel(m_panels[5], "Cube vertex in screen space", tDX::WHITE);
+    }
   }
 
-private:
   // Constants to specify UI
   constexpr static int32_t m_windowWidth = g::screenWidth / 2;
   constexpr static int32_t m_windowHeight = g::screenHeight / 2;
@@ -397,38 +650,130 @@ private:
   }};
 
   // Default matrix
-  constexpr static float4x4 m_identityMatrix =
-  {{
-    {{ 1, 0, 0, 0 }},
-    {{ 0, 1, 0, 0 }},
-    {{ 0, 0, 1, 0 }},
-    {{ 0, 0, 0, 1 }}
-  }};
+  constexpr static float4x4 m_identityMatrix = float4x4::identity();
 
   // Cube transformations
   float m_cubeTranslationX = 0.0f;
   float m_cubeTranslationZ = -2.0f;
   float m_yaw = 0;
 
-  // Matrices to describe a scene
-  float4x4 m_translationMatrix;
-  float4x4 m_rotationMatrix;
-  float4x4 m_modelMatrix;
+  // Towards the light, from the upper left behind the camera
+  const float3 m_lightDirection = normalize(float3{ -0.4f, 0.6f, 0.7f });
 
-  float4x4 m_viewMatrix;
-  float4x4 m_projectionMatrix;
+  // Look at
+  const float3 m_eye = { 0, 0, 0 };
+  const float3 m_target = { 0, 0, -1 };
+  const float3 m_up = { 0, 1, 0 };
+
+  // The camera does not move, its matrices are computed once at startup, not
+  // by the compiler, as older compilers cannot use the math functions there
+  const float4x4 m_viewMatrix = lookAt(m_eye, m_target, m_up);
+  const float4x4 m_projectionMatrix = perspective(toRad(45.0f), m_aspectRatio, 0.1f, 5.0f);
+
+  // Transforms of the scene, each computed again only after its inputs changed.
+  // Inputs are declared before the nodes computed from them.
+  TransformNode m_translation{ "translation", [this] { return translation(m_cubeTranslationX, 0, m_cubeTranslationZ); } };
+  TransformNode m_rotation{ "rotation", [this] { return rotationY(-toRad(m_yaw)); } };
+  TransformNode m_model{ "model", [this] { return m_translation.get() * m_rotation.get(); }, { &m_translation, &m_rotation } };
+  TransformNode m_view{ "view", [this] { return m_viewMatrix; } };
+  TransformNode m_projection{ "projection", [this] { return m_projectionMatrix; } };
+  TransformNode m_viewProjection{ "viewProjection", [this] { return m_projection.get() * m_view.get(); }, { &m_projection, &m_view } };
+  TransformNode m_mvp{ "mvp", [this] { return m_viewProjection.get() * m_model.get(); }, { &m_viewProjection, &m_model } };
+
+  TransformNode* const m_transforms[7] = { &m_translation, &m_rotation, &m_model, &m_view, &m_projection, &m_viewProjection, &m_mvp };
+
+  // Faces of the cube, counter-clockwise seen from the outside
+  constexpr static array<array<uint32_t, 4>, 6> m_cubeFaces =
+  {{
+    {{ 0, 3, 2, 1 }},
+    {{ 4, 5, 6, 7 }},
+    {{ 0, 1, 5, 4 }},
+    {{ 3, 7, 6, 2 }},
+    {{ 0, 4, 7, 3 }},
+    {{ 1, 2, 6, 5 }}
+  }};
 
-  float4x4 m_mvpMatrix;
+  // Displayed mesh, the cube unless one is loaded, and its transformed vertices
+  Mesh m_mesh;
+  VertexStream m_screenVertices;
+  VertexStream m_clipVertices;
+  float4 m_screenVertex = {};
+  RenderMode m_renderMode = RenderMode::Wireframe;
+  tDX::Sprite m_texture;
+
+  // Additional copies of the mesh, their screen space vertices one after another
+  Scene m_scene;
+  vector<uint32_t> m_visibleInstances;
+  VertexStream m_instanceVertices;
+
+  // Printed values on the right side, from top to bottom
+  TextPanel m_panels[6] =
+  {
+    { 0, 60 }, { 60, 120 }, { 120, 180 }, { 180, 240 }, { 240, 300 }, { 300, (int32_t)g::screenHeight }
+  };
 
-  // Look at
-  float3 m_eye = { 0, 0, 0 };
-  float3 m_target = { 0, 0, -1 };
-  float3 m_up = { 0, 1, 0 };
+  // Static parts of the views
+  tDX::CommandList m_gridCommands;
+  tDX::CommandList m_borderCommands;
+
+  // Profiling zones
+  tDX::ProfileZone* m_zoneGrid = nullptr;
+  tDX::ProfileZone* m_zone2DView = nullptr;
+  tDX::ProfileZone* m_zone3DTransform = nullptr;
+  tDX::ProfileZone* m_zoneMatrixPrint = nullptr;
+  tDX::ProfileZone* m_zoneTiles = nullptr;
+  tDX::ProfileZone* m_zoneScene = nullptr;
 };
 
-int main()
+int main(int argc, char* argv[])
 {
   MatrixDemo demo;
+
+  // Benchmark without a window: --headless [--frames N] [--dt seconds]
+  // Time the frame phases: --profile [file.csv]
+  // Show a different model: --mesh file.obj
+  // Draw solid faces: --solid, or with the scanline FillTriangle: --scanline, or textured: --textured
+  // Draw in screen tiles on several threads: --threads N (0 = all cores)
+  // Time the matrix operations and sinCos and exit: --bench-math
+  // Time rotated sprite draws from both sprite layouts and DrawSprite and exit: --bench-sprite
+  // Check the PNG and QOI decoders on encoded images, time them and exit: --bench-image
+  // Draw more copies of the mesh: --instances N
+  bool headless = false;
+  uint32_t frames = 0;
+  float elapsedTime = 0.0f;
+
+  for (int i = 1; i < argc; i++)
+  {
+    string arg = argv[i];
+
+    if (arg == "--headless") { headless = true; }
+    else if (arg == "--frames" && i + 1 < argc) { headless = true; frames = (uint32_t)stoul(argv[++i]); }
+    else if (arg == "--dt" && i + 1 < argc) { headless = true; elapsedTime = stof(argv[++i]); }
+    else if (arg == "--mesh" && i + 1 < argc)
+    {
+      if (!demo.LoadMesh(argv[++i]))
+        cout << "Failed to load mesh " << argv[i] << endl;
+    }
+    else if (arg == "--solid") { demo.SetRenderMode(MatrixDemo::RenderMode::Solid); }
+    else if (arg == "--scanline") { demo.SetRenderMode(MatrixDemo::RenderMode::Scanline); }
+    else if (arg == "--textured") { demo.SetRenderMode(MatrixDemo::RenderMode::Textured); }
+    else if (arg == "--threads" && i + 1 < argc) { demo.SetRenderThreads((uint32_t)stoul(argv[++i])); }
+    else if (arg == "--instances" && i + 1 < argc) { demo.AddInstances((uint32_t)stoul(argv[++i])); }
+    else if (arg == "--bench-math") { return RunMathBenchmark() ? 0 : 1; }
+    else if (arg == "--bench-sprite") { return RunSpriteBenchmark(demo) ? 0 : 1; }
+    else if (arg == "--bench-image") { return RunImageBenchmark() ? 0 : 1; }
+    else if (arg == "--profile")
+    {
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        demo.EnableProfiling(argv[++i]);
+      else
+        demo.EnableProfiling();
+    }
+  }
+
+  if (headless)
+    demo.SetHeadless(frames, elapsedTime);
+
   if (demo.Construct(g::screenWidth, g::screenHeight, 2, 2))
     demo.Start();
 
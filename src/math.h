@@ -0,0 +1,703 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "engine/tPixelGameEngine.h"
+
+#define PI 3.14159265358979323846f
+
+// True while the compiler evaluates a constant expression. The SIMD and <cmath>
+// paths below are only taken at run time, constant expressions use portable code.
+// Older compilers, like the v141 toolset, cannot tell, they always take the run
+// time paths and the functions choosing between them, declared MATH_CONSTEXPR,
+// are only inline there and cannot be used in constant expressions.
+#if (defined(__GNUC__) && __GNUC__ >= 9) || defined(__clang__) || (defined(_MSC_VER) && _MSC_VER >= 1925)
+#define MATH_IS_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#define MATH_CONSTEXPR constexpr
+#else
+#define MATH_IS_CONSTANT_EVALUATED() false
+#define MATH_CONSTEXPR inline
+#endif
+
+template <typename T, size_t N>
+struct Vector;
+
+template <typename T>
+struct Vector<T, 2>
+{
+  using value_type = T;
+  T x, y;
+};
+
+template <typename T>
+struct Vector<T, 3>
+{
+  using value_type = T;
+  T x, y, z;
+};
+
+// Four components fill one SSE register
+template <typename T>
+struct alignas(sizeof(T) * 4) Vector<T, 4>
+{
+  using value_type = T;
+  T x, y, z, w;
+};
+
+// Row major, m[row][column], vectors are multiplied as columns from the right
+template <typename T, size_t R, size_t C>
+struct alignas(16) Matrix
+{
+  T m[R][C];
+
+  constexpr T* operator[](size_t row) { return m[row]; }
+  constexpr const T* operator[](size_t row) const { return m[row]; }
+
+  static constexpr Matrix identity()
+  {
+    Matrix result = {};
+    for (size_t i = 0; i < R && i < C; i++)
+      result.m[i][i] = T(1);
+
+    return result;
+  }
+};
+
+using float4x4 = Matrix<float, 4, 4>;
+
+using float4 = Vector<float, 4>;
+using float3 = Vector<float, 3>;
+using float2 = Vector<float, 2>;
+
+// Before C++17 std::allocator ignores alignas, 32 bit Windows returns blocks
+// aligned to 8 bytes only. Arrays of float4 and float4x4 on the heap, which the
+// SIMD code loads and stores aligned, use this allocator.
+template <typename T>
+struct AlignedAllocator
+{
+  using value_type = T;
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U>&) {}
+
+  T* allocate(size_t n)
+  {
+    constexpr size_t alignment = alignof(T) > alignof(std::max_align_t) ? alignof(T) : alignof(std::max_align_t);
+
+    // The block the heap returned is stored just before the aligned one
+    void* raw = ::operator new(n * sizeof(T) + alignment);
+    void* p = (void*)(((uintptr_t)raw + alignment) & ~(uintptr_t)(alignment - 1));
+    ((void**)p)[-1] = raw;
+    return (T*)p;
+  }
+
+  void deallocate(T* p, size_t) { ::operator delete(((void**)p)[-1]); }
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// <cmath> functions usable in constant expressions, at run time they call <cmath>
+namespace cx
+{
+  MATH_CONSTEXPR float sqrt(float x)
+  {
+    if (!MATH_IS_CONSTANT_EVALUATED())
+      return std::sqrt(x);
+
+    if (x < 0.0f || x != x)
+      return std::numeric_limits<float>::quiet_NaN();
+
+    if (x == 0.0f || x == std::numeric_limits<float>::infinity())
+      return x;
+
+    // Newton steps from above decrease until they converge, in double so the
+    // float result is rounded once
+    double r = x > 1.0f ? x : 1.0;
+    for (double next = 0.5 * (r + x / r); next < r; next = 0.5 * (r + x / r))
+      r = next;
+
+    return (float)r;
+  }
+
+  // Taylor series after reducing the angle to -pi..pi
+  constexpr double sinCosSeries(double x, bool cosine)
+  {
+    constexpr double twoPi = 6.28318530717958647692;
+
+    const double turns = x / twoPi;
+    x -= twoPi * (double)(long long)(turns + (turns < 0 ? -0.5 : 0.5));
+
+    double term = cosine ? 1.0 : x;
+    double sum = term;
+    for (int n = cosine ? 1 : 2; n < 60; n += 2)
+    {
+      term *= -x * x / (double)(n * (n + 1));
+      sum += term;
+    }
+
+    return sum;
+  }
+
+  MATH_CONSTEXPR float sin(float x) { return MATH_IS_CONSTANT_EVALUATED() ? (float)sinCosSeries(x, false) : std::sin(x); }
+  MATH_CONSTEXPR float cos(float x) { return MATH_IS_CONSTANT_EVALUATED() ? (float)sinCosSeries(x, true) : std::cos(x); }
+  MATH_CONSTEXPR float tan(float x) { return MATH_IS_CONSTANT_EVALUATED() ? (float)(sinCosSeries(x, false) / sinCosSeries(x, true)) : std::tan(x); }
+}
+
+// Utils methods
+constexpr float toRad(float deg) { return deg * PI / 180.0f; }
+
+template <typename T>
+constexpr T dot(const Vector<T, 4>& v1, const Vector<T, 4>& v2) { return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z + v1.w * v2.w; }
+
+template <typename T>
+constexpr T dot(const Vector<T, 3>& v1, const Vector<T, 3>& v2) { return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z; }
+
+template <typename T>
+constexpr Vector<T, 3> cross(const Vector<T, 3>& v1, const Vector<T, 3>& v2)
+{
+  return { v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x };
+}
+
+MATH_CONSTEXPR float3 normalize(const float3& v1)
+{
+  const float length = cx::sqrt(v1.x * v1.x + v1.y * v1.y + v1.z * v1.z);
+
+  return { v1.x / length, v1.y / length, v1.z / length };
+}
+
+// Operator overloading
+
+template <typename T>
+constexpr Vector<T, 3> operator-(const Vector<T, 3>& v1) { return { -v1.x, -v1.y, -v1.z }; }
+
+template <typename T>
+constexpr Vector<T, 3> operator-(const Vector<T, 3>& v1, const Vector<T, 3>& v2) { return { v1.x - v2.x, v1.y - v2.y, v1.z - v2.z }; }
+
+template <typename T>
+constexpr Vector<T, 2>& operator-=(Vector<T, 2>& v1, const Vector<T, 2>& v2)
+{
+  v1.x = v1.x - v2.x;
+  v1.y = v1.y - v2.y;
+
+  return v1;
+}
+
+template <typename T>
+constexpr Vector<T, 2> operator+(const Vector<T, 2>& v1, typename Vector<T, 2>::value_type s1) { return { v1.x + s1, v1.y + s1 }; }
+
+template <typename T>
+constexpr Vector<T, 2> operator+(const Vector<T, 2>& v1, const Vector<T, 2>& v2) { return { v1.x + v2.x, v1.y + v2.y }; }
+
+// Portable versions of the matrix operations, used in constant expressions and
+// for types and sizes without a SIMD version. Every element is summed in the
+// order of dot, so both versions give the same results.
+namespace scalar
+{
+  // Element r, c of the product, written out for the common inner size of 4
+  template <typename T, size_t R, size_t K, size_t C>
+  constexpr T multiplyElement(const Matrix<T, R, K>& m1, const Matrix<T, K, C>& m2, size_t r, size_t c)
+  {
+    T sum = m1.m[r][0] * m2.m[0][c];
+    for (size_t k = 1; k < K; k++)
+      sum = sum + m1.m[r][k] * m2.m[k][c];
+
+    return sum;
+  }
+
+  template <typename T, size_t R, size_t C>
+  constexpr T multiplyElement(const Matrix<T, R, 4>& m1, const Matrix<T, 4, C>& m2, size_t r, size_t c)
+  {
+    return m1.m[r][0] * m2.m[0][c] + m1.m[r][1] * m2.m[1][c] + m1.m[r][2] * m2.m[2][c] + m1.m[r][3] * m2.m[3][c];
+  }
+
+  template <typename T, size_t R, size_t K, size_t C>
+  constexpr Matrix<T, R, C> multiply(const Matrix<T, R, K>& m1, const Matrix<T, K, C>& m2)
+  {
+    Matrix<T, R, C> mul = {};
+
+    for (size_t r = 0; r < R; r++)
+      for (size_t c = 0; c < C; c++)
+        mul.m[r][c] = multiplyElement(m1, m2, r, c);
+
+    return mul;
+  }
+
+  template <typename T>
+  constexpr Vector<T, 4> multiply(const Matrix<T, 4, 4>& m1, const Vector<T, 4>& v1)
+  {
+    const T* r[4] = { m1.m[0], m1.m[1], m1.m[2], m1.m[3] };
+
+    return
+    {
+      r[0][0] * v1.x + r[0][1] * v1.y + r[0][2] * v1.z + r[0][3] * v1.w,
+      r[1][0] * v1.x + r[1][1] * v1.y + r[1][2] * v1.z + r[1][3] * v1.w,
+      r[2][0] * v1.x + r[2][1] * v1.y + r[2][2] * v1.z + r[2][3] * v1.w,
+      r[3][0] * v1.x + r[3][1] * v1.y + r[3][2] * v1.z + r[3][3] * v1.w,
+    };
+  }
+
+  template <typename T, size_t R, size_t C>
+  constexpr Matrix<T, C, R> transpose(const Matrix<T, R, C>& m1)
+  {
+    Matrix<T, C, R> t = {};
+
+    for (size_t r = 0; r < R; r++)
+      for (size_t c = 0; c < C; c++)
+        t.m[c][r] = m1.m[r][c];
+
+    return t;
+  }
+
+  // Adjugate divided by the determinant, a singular matrix gives infinities and NaNs
+  template <typename T>
+  constexpr Matrix<T, 4, 4> inverse(const Matrix<T, 4, 4>& m1)
+  {
+    const auto& a = m1.m;
+
+    // 2x2 determinants of the upper two and the lower two rows
+    const T s0 = a[0][0] * a[1][1] - a[1][0] * a[0][1];
+    const T s1 = a[0][0] * a[1][2] - a[1][0] * a[0][2];
+    const T s2 = a[0][0] * a[1][3] - a[1][0] * a[0][3];
+    const T s3 = a[0][1] * a[1][2] - a[1][1] * a[0][2];
+    const T s4 = a[0][1] * a[1][3] - a[1][1] * a[0][3];
+    const T s5 = a[0][2] * a[1][3] - a[1][2] * a[0][3];
+
+    const T c5 = a[2][2] * a[3][3] - a[3][2] * a[2][3];
+    const T c4 = a[2][1] * a[3][3] - a[3][1] * a[2][3];
+    const T c3 = a[2][1] * a[3][2] - a[3][1] * a[2][2];
+    const T c2 = a[2][0] * a[3][3] - a[3][0] * a[2][3];
+    const T c1 = a[2][0] * a[3][2] - a[3][0] * a[2][2];
+    const T c0 = a[2][0] * a[3][1] - a[3][0] * a[2][1];
+
+    const T invDet = T(1) / (s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0);
+
+    Matrix<T, 4, 4> inv = {};
+
+    inv.m[0][0] = ( a[1][1] * c5 - a[1][2] * c4 + a[1][3] * c3) * invDet;
+    inv.m[0][1] = (-a[0][1] * c5 + a[0][2] * c4 - a[0][3] * c3) * invDet;
+    inv.m[0][2] = ( a[3][1] * s5 - a[3][2] * s4 + a[3][3] * s3) * invDet;
+    inv.m[0][3] = (-a[2][1] * s5 + a[2][2] * s4 - a[2][3] * s3) * invDet;
+
+    inv.m[1][0] = (-a[1][0] * c5 + a[1][2] * c2 - a[1][3] * c1) * invDet;
+    inv.m[1][1] = ( a[0][0] * c5 - a[0][2] * c2 + a[0][3] * c1) * invDet;
+    inv.m[1][2] = (-a[3][0] * s5 + a[3][2] * s2 - a[3][3] * s1) * invDet;
+    inv.m[1][3] = ( a[2][0] * s5 - a[2][2] * s2 + a[2][3] * s1) * invDet;
+
+    inv.m[2][0] = ( a[1][0] * c4 - a[1][1] * c2 + a[1][3] * c0) * invDet;
+    inv.m[2][1] = (-a[0][0] * c4 + a[0][1] * c2 - a[0][3] * c0) * invDet;
+    inv.m[2][2] = ( a[3][0] * s4 - a[3][1] * s2 + a[3][3] * s0) * invDet;
+    inv.m[2][3] = (-a[2][0] * s4 + a[2][1] * s2 - a[2][3] * s0) * invDet;
+
+    inv.m[3][0] = (-a[1][0] * c3 + a[1][1] * c1 - a[1][2] * c0) * invDet;
+    inv.m[3][1] = ( a[0][0] * c3 - a[0][1] * c1 + a[0][2] * c0) * invDet;
+    inv.m[3][2] = (-a[3][0] * s3 + a[3][1] * s1 - a[3][2] * s0) * invDet;
+    inv.m[3][3] = ( a[2][0] * s3 - a[2][1] * s1 + a[2][2] * s0) * invDet;
+
+    return inv;
+  }
+}
+
+#if defined(T_PGE_SSE2)
+// float4x4 operations on SSE registers, one row per register
+namespace simd
+{
+  inline float4x4 multiply(const float4x4& m1, const float4x4& m2)
+  {
+    float4x4 mul;
+
+    const __m128 b0 = _mm_load_ps(m2.m[0]);
+    const __m128 b1 = _mm_load_ps(m2.m[1]);
+    const __m128 b2 = _mm_load_ps(m2.m[2]);
+    const __m128 b3 = _mm_load_ps(m2.m[3]);
+
+    // Row r of the result is the rows of m2 weighted by row r of m1
+    for (int r = 0; r < 4; r++)
+    {
+      const __m128 a = _mm_load_ps(m1.m[r]);
+
+      __m128 sum = _mm_mul_ps(_mm_shuffle_ps(a, a, 0x00), b0);
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_shuffle_ps(a, a, 0x55), b1));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xAA), b2));
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xFF), b3));
+
+      _mm_store_ps(mul.m[r], sum);
+    }
+
+    return mul;
+  }
+
+  inline float4 multiply(const float4x4& m1, const float4& v1)
+  {
+    const __m128 v = _mm_load_ps(&v1.x);
+
+    // Products of every row, transposed so the sums run across registers
+    __m128 p0 = _mm_mul_ps(_mm_load_ps(m1.m[0]), v);
+    __m128 p1 = _mm_mul_ps(_mm_load_ps(m1.m[1]), v);
+    __m128 p2 = _mm_mul_ps(_mm_load_ps(m1.m[2]), v);
+    __m128 p3 = _mm_mul_ps(_mm_load_ps(m1.m[3]), v);
+    _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+
+    float4 mul;
+    _mm_store_ps(&mul.x, _mm_add_ps(_mm_add_ps(_mm_add_ps(p0, p1), p2), p3));
+
+    return mul;
+  }
+
+  inline float4x4 transpose(const float4x4& m1)
+  {
+    __m128 r0 = _mm_load_ps(m1.m[0]);
+    __m128 r1 = _mm_load_ps(m1.m[1]);
+    __m128 r2 = _mm_load_ps(m1.m[2]);
+    __m128 r3 = _mm_load_ps(m1.m[3]);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+    float4x4 t;
+    _mm_store_ps(t.m[0], r0);
+    _mm_store_ps(t.m[1], r1);
+    _mm_store_ps(t.m[2], r2);
+    _mm_store_ps(t.m[3], r3);
+
+    return t;
+  }
+
+// Lanes x, y, z, w of the shuffle result, the first two from a, the others from b
+#define MATH_SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps(a, b, (x) | ((y) << 2) | ((z) << 4) | ((w) << 6))
+
+  // 2x2 matrices stored as one register, row major
+  inline __m128 Mul2x2(__m128 a, __m128 b)
+  {
+    return _mm_add_ps(_mm_mul_ps(a, MATH_SHUFFLE(b, b, 0, 3, 0, 3)), _mm_mul_ps(MATH_SHUFFLE(a, a, 1, 0, 3, 2), MATH_SHUFFLE(b, b, 2, 1, 2, 1)));
+  }
+
+  // Adjugate of a times b
+  inline __m128 AdjMul2x2(__m128 a, __m128 b)
+  {
+    return _mm_sub_ps(_mm_mul_ps(MATH_SHUFFLE(a, a, 3, 3, 0, 0), b), _mm_mul_ps(MATH_SHUFFLE(a, a, 1, 1, 2, 2), MATH_SHUFFLE(b, b, 2, 3, 0, 1)));
+  }
+
+  // a times the adjugate of b
+  inline __m128 MulAdj2x2(__m128 a, __m128 b)
+  {
+    return _mm_sub_ps(_mm_mul_ps(a, MATH_SHUFFLE(b, b, 3, 0, 3, 0)), _mm_mul_ps(MATH_SHUFFLE(a, a, 1, 0, 3, 2), MATH_SHUFFLE(b, b, 2, 1, 2, 1)));
+  }
+
+  // Blockwise inverse of the 2x2 sub matrices A B / C D, a singular matrix
+  // gives infinities and NaNs
+  inline float4x4 inverse(const float4x4& m1)
+  {
+    const __m128 r0 = _mm_load_ps(m1.m[0]);
+    const __m128 r1 = _mm_load_ps(m1.m[1]);
+    const __m128 r2 = _mm_load_ps(m1.m[2]);
+    const __m128 r3 = _mm_load_ps(m1.m[3]);
+
+    const __m128 A = _mm_movelh_ps(r0, r1);
+    const __m128 B = _mm_movehl_ps(r1, r0);
+    const __m128 C = _mm_movelh_ps(r2, r3);
+    const __m128 D = _mm_movehl_ps(r3, r2);
+
+    // Determinants |A| |B| |C| |D|
+    const __m128 detSub = _mm_sub_ps(
+      _mm_mul_ps(MATH_SHUFFLE(r0, r2, 0, 2, 0, 2), MATH_SHUFFLE(r1, r3, 1, 3, 1, 3)),
+      _mm_mul_ps(MATH_SHUFFLE(r0, r2, 1, 3, 1, 3), MATH_SHUFFLE(r1, r3, 0, 2, 0, 2)));
+
+    const __m128 detA = MATH_SHUFFLE(detSub, detSub, 0, 0, 0, 0);
+    const __m128 detB = MATH_SHUFFLE(detSub, detSub, 1, 1, 1, 1);
+    const __m128 detC = MATH_SHUFFLE(detSub, detSub, 2, 2, 2, 2);
+    const __m128 detD = MATH_SHUFFLE(detSub, detSub, 3, 3, 3, 3);
+
+    const __m128 DC = AdjMul2x2(D, C);
+    const __m128 AB = AdjMul2x2(A, B);
+
+    // Adjugates of the blocks of the inverse
+    __m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), Mul2x2(B, DC));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), Mul2x2(C, AB));
+    __m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), MulAdj2x2(D, AB));
+    __m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), MulAdj2x2(A, DC));
+
+    // |M| = |A||D| + |B||C| - tr(A#B D#C), the trace summed into every lane
+    __m128 tr = _mm_mul_ps(AB, MATH_SHUFFLE(DC, DC, 0, 2, 1, 3));
+    tr = _mm_add_ps(tr, MATH_SHUFFLE(tr, tr, 2, 3, 0, 1));
+    tr = _mm_add_ps(tr, MATH_SHUFFLE(tr, tr, 1, 0, 3, 2));
+
+    const __m128 detM = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(detA, detD), _mm_mul_ps(detB, detC)), tr);
+    const __m128 rDetM = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), detM);
+
+    X = _mm_mul_ps(X, rDetM);
+    Y = _mm_mul_ps(Y, rDetM);
+    Z = _mm_mul_ps(Z, rDetM);
+    W = _mm_mul_ps(W, rDetM);
+
+    // The adjugate shuffle and the interleave of the blocks in one step
+    float4x4 inv;
+    _mm_store_ps(inv.m[0], MATH_SHUFFLE(X, Y, 3, 1, 3, 1));
+    _mm_store_ps(inv.m[1], MATH_SHUFFLE(X, Y, 2, 0, 2, 0));
+    _mm_store_ps(inv.m[2], MATH_SHUFFLE(Z, W, 3, 1, 3, 1));
+    _mm_store_ps(inv.m[3], MATH_SHUFFLE(Z, W, 2, 0, 2, 0));
+
+    return inv;
+  }
+
+#undef MATH_SHUFFLE
+}
+#endif
+
+// The SIMD versions are chosen at run time for float4x4 by the overloads below,
+// constant expressions and other types use the scalar ones
+template <typename T, size_t R, size_t K, size_t C>
+constexpr Matrix<T, R, C> operator*(const Matrix<T, R, K>& m1, const Matrix<T, K, C>& m2) { return scalar::multiply(m1, m2); }
+
+template <typename T>
+constexpr Vector<T, 4> operator*(const Matrix<T, 4, 4>& m1, const Vector<T, 4>& v1) { return scalar::multiply(m1, v1); }
+
+template <typename T, size_t R, size_t C>
+constexpr Matrix<T, C, R> transpose(const Matrix<T, R, C>& m1) { return scalar::transpose(m1); }
+
+template <typename T>
+constexpr Matrix<T, 4, 4> inverse(const Matrix<T, 4, 4>& m1) { return scalar::inverse(m1); }
+
+#if defined(T_PGE_SSE2)
+MATH_CONSTEXPR float4x4 operator*(const float4x4& m1, const float4x4& m2)
+{
+  return MATH_IS_CONSTANT_EVALUATED() ? scalar::multiply(m1, m2) : simd::multiply(m1, m2);
+}
+
+MATH_CONSTEXPR float4 operator*(const float4x4& m1, const float4& v1)
+{
+  return MATH_IS_CONSTANT_EVALUATED() ? scalar::multiply(m1, v1) : simd::multiply(m1, v1);
+}
+
+MATH_CONSTEXPR float4x4 transpose(const float4x4& m1)
+{
+  return MATH_IS_CONSTANT_EVALUATED() ? scalar::transpose(m1) : simd::transpose(m1);
+}
+
+MATH_CONSTEXPR float4x4 inverse(const float4x4& m1)
+{
+  return MATH_IS_CONSTANT_EVALUATED() ? scalar::inverse(m1) : simd::inverse(m1);
+}
+#endif
+
+// Sine and cosine of the same angle, one at a time or for a whole array. The
+// angle is reduced to -pi/4..pi/4 by the nearest multiple of pi/2, subtracted
+// in three parts so the reduction stays exact, and both are evaluated by the
+// minimax polynomials of Cephes sinf and cosf. For |angle| <= 8192 radians the
+// error against libm is below 1.2e-7, beyond that the reduction loses digits.
+// Beyond about 3e9 radians, for infinities and for NaN the results are
+// meaningless, but not undefined. The batch runs 8 or 4 angles per step with
+// the same operations as the single angle version, so both give the same
+// results within the valid range.
+namespace trig
+{
+  constexpr float twoOverPi = 0.636619772367581343f;
+
+  // pi/2 = halfPi1 + halfPi2 + halfPi3, the first two exact when multiplied by
+  // the quadrant
+  constexpr float halfPi1 = 1.5703125f;
+  constexpr float halfPi2 = 4.837512969970703125e-4f;
+  constexpr float halfPi3 = 7.54978995489188216e-8f;
+
+  constexpr float sin0 = -1.6666654611e-1f, sin1 = 8.3321608736e-3f, sin2 = -1.9515295891e-4f;
+  constexpr float cos0 = 4.166664568298827e-2f, cos1 = -1.388731625493765e-3f, cos2 = 2.443315711809948e-5f;
+}
+
+inline void sinCos(float angle, float& s, float& c)
+{
+  using namespace trig;
+
+  // Nearest quadrant, rounded half away from zero. NaN and quadrants beyond
+  // int32_t convert -2^31 instead, which is what the conversion of the SIMD
+  // versions gives. Selected by the bits, a float compare would keep loops
+  // calling this from being vectorized.
+  float t = angle * twoOverPi + (angle < 0.0f ? -0.5f : 0.5f);
+  uint32_t bits;
+  std::memcpy(&bits, &t, sizeof(bits));
+  const uint32_t inRange = 0u - (uint32_t)((bits & 0x7FFFFFFF) < 0x4F000000);
+  bits = (bits & inRange) | (0xCF000000 & ~inRange);
+  std::memcpy(&t, &bits, sizeof(bits));
+  const int32_t n = (int32_t)t;
+  const float q = (float)n;
+  const float r = ((angle - q * halfPi1) - q * halfPi2) - q * halfPi3;
+  const float z = r * r;
+
+  const float sr = r + r * z * ((sin2 * z + sin1) * z + sin0);
+  const float cr = 1.0f - 0.5f * z + z * z * ((cos2 * z + cos1) * z + cos0);
+
+  // sin(r + n pi/2) and cos(r + n pi/2) from the quadrant
+  const float sq = (n & 1) ? cr : sr;
+  const float cq = (n & 1) ? sr : cr;
+
+  s = (n & 2) ? -sq : sq;
+  c = ((n + 1) & 2) ? -cq : cq;
+}
+
+inline void sinCos(const float* angles, size_t count, float* sines, float* cosines)
+{
+  using namespace trig;
+
+  size_t i = 0;
+
+#if defined(T_PGE_AVX2)
+  {
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+
+    for (; i < (count & ~(size_t)7); i += 8)
+    {
+      const __m256 x = _mm256_loadu_ps(angles + i);
+
+      const __m256 half = _mm256_or_ps(_mm256_set1_ps(0.5f), _mm256_and_ps(x, signMask));
+      const __m256i n = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(twoOverPi)), half));
+      const __m256 q = _mm256_cvtepi32_ps(n);
+
+      __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(q, _mm256_set1_ps(halfPi1)));
+      r = _mm256_sub_ps(r, _mm256_mul_ps(q, _mm256_set1_ps(halfPi2)));
+      r = _mm256_sub_ps(r, _mm256_mul_ps(q, _mm256_set1_ps(halfPi3)));
+      const __m256 z = _mm256_mul_ps(r, r);
+
+      __m256 sp = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(sin2), z), _mm256_set1_ps(sin1));
+      sp = _mm256_add_ps(_mm256_mul_ps(sp, z), _mm256_set1_ps(sin0));
+      const __m256 sr = _mm256_add_ps(r, _mm256_mul_ps(_mm256_mul_ps(r, z), sp));
+
+      __m256 cp = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(cos2), z), _mm256_set1_ps(cos1));
+      cp = _mm256_add_ps(_mm256_mul_ps(cp, z), _mm256_set1_ps(cos0));
+      const __m256 cr = _mm256_add_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(_mm256_set1_ps(0.5f), z)), _mm256_mul_ps(_mm256_mul_ps(z, z), cp));
+
+      const __m256 odd = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(n, one), one));
+      const __m256 sq = _mm256_blendv_ps(sr, cr, odd);
+      const __m256 cq = _mm256_blendv_ps(cr, sr, odd);
+
+      const __m256 sSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(n, two), 30));
+      const __m256 cSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(n, one), two), 30));
+
+      _mm256_storeu_ps(sines + i, _mm256_xor_ps(sq, sSign));
+      _mm256_storeu_ps(cosines + i, _mm256_xor_ps(cq, cSign));
+    }
+  }
+#endif
+
+#if defined(T_PGE_SSE2)
+  {
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+
+    for (; i < (count & ~(size_t)3); i += 4)
+    {
+      const __m128 x = _mm_loadu_ps(angles + i);
+
+      const __m128 half = _mm_or_ps(_mm_set1_ps(0.5f), _mm_and_ps(x, signMask));
+      const __m128i n = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(twoOverPi)), half));
+      const __m128 q = _mm_cvtepi32_ps(n);
+
+      __m128 r = _mm_sub_ps(x, _mm_mul_ps(q, _mm_set1_ps(halfPi1)));
+      r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(halfPi2)));
+      r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(halfPi3)));
+      const __m128 z = _mm_mul_ps(r, r);
+
+      __m128 sp = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(sin2), z), _mm_set1_ps(sin1));
+      sp = _mm_add_ps(_mm_mul_ps(sp, z), _mm_set1_ps(sin0));
+      const __m128 sr = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, z), sp));
+
+      __m128 cp = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(cos2), z), _mm_set1_ps(cos1));
+      cp = _mm_add_ps(_mm_mul_ps(cp, z), _mm_set1_ps(cos0));
+      const __m128 cr = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(0.5f), z)), _mm_mul_ps(_mm_mul_ps(z, z), cp));
+
+      // SSE2 has no blend, odd quadrants swap sine and cosine by masks
+      const __m128 odd = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(n, one), one));
+      const __m128 sq = _mm_or_ps(_mm_and_ps(odd, cr), _mm_andnot_ps(odd, sr));
+      const __m128 cq = _mm_or_ps(_mm_and_ps(odd, sr), _mm_andnot_ps(odd, cr));
+
+      const __m128 sSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(n, two), 30));
+      const __m128 cSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(n, one), two), 30));
+
+      _mm_storeu_ps(sines + i, _mm_xor_ps(sq, sSign));
+      _mm_storeu_ps(cosines + i, _mm_xor_ps(cq, cSign));
+    }
+  }
+#endif
+
+  // Remaining angles
+  for (; i < count; i++)
+    sinCos(angles[i], sines[i], cosines[i]);
+}
+
+// Transformations
+
+constexpr float4x4 translation(float x, float y, float z)
+{
+  return
+  {{
+    { 1, 0, 0, x },
+    { 0, 1, 0, y },
+    { 0, 0, 1, z },
+    { 0, 0, 0, 1 },
+  }};
+}
+
+// Counter-clockwise seen from +y looking down, angle in radians
+MATH_CONSTEXPR float4x4 rotationY(float angle)
+{
+  float s = 0.0f, c = 0.0f;
+
+  if (MATH_IS_CONSTANT_EVALUATED())
+  {
+    s = cx::sin(angle);
+    c = cx::cos(angle);
+  }
+  else
+    sinCos(angle, s, c);
+
+  return
+  {{
+    {  c, 0, s, 0 },
+    {  0, 1, 0, 0 },
+    { -s, 0, c, 0 },
+    {  0, 0, 0, 1 },
+  }};
+}
+
+// Right handed view matrix, the camera at eye looks at target
+MATH_CONSTEXPR float4x4 lookAt(const float3& eye, const float3& target, const float3& up)
+{
+  const float3 zaxis = normalize(eye - target);
+  const float3 xaxis = normalize(cross(up, zaxis));
+  const float3 yaxis = cross(zaxis, xaxis);
+
+  return
+  {{
+    { xaxis.x, xaxis.y, xaxis.z, -dot(xaxis, eye) },
+    { yaxis.x, yaxis.y, yaxis.z, -dot(yaxis, eye) },
+    { zaxis.x, zaxis.y, zaxis.z, -dot(zaxis, eye) },
+    { 0, 0, 0, 1 },
+  }};
+}
+
+// Right handed projection to 0 <= z <= w between the near and far plane,
+// vertical field of view in radians
+MATH_CONSTEXPR float4x4 perspective(float fovY, float aspectRatio, float n, float f)
+{
+  const float yScale = 1.0f / cx::tan(fovY / 2.0f);
+  const float xScale = yScale / aspectRatio;
+
+  return
+  {{
+    { xScale, 0     , 0      , 0               },
+    { 0     , yScale, 0      , 0               },
+    { 0     , 0     , f/(n-f), n * f / (n - f) },
+    { 0     , 0     , -1     , 0               },
+  }};
+}
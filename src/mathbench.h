@@ -0,0 +1,248 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "src/math.h"
+
+// Microbenchmark of the matrix operations against the float4x4 operators they
+// replaced, which are kept here as the reference
+namespace legacy
+{
+  using float4x4 = std::array<std::array<float, 4>, 4>;
+
+  inline float dot(const float4& v1, const float4& v2) { return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z + v1.w * v2.w; }
+
+  inline float4x4 mul(const float4x4& m1, const float4x4& m2)
+  {
+    const float4 row_11 = { m1[0][0], m1[0][1], m1[0][2], m1[0][3] };
+    const float4 row_21 = { m1[1][0], m1[1][1], m1[1][2], m1[1][3] };
+    const float4 row_31 = { m1[2][0], m1[2][1], m1[2][2], m1[2][3] };
+    const float4 row_41 = { m1[3][0], m1[3][1], m1[3][2], m1[3][3] };
+
+    const float4 col_12 = { m2[0][0], m2[1][0], m2[2][0], m2[3][0] };
+    const float4 col_22 = { m2[0][1], m2[1][1], m2[2][1], m2[3][1] };
+    const float4 col_32 = { m2[0][2], m2[1][2], m2[2][2], m2[3][2] };
+    const float4 col_42 = { m2[0][3], m2[1][3], m2[2][3], m2[3][3] };
+
+    float4x4 mul =
+    {{
+      {{ dot(row_11, col_12), dot(row_11, col_22), dot(row_11, col_32), dot(row_11, col_42) }},
+      {{ dot(row_21, col_12), dot(row_21, col_22), dot(row_21, col_32), dot(row_21, col_42) }},
+      {{ dot(row_31, col_12), dot(row_31, col_22), dot(row_31, col_32), dot(row_31, col_42) }},
+      {{ dot(row_41, col_12), dot(row_41, col_22), dot(row_41, col_32), dot(row_41, col_42) }},
+    }};
+
+    return mul;
+  }
+
+  inline float4 mul(const float4x4& m1, const float4& v1)
+  {
+    const float4 row_11 = { m1[0][0], m1[0][1], m1[0][2], m1[0][3] };
+    const float4 row_21 = { m1[1][0], m1[1][1], m1[1][2], m1[1][3] };
+    const float4 row_31 = { m1[2][0], m1[2][1], m1[2][2], m1[2][3] };
+    const float4 row_41 = { m1[3][0], m1[3][1], m1[3][2], m1[3][3] };
+
+    return { dot(row_11, v1), dot(row_21, v1), dot(row_31, v1), dot(row_41, v1) };
+  }
+}
+
+// Times every operation on the same random inputs and checks that the results
+// agree with the reference. Returns false if one of them does not.
+inline bool RunMathBenchmark(size_t rounds = 20000)
+{
+  // Few enough that all inputs and outputs stay in the L1 cache
+  constexpr size_t count = 128;
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> value(-2.0f, 2.0f);
+
+  AlignedVector<float4x4> a(count), b(count), out(count);
+  std::vector<legacy::float4x4> la(count), lb(count), lout(count);
+  AlignedVector<float4> v(count), vout(count);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+      {
+        la[i][r][c] = a[i][r][c] = value(rng);
+        lb[i][r][c] = b[i][r][c] = value(rng);
+      }
+
+    v[i] = { value(rng), value(rng), value(rng), value(rng) };
+  }
+
+  bool ok = true;
+
+  // Nanoseconds per input of op(i) called for all inputs, or called once when
+  // it handles the whole batch, the best of a few tries
+  auto time = [&](const char* name, auto op, bool batch = false)
+  {
+    const size_t calls = batch ? 1 : count;
+    double best = 1e30;
+
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+      const auto start = std::chrono::steady_clock::now();
+
+      for (size_t round = 0; round < rounds / 5; round++)
+        for (size_t i = 0; i < calls; i++)
+          op(i);
+
+      const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count() / (double)((rounds / 5) * count));
+    }
+
+    std::printf("  %-28s %7.2f ns\n", name, best);
+  };
+
+  // Compilers may contract the sums of products to FMA differently in the two
+  // versions, so equal means within rounding
+  auto close = [](float a, float b) { return std::fabs(a - b) <= 1e-5f * std::max(1.0f, std::fabs(a)); };
+
+  auto check = [&](const char* name, bool equal)
+  {
+    if (!equal)
+    {
+      std::printf("  %s differs from the reference\n", name);
+      ok = false;
+    }
+  };
+
+  // Transforms are chained like the model, view and projection matrices, so
+  // the multiplies are timed one after the other on rotations that keep the
+  // product bounded
+  AlignedVector<float4x4> rotations(count);
+  std::vector<legacy::float4x4> legacyRotations(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    rotations[i] = rotationY(value(rng));
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        legacyRotations[i][r][c] = rotations[i][r][c];
+  }
+
+  legacy::float4x4 legacyChain = {};
+  float4x4 chain = {};
+
+  std::printf("Matrix multiply\n");
+  time("legacy operator*", [&](size_t i) { legacyChain = legacy::mul(i ? legacyChain : legacyRotations[0], legacyRotations[i]); });
+  time("scalar::multiply", [&](size_t i) { chain = scalar::multiply(i ? chain : rotations[0], rotations[i]); });
+  time("operator*", [&](size_t i) { chain = (i ? chain : rotations[0]) * rotations[i]; });
+
+  for (size_t i = 0; i < count; i++)
+  {
+    out[i] = a[i] * b[i];
+    lout[i] = legacy::mul(la[i], lb[i]);
+  }
+
+  bool matricesEqual = close(legacyChain[0][0], chain[0][0]);
+  for (size_t i = 0; i < count; i++)
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        if (!close(out[i][r][c], lout[i][r][c]))
+          matricesEqual = false;
+  check("operator*", matricesEqual);
+
+  std::printf("Matrix times vector\n");
+  AlignedVector<float4> lvout(count);
+  time("legacy operator*", [&](size_t i) { lvout[i] = legacy::mul(la[i], v[i]); });
+  time("scalar::multiply", [&](size_t i) { vout[i] = scalar::multiply(a[i], v[i]); });
+  time("operator*", [&](size_t i) { vout[i] = a[i] * v[i]; });
+
+  bool vectorsEqual = true;
+  for (size_t i = 0; i < count; i++)
+    if (!close(vout[i].x, lvout[i].x) || !close(vout[i].y, lvout[i].y) || !close(vout[i].z, lvout[i].z) || !close(vout[i].w, lvout[i].w))
+      vectorsEqual = false;
+  check("operator* with a vector", vectorsEqual);
+
+  std::printf("Transpose\n");
+  AlignedVector<float4x4> reference(count);
+  time("scalar::transpose", [&](size_t i) { reference[i] = scalar::transpose(a[i]); });
+  time("transpose", [&](size_t i) { out[i] = transpose(a[i]); });
+
+  bool transposeEqual = true;
+  for (size_t i = 0; i < count; i++)
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        if (out[i][r][c] != reference[i][r][c])
+          transposeEqual = false;
+  check("transpose", transposeEqual);
+
+  // The two ways of computing the inverse round differently, they are compared
+  // by how close a times its inverse is to identity
+  std::printf("Inverse\n");
+  time("scalar::inverse", [&](size_t i) { reference[i] = scalar::inverse(a[i]); });
+  time("inverse", [&](size_t i) { out[i] = inverse(a[i]); });
+
+  size_t inverseWorse = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    const float4x4 p1 = scalar::multiply(a[i], reference[i]);
+    const float4x4 p2 = scalar::multiply(a[i], out[i]);
+
+    float e1 = 0.0f, e2 = 0.0f;
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+      {
+        e1 = std::max(e1, std::fabs(p1[r][c] - (r == c ? 1.0f : 0.0f)));
+        e2 = std::max(e2, std::fabs(p2[r][c] - (r == c ? 1.0f : 0.0f)));
+      }
+
+    // Nearly singular inputs lose precision either way
+    if (e2 > std::max(e1 * 8.0f, 1e-4f))
+      inverseWorse++;
+  }
+  check("inverse", inverseWorse == 0);
+
+  std::printf("Sine and cosine\n");
+  std::vector<float> angles(count), sines(count), cosines(count);
+  std::uniform_real_distribution<float> angle(-8.0f, 8.0f);
+  for (float& a : angles)
+    a = angle(rng);
+
+  time("std::sin, std::cos", [&](size_t i) { sines[i] = std::sin(angles[i]); cosines[i] = std::cos(angles[i]); });
+  time("sinCos", [&](size_t i) { sinCos(angles[i], sines[i], cosines[i]); });
+  time("sinCos batch", [&](size_t) { sinCos(angles.data(), count, sines.data(), cosines.data()); }, true);
+
+  // Against libm in double over the whole documented range, densely around
+  // zero where the demo's angles are. The batch has to agree with the single
+  // angle version.
+  double maxError = 0.0;
+  bool batchEqual = true;
+
+  for (const float range : { 3.2f, 8192.0f })
+  {
+    constexpr size_t samples = 1 << 20;
+    std::vector<float> x(samples), s(samples), c(samples);
+    for (size_t i = 0; i < samples; i++)
+      x[i] = -range + 2.0f * range * (float)i / (float)samples;
+
+    sinCos(x.data(), samples, s.data(), c.data());
+
+    for (size_t i = 0; i < samples; i++)
+    {
+      float s1, c1;
+      sinCos(x[i], s1, c1);
+      if (!close(s1, s[i]) || !close(c1, c[i]))
+        batchEqual = false;
+
+      maxError = std::max(maxError, std::fabs((double)s[i] - std::sin((double)x[i])));
+      maxError = std::max(maxError, std::fabs((double)c[i] - std::cos((double)x[i])));
+    }
+  }
+
+  std::printf("  %-28s %9.2e\n", "max error", maxError);
+  check("sinCos", maxError < 1.2e-7);
+  check("sinCos batch", batchEqual);
+
+  std::printf(ok ? "All results match\n" : "Some results do not match\n");
+
+  return ok;
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "engine/tPixelGameEngine.h"
+#include "src/math.h"
+#include "src/pipeline.h"
+
+// Indexed mesh, every vertex is stored and transformed once no matter how
+// many faces share it
+struct Mesh
+{
+  // Object space positions, w is always 1
+  VertexStream positions;
+  // Triangle list, polygons are fan triangulated
+  std::vector<uint32_t> indices;
+  // Texture coordinate of every triangle corner, in the order of indices
+  std::vector<float2> texCoords;
+  // Pairs of vertex indices, every polygon edge exactly once
+  std::vector<uint32_t> edges;
+  // Object space unit normal of every triangle
+  std::vector<float3> normals;
+  // Object space bounding sphere
+  float3 center = { 0, 0, 0 };
+  float radius = 0.0f;
+};
+
+// Bounding sphere around the center of the bounding box
+inline void ComputeBoundingSphere(Mesh& mesh)
+{
+  const VertexStream& p = mesh.positions;
+  if (p.size() == 0)
+    return;
+
+  float3 lo = { p.x[0], p.y[0], p.z[0] };
+  float3 hi = lo;
+
+  for (size_t i = 1; i < p.size(); i++)
+  {
+    lo = { std::min(lo.x, p.x[i]), std::min(lo.y, p.y[i]), std::min(lo.z, p.z[i]) };
+    hi = { std::max(hi.x, p.x[i]), std::max(hi.y, p.y[i]), std::max(hi.z, p.z[i]) };
+  }
+
+  mesh.center = { (lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f };
+
+  float radius2 = 0.0f;
+  for (size_t i = 0; i < p.size(); i++)
+  {
+    float3 d = float3{ p.x[i], p.y[i], p.z[i] } - mesh.center;
+    radius2 = std::max(radius2, dot(d, d));
+  }
+
+  mesh.radius = std::sqrt(radius2);
+}
+
+// Normals of the triangles, counter-clockwise ones face the viewer
+inline void ComputeFaceNormals(Mesh& mesh)
+{
+  const VertexStream& p = mesh.positions;
+  mesh.normals.resize(mesh.indices.size() / 3);
+
+  for (size_t t = 0; t < mesh.normals.size(); t++)
+  {
+    uint32_t i0 = mesh.indices[t * 3 + 0], i1 = mesh.indices[t * 3 + 1], i2 = mesh.indices[t * 3 + 2];
+    float3 e1 = { p.x[i1] - p.x[i0], p.y[i1] - p.y[i0], p.z[i1] - p.z[i0] };
+    float3 e2 = { p.x[i2] - p.x[i0], p.y[i2] - p.y[i0], p.z[i2] - p.z[i0] };
+    float3 n = cross(e1, e2);
+
+    // Degenerate triangles get a zero normal instead of NaNs
+    mesh.normals[t] = dot(n, n) > 0.0f ? normalize(n) : float3{ 0, 0, 0 };
+  }
+}
+
+// Texture coordinate of corner i of a polygon with count corners. Quads cover
+// the whole texture, other polygons lie on the circle inside it.
+inline float2 PolygonTexCoord(size_t i, size_t count)
+{
+  if (count == 4)
+  {
+    const float2 corners[4] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+    return corners[i];
+  }
+
+  float s, c;
+  sinCos(6.2831853f * (float)i / (float)count, s, c);
+  return { 0.5f + 0.5f * c, 0.5f + 0.5f * s };
+}
+
+// Adds a polygon to the mesh. Its boundary goes to the edge list which still
+// has to be deduplicated by BuildEdgeList once all polygons are in.
+inline void AddPolygon(Mesh& mesh, const uint32_t* polygon, size_t count)
+{
+  if (count < 2)
+    return;
+
+  for (size_t i = 2; i < count; i++)
+  {
+    mesh.indices.push_back(polygon[0]);
+    mesh.indices.push_back(polygon[i - 1]);
+    mesh.indices.push_back(polygon[i]);
+
+    mesh.texCoords.push_back(PolygonTexCoord(0, count));
+    mesh.texCoords.push_back(PolygonTexCoord(i - 1, count));
+    mesh.texCoords.push_back(PolygonTexCoord(i, count));
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    mesh.edges.push_back(polygon[i]);
+    mesh.edges.push_back(polygon[(i + 1) % count]);
+  }
+}
+
+// Removes edges shared by several polygons, so each one is drawn once
+inline void BuildEdgeList(Mesh& mesh)
+{
+  std::vector<uint64_t> keys;
+  keys.reserve(mesh.edges.size() / 2);
+
+  for (size_t i = 0; i + 1 < mesh.edges.size(); i += 2)
+  {
+    uint64_t a = std::min(mesh.edges[i], mesh.edges[i + 1]);
+    uint64_t b = std::max(mesh.edges[i], mesh.edges[i + 1]);
+
+    if (a != b)
+      keys.push_back(a << 32 | b);
+  }
+
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  mesh.edges.resize(keys.size() * 2);
+  for (size_t i = 0; i < keys.size(); i++)
+  {
+    mesh.edges[i * 2 + 0] = (uint32_t)(keys[i] >> 32);
+    mesh.edges[i * 2 + 1] = (uint32_t)(keys[i] & 0xFFFFFFFF);
+  }
+}
+
+// Scales and moves the mesh so it fits a unit cube centered at the origin
+inline void FitToUnitCube(Mesh& mesh)
+{
+  VertexStream& p = mesh.positions;
+  if (p.size() == 0)
+    return;
+
+  float3 lo = { p.x[0], p.y[0], p.z[0] };
+  float3 hi = lo;
+
+  for (size_t i = 1; i < p.size(); i++)
+  {
+    lo = { std::min(lo.x, p.x[i]), std::min(lo.y, p.y[i]), std::min(lo.z, p.z[i]) };
+    hi = { std::max(hi.x, p.x[i]), std::max(hi.y, p.y[i]), std::max(hi.z, p.z[i]) };
+  }
+
+  float extent = std::max(std::max(hi.x - lo.x, hi.y - lo.y), hi.z - lo.z);
+  float scale = extent > 0.0f ? 1.0f / extent : 1.0f;
+  float3 center = { (lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f };
+
+  for (size_t i = 0; i < p.size(); i++)
+  {
+    p.x[i] = (p.x[i] - center.x) * scale;
+    p.y[i] = (p.y[i] - center.y) * scale;
+    p.z[i] = (p.z[i] - center.z) * scale;
+  }
+
+  ComputeBoundingSphere(mesh);
+}
+
+// Loads positions and faces of a Wavefront OBJ file. Texture coordinates,
+// normals, groups and materials are skipped, faces get the ones of AddPolygon.
+inline tDX::rcode LoadObj(const std::string& sFile, Mesh& mesh)
+{
+  std::ifstream ifs(sFile, std::ifstream::binary);
+  if (!ifs.is_open())
+    return tDX::NO_FILE;
+
+  // Parse from one buffer, the file is read in a single call
+  std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+  mesh = Mesh();
+
+  std::vector<float> x, y, z;
+  std::vector<uint32_t> polygon;
+
+  const char* c = data.c_str();
+  const char* end = c + data.size();
+
+  auto skipSpaces = [&]() { while (c < end && (*c == ' ' || *c == '\t')) c++; };
+  auto skipLine = [&]() { while (c < end && *c != '\n') c++; if (c < end) c++; };
+
+  while (c < end)
+  {
+    skipSpaces();
+
+    if (c[0] == 'v' && (c[1] == ' ' || c[1] == '\t'))
+    {
+      c++;
+
+      // All three on this line, strtof would skip the line break and read on
+      float position[3];
+      for (float& coordinate : position)
+      {
+        skipSpaces();
+        if (c >= end || *c == '\n' || *c == '\r' || *c == '#')
+          return tDX::FAIL;
+
+        char* next = nullptr;
+        coordinate = strtof(c, &next);
+        if (next == c)
+          return tDX::FAIL;
+        c = next;
+      }
+
+      x.push_back(position[0]);
+      y.push_back(position[1]);
+      z.push_back(position[2]);
+    }
+    else if (c[0] == 'f' && (c[1] == ' ' || c[1] == '\t'))
+    {
+      c++;
+      polygon.clear();
+
+      while (true)
+      {
+        skipSpaces();
+        if (c >= end || *c == '\n' || *c == '\r' || *c == '#')
+          break;
+
+        char* next = nullptr;
+        long index = strtol(c, &next, 10);
+        if (next == c)
+          return tDX::FAIL;
+
+        // Negative indices are relative to the last vertex read
+        long resolved = index < 0 ? (long)x.size() + index : index - 1;
+        if (resolved < 0 || resolved >= (long)x.size())
+          return tDX::FAIL;
+
+        polygon.push_back((uint32_t)resolved);
+
+        // Skip texture and normal indices
+        c = next;
+        while (c < end && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r')
+          c++;
+      }
+
+      AddPolygon(mesh, polygon.data(), polygon.size());
+    }
+
+    skipLine();
+  }
+
+  mesh.positions.x = std::move(x);
+  mesh.positions.y = std::move(y);
+  mesh.positions.z = std::move(z);
+  mesh.positions.w.assign(mesh.positions.x.size(), 1.0f);
+
+  BuildEdgeList(mesh);
+  ComputeFaceNormals(mesh);
+  ComputeBoundingSphere(mesh);
+
+  return tDX::OK;
+}
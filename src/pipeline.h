@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "engine/tPixelGameEngine.h"
+#include "src/math.h"
+
+// Vertices stored as structure of arrays, every component is contiguous so
+// one SIMD register holds the same component of several vertices
+struct VertexStream
+{
+  std::vector<float> x, y, z, w;
+
+  size_t size() const { return x.size(); }
+
+  // Keeps the capacity, so a stream reused every frame does not allocate
+  void resize(size_t count)
+  {
+    x.resize(count);
+    y.resize(count);
+    z.resize(count);
+    w.resize(count);
+  }
+
+  void set(size_t i, const float4& v) { x[i] = v.x; y[i] = v.y; z[i] = v.z; w[i] = v.w; }
+  float4 get(size_t i) const { return { x[i], y[i], z[i], w[i] }; }
+};
+
+// Screen area the normalized device coordinates are mapped to
+struct Viewport
+{
+  float x, y;
+  float width, height;
+};
+
+// Transforms count vertices by mvp, does the perspective divide and maps the
+// result to the viewport. Out receives screen x and y, z/w as depth and 1/w in w.
+inline void TransformToScreen(const float4x4& mvp, const float* const in[4], size_t count, const Viewport& viewport, float* const out[4])
+{
+  const float* ix = in[0]; const float* iy = in[1]; const float* iz = in[2]; const float* iw = in[3];
+  float* ox = out[0]; float* oy = out[1]; float* oz = out[2]; float* ow = out[3];
+
+  const float scaleX = (viewport.width - 1) * 0.5f;
+  const float scaleY = (viewport.height - 1) * 0.5f;
+
+  size_t i = 0;
+
+#if defined(T_PGE_AVX2)
+  {
+    __m256 m[4][4];
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        m[r][c] = _mm256_set1_ps(mvp[r][c]);
+
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 sx = _mm256_set1_ps(scaleX), sy = _mm256_set1_ps(scaleY);
+    const __m256 vx = _mm256_set1_ps(viewport.x), vy = _mm256_set1_ps(viewport.y);
+
+    for (; i + 8 <= count; i += 8)
+    {
+      const __m256 x = _mm256_loadu_ps(ix + i), y = _mm256_loadu_ps(iy + i), z = _mm256_loadu_ps(iz + i), w = _mm256_loadu_ps(iw + i);
+
+      __m256 c[4];
+      for (int r = 0; r < 4; r++)
+        c[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[r][0], x), _mm256_mul_ps(m[r][1], y)), _mm256_mul_ps(m[r][2], z)), _mm256_mul_ps(m[r][3], w));
+
+      const __m256 ndcX = _mm256_div_ps(c[0], c[3]);
+      const __m256 ndcY = _mm256_div_ps(c[1], c[3]);
+
+      _mm256_storeu_ps(ox + i, _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(ndcX, one), sx), vx));
+      _mm256_storeu_ps(oy + i, _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(one, ndcY), sy), vy));
+      _mm256_storeu_ps(oz + i, _mm256_div_ps(c[2], c[3]));
+      _mm256_storeu_ps(ow + i, _mm256_div_ps(one, c[3]));
+    }
+  }
+#endif
+
+#if defined(T_PGE_SSE2)
+  {
+    __m128 m[4][4];
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        m[r][c] = _mm_set1_ps(mvp[r][c]);
+
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 sx = _mm_set1_ps(scaleX), sy = _mm_set1_ps(scaleY);
+    const __m128 vx = _mm_set1_ps(viewport.x), vy = _mm_set1_ps(viewport.y);
+
+    for (; i + 4 <= count; i += 4)
+    {
+      const __m128 x = _mm_loadu_ps(ix + i), y = _mm_loadu_ps(iy + i), z = _mm_loadu_ps(iz + i), w = _mm_loadu_ps(iw + i);
+
+      __m128 c[4];
+      for (int r = 0; r < 4; r++)
+        c[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], x), _mm_mul_ps(m[r][1], y)), _mm_mul_ps(m[r][2], z)), _mm_mul_ps(m[r][3], w));
+
+      const __m128 ndcX = _mm_div_ps(c[0], c[3]);
+      const __m128 ndcY = _mm_div_ps(c[1], c[3]);
+
+      _mm_storeu_ps(ox + i, _mm_add_ps(_mm_mul_ps(_mm_add_ps(ndcX, one), sx), vx));
+      _mm_storeu_ps(oy + i, _mm_add_ps(_mm_mul_ps(_mm_sub_ps(one, ndcY), sy), vy));
+      _mm_storeu_ps(oz + i, _mm_div_ps(c[2], c[3]));
+      _mm_storeu_ps(ow + i, _mm_div_ps(one, c[3]));
+    }
+  }
+#endif
+
+  // Remaining vertices
+  for (; i < count; i++)
+  {
+    float4 v = mvp * float4{ ix[i], iy[i], iz[i], iw[i] };
+
+    ox[i] = (v.x / v.w + 1.0f) * scaleX + viewport.x;
+    oy[i] = (1.0f - v.y / v.w) * scaleY + viewport.y;
+    oz[i] = v.z / v.w;
+    ow[i] = 1.0f / v.w;
+  }
+}
+
+// Transforms the whole stream to the screen, see above
+inline void TransformToScreen(const float4x4& mvp, const VertexStream& in, const Viewport& viewport, VertexStream& out)
+{
+  out.resize(in.size());
+
+  const float* const i[4] = { in.x.data(), in.y.data(), in.z.data(), in.w.data() };
+  float* const o[4] = { out.x.data(), out.y.data(), out.z.data(), out.w.data() };
+  TransformToScreen(mvp, i, in.size(), viewport, o);
+}
+
+// Transforms the stream to the screen once for every listed instance, by the
+// view projection times the world matrix of the instance. Vertices of the n-th
+// listed instance start at n * in.size() in out.
+inline void TransformInstancesToScreen(const float4x4& viewProjection, const float4x4* world, const std::vector<uint32_t>& instances,
+  const VertexStream& in, const Viewport& viewport, VertexStream& out)
+{
+  const size_t count = in.size();
+  out.resize(count * instances.size());
+
+  const float* const i[4] = { in.x.data(), in.y.data(), in.z.data(), in.w.data() };
+
+  for (size_t n = 0; n < instances.size(); n++)
+  {
+    const size_t first = n * count;
+    float* const o[4] = { out.x.data() + first, out.y.data() + first, out.z.data() + first, out.w.data() + first };
+    TransformToScreen(viewProjection * world[instances[n]], i, count, viewport, o);
+  }
+}
+
+// Transforms the stream by mvp into clip space, without the perspective divide
+inline void TransformToClip(const float4x4& mvp, const VertexStream& in, VertexStream& out)
+{
+  const size_t count = in.size();
+  out.resize(count);
+
+  const float* ix = in.x.data(); const float* iy = in.y.data(); const float* iz = in.z.data(); const float* iw = in.w.data();
+  float* o[4] = { out.x.data(), out.y.data(), out.z.data(), out.w.data() };
+
+  size_t i = 0;
+
+#if defined(T_PGE_AVX2)
+  {
+    __m256 m[4][4];
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        m[r][c] = _mm256_set1_ps(mvp[r][c]);
+
+    for (; i + 8 <= count; i += 8)
+    {
+      const __m256 x = _mm256_loadu_ps(ix + i), y = _mm256_loadu_ps(iy + i), z = _mm256_loadu_ps(iz + i), w = _mm256_loadu_ps(iw + i);
+
+      for (int r = 0; r < 4; r++)
+        _mm256_storeu_ps(o[r] + i, _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[r][0], x), _mm256_mul_ps(m[r][1], y)), _mm256_mul_ps(m[r][2], z)), _mm256_mul_ps(m[r][3], w)));
+    }
+  }
+#endif
+
+#if defined(T_PGE_SSE2)
+  {
+    __m128 m[4][4];
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        m[r][c] = _mm_set1_ps(mvp[r][c]);
+
+    for (; i + 4 <= count; i += 4)
+    {
+      const __m128 x = _mm_loadu_ps(ix + i), y = _mm_loadu_ps(iy + i), z = _mm_loadu_ps(iz + i), w = _mm_loadu_ps(iw + i);
+
+      for (int r = 0; r < 4; r++)
+        _mm_storeu_ps(o[r] + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], x), _mm_mul_ps(m[r][1], y)), _mm_mul_ps(m[r][2], z)), _mm_mul_ps(m[r][3], w)));
+    }
+  }
+#endif
+
+  // Remaining vertices
+  for (; i < count; i++)
+    out.set(i, mvp * float4{ ix[i], iy[i], iz[i], iw[i] });
+}
+
+// Perspective divide and viewport mapping of a single clip space vertex
+inline float4 ToScreen(const float4& clip, const Viewport& viewport)
+{
+  return
+  {
+    (clip.x / clip.w + 1.0f) * ((viewport.width - 1) * 0.5f) + viewport.x,
+    (1.0f - clip.y / clip.w) * ((viewport.height - 1) * 0.5f) + viewport.y,
+    clip.z / clip.w,
+    1.0f / clip.w,
+  };
+}
+
+// Clips the clip space segment a-b against the view frustum, -w <= x,y <= w
+// and 0 <= z <= w. Returns false if nothing of it is visible.
+inline bool ClipLine(float4& a, float4& b)
+{
+  // Signed distances to the six planes, positive inside
+  const float da[6] = { a.w + a.x, a.w - a.x, a.w + a.y, a.w - a.y, a.z, a.w - a.z };
+  const float db[6] = { b.w + b.x, b.w - b.x, b.w + b.y, b.w - b.y, b.z, b.w - b.z };
+
+  float t0 = 0.0f;
+  float t1 = 1.0f;
+
+  for (int p = 0; p < 6; p++)
+  {
+    if (da[p] < 0.0f && db[p] < 0.0f)
+      return false;
+
+    if (da[p] < 0.0f)
+      t0 = std::max(t0, da[p] / (da[p] - db[p]));
+    else if (db[p] < 0.0f)
+      t1 = std::min(t1, da[p] / (da[p] - db[p]));
+  }
+
+  if (t0 > t1)
+    return false;
+
+  const float4 d = { b.x - a.x, b.y - a.y, b.z - a.z, b.w - a.w };
+  const float4 start = a;
+
+  if (t0 > 0.0f)
+    a = { start.x + t0 * d.x, start.y + t0 * d.y, start.z + t0 * d.z, start.w + t0 * d.w };
+  if (t1 < 1.0f)
+    b = { start.x + t1 * d.x, start.y + t1 * d.y, start.z + t1 * d.z, start.w + t1 * d.w };
+
+  return true;
+}
+
+// Clips the clip space triangle a-b-c against the view frustum like ClipLine.
+// Out receives the convex polygon that is left, the vertex count is returned.
+// The texture coordinates uv of the corners are interpolated into outUV.
+inline size_t ClipTriangle(const float4& a, const float4& b, const float4& c, const float2 uv[3], std::array<float4, 9>& out, std::array<float2, 9>& outUV)
+{
+  // Every plane adds at most one vertex
+  std::array<float4, 9> in;
+  std::array<float2, 9> inUV;
+  size_t count = 3;
+  out[0] = a; out[1] = b; out[2] = c;
+  outUV[0] = uv[0]; outUV[1] = uv[1]; outUV[2] = uv[2];
+
+  auto distance = [](const float4& v, int p)
+  {
+    switch (p)
+    {
+    case 0: return v.w + v.x;
+    case 1: return v.w - v.x;
+    case 2: return v.w + v.y;
+    case 3: return v.w - v.y;
+    case 4: return v.z;
+    default: return v.w - v.z;
+    }
+  };
+
+  for (int p = 0; p < 6 && count > 0; p++)
+  {
+    in = out;
+    inUV = outUV;
+    size_t inCount = count;
+    count = 0;
+
+    for (size_t i = 0; i < inCount; i++)
+    {
+      const float4& u = in[i];
+      const float4& v = in[(i + 1) % inCount];
+      float du = distance(u, p);
+      float dv = distance(v, p);
+
+      const float2& uvU = inUV[i];
+      const float2& uvV = inUV[(i + 1) % inCount];
+
+      if (du >= 0.0f)
+      {
+        outUV[count] = uvU;
+        out[count++] = u;
+      }
+
+      // Edge crosses the plane
+      if ((du >= 0.0f) != (dv >= 0.0f))
+      {
+        float t = du / (du - dv);
+        outUV[count] = { uvU.x + t * (uvV.x - uvU.x), uvU.y + t * (uvV.y - uvU.y) };
+        out[count++] = { u.x + t * (v.x - u.x), u.y + t * (v.y - u.y), u.z + t * (v.z - u.z), u.w + t * (v.w - u.w) };
+      }
+    }
+  }
+
+  return count;
+}
+
+// View frustum as six planes (normal in xyz, distance in w), normals point inside
+struct Frustum
+{
+  std::array<float4, 6> planes;
+};
+
+enum class Visibility { Outside, Intersecting, Inside };
+
+// Extracts the world space frustum planes from projection * view
+inline Frustum ExtractFrustum(const float4x4& viewProjection)
+{
+  const float4x4& m = viewProjection;
+  auto row = [&](int r) { return float4{ m[r][0], m[r][1], m[r][2], m[r][3] }; };
+  auto add = [](const float4& a, const float4& b) { return float4{ a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w }; };
+  auto sub = [](const float4& a, const float4& b) { return float4{ a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w }; };
+
+  Frustum frustum =
+  {{{
+    add(row(3), row(0)), // left
+    sub(row(3), row(0)), // right
+    add(row(3), row(1)), // bottom
+    sub(row(3), row(1)), // top
+    row(2),              // near, z in clip space starts at 0
+    sub(row(3), row(2)), // far
+  }}};
+
+  for (auto& plane : frustum.planes)
+  {
+    float length = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+    plane = { plane.x / length, plane.y / length, plane.z / length, plane.w / length };
+  }
+
+  return frustum;
+}
+
+inline Visibility TestSphere(const Frustum& frustum, const float3& center, float radius)
+{
+  Visibility result = Visibility::Inside;
+
+  for (const auto& plane : frustum.planes)
+  {
+    float distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+
+    if (distance < -radius)
+      return Visibility::Outside;
+    if (distance < radius)
+      result = Visibility::Intersecting;
+  }
+
+  return result;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "engine/tPixelGameEngine.h"
+#include "src/math.h"
+
+// Instances of a mesh stored as structure of arrays. Position, orientation and
+// scale are relative to the parent, a parent always comes before its children.
+struct Scene
+{
+  std::vector<float> x, y, z;
+  // Orientation as unit quaternion
+  std::vector<float> qx, qy, qz, qw;
+  // Uniform, so normals stay perpendicular to the faces
+  std::vector<float> scale;
+  // Turning speed around the own y axis, radians per second
+  std::vector<float> spin;
+  // -1 for instances without parent
+  std::vector<int32_t> parent;
+
+  // Object to world matrix of every instance, filled by UpdateScene
+  AlignedVector<float4x4> world;
+
+  size_t size() const { return x.size(); }
+
+  void clear()
+  {
+    x.clear(); y.clear(); z.clear();
+    qx.clear(); qy.clear(); qz.clear(); qw.clear();
+    scale.clear();
+    spin.clear();
+    parent.clear();
+    world.clear();
+  }
+
+  // Returns the index of the new instance
+  size_t add(const float3& position, const float4& orientation, float s, float spinSpeed, int32_t parentIndex = -1)
+  {
+    assert(parentIndex < (int32_t)size());
+
+    x.push_back(position.x); y.push_back(position.y); z.push_back(position.z);
+    qx.push_back(orientation.x); qy.push_back(orientation.y); qz.push_back(orientation.z); qw.push_back(orientation.w);
+    scale.push_back(s);
+    spin.push_back(spinSpeed);
+    parent.push_back(parentIndex);
+    world.push_back(float4x4::identity());
+
+    return size() - 1;
+  }
+};
+
+// Unit quaternion of a rotation by angle radians around a unit axis
+inline float4 AxisAngle(const float3& axis, float angle)
+{
+  float s, c;
+  sinCos(angle * 0.5f, s, c);
+
+  return { axis.x * s, axis.y * s, axis.z * s, c };
+}
+
+// Turns every instance around its own y axis by its spin over the elapsed time
+inline void RotateInstancesY(Scene& scene, float elapsedTime)
+{
+  float* qx = scene.qx.data(); float* qy = scene.qy.data(); float* qz = scene.qz.data(); float* qw = scene.qw.data();
+  const float* spin = scene.spin.data();
+
+  // Half angles of a block of instances, their sines and cosines in one batch
+  constexpr size_t block = 256;
+  float halfAngle[block], sines[block], cosines[block];
+
+  for (size_t first = 0; first < scene.size(); first += block)
+  {
+    const size_t count = std::min(block, scene.size() - first);
+
+    for (size_t i = 0; i < count; i++)
+      halfAngle[i] = spin[first + i] * elapsedTime * 0.5f;
+
+    sinCos(halfAngle, count, sines, cosines);
+
+    // q * (0, s, 0, c), independent per instance so the compiler vectorizes it
+    for (size_t i = 0; i < count; i++)
+    {
+      const size_t k = first + i;
+      const float x = qx[k], y = qy[k], z = qz[k], w = qw[k];
+      const float s = sines[i], c = cosines[i];
+
+      qx[k] = x * c - z * s;
+      qy[k] = y * c + w * s;
+      qz[k] = z * c + x * s;
+      qw[k] = w * c - y * s;
+    }
+  }
+}
+
+// Computes the world matrices of all instances. Local matrices are built four
+// instances at a time, then children are multiplied by their parents in order.
+inline void UpdateScene(Scene& scene)
+{
+  const size_t count = scene.size();
+
+  const float* px = scene.x.data(); const float* py = scene.y.data(); const float* pz = scene.z.data();
+  const float* qx = scene.qx.data(); const float* qy = scene.qy.data(); const float* qz = scene.qz.data(); const float* qw = scene.qw.data();
+  const float* ps = scene.scale.data();
+  float4x4* world = scene.world.data();
+
+  size_t i = 0;
+
+#if defined(T_PGE_SSE2)
+  {
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+
+    for (; i + 4 <= count; i += 4)
+    {
+      const __m128 x = _mm_loadu_ps(qx + i), y = _mm_loadu_ps(qy + i), z = _mm_loadu_ps(qz + i), w = _mm_loadu_ps(qw + i);
+      const __m128 s = _mm_loadu_ps(ps + i);
+
+      const __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+      const __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+      const __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+      // Rotation scaled, one register per matrix element of the four instances
+      __m128 m00 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), s);
+      __m128 m01 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), s);
+      __m128 m02 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), s);
+      __m128 m03 = _mm_loadu_ps(px + i);
+
+      __m128 m10 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), s);
+      __m128 m11 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), s);
+      __m128 m12 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), s);
+      __m128 m13 = _mm_loadu_ps(py + i);
+
+      __m128 m20 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), s);
+      __m128 m21 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), s);
+      __m128 m22 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), s);
+      __m128 m23 = _mm_loadu_ps(pz + i);
+
+      // Transposed, each register becomes a row of one instance
+      _MM_TRANSPOSE4_PS(m00, m01, m02, m03);
+      _MM_TRANSPOSE4_PS(m10, m11, m12, m13);
+      _MM_TRANSPOSE4_PS(m20, m21, m22, m23);
+
+      const __m128 r0[4] = { m00, m01, m02, m03 };
+      const __m128 r1[4] = { m10, m11, m12, m13 };
+      const __m128 r2[4] = { m20, m21, m22, m23 };
+
+      for (int k = 0; k < 4; k++)
+      {
+        _mm_store_ps(world[i + k].m[0], r0[k]);
+        _mm_store_ps(world[i + k].m[1], r1[k]);
+        _mm_store_ps(world[i + k].m[2], r2[k]);
+        _mm_store_ps(world[i + k].m[3], _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f));
+      }
+    }
+  }
+#endif
+
+  // Remaining instances
+  for (; i < count; i++)
+  {
+    const float x = qx[i], y = qy[i], z = qz[i], w = qw[i], s = ps[i];
+
+    world[i] =
+    {{
+      { (1 - 2 * (y * y + z * z)) * s, 2 * (x * y - w * z) * s      , 2 * (x * z + w * y) * s      , px[i] },
+      { 2 * (x * y + w * z) * s      , (1 - 2 * (x * x + z * z)) * s, 2 * (y * z - w * x) * s      , py[i] },
+      { 2 * (x * z - w * y) * s      , 2 * (y * z + w * x) * s      , (1 - 2 * (x * x + y * y)) * s, pz[i] },
+      { 0                            , 0                            , 0                            , 1     },
+    }};
+  }
+
+  // Parents come first, so their world matrix is final when a child reads it
+  const int32_t* parent = scene.parent.data();
+  for (i = 0; i < count; i++)
+    if (parent[i] >= 0)
+      world[i] = world[parent[i]] * world[i];
+}
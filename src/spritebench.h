@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "engine/tPixelGameEngine.h"
+#include "src/math.h"
+
+// Data cache of 32 KB with 64 byte lines, 8 ways and LRU replacement, like the
+// L1 of current x86 cores. Counts the misses of a sequence of reads, the same
+// on every machine, which hardware counters would not be.
+class CacheModel
+{
+public:
+  void clear()
+  {
+    for (auto& set : m_sets)
+      set.fill(~(uint64_t)0);
+    m_misses = 0;
+  }
+
+  void read(uint64_t address)
+  {
+    const uint64_t line = address >> 6;
+    auto& set = m_sets[line % m_sets.size()];
+
+    // Most recently used first
+    auto hit = std::find(set.begin(), set.end(), line);
+    if (hit == set.end())
+    {
+      m_misses++;
+      hit = set.end() - 1;
+    }
+
+    std::rotate(set.begin(), hit, hit + 1);
+    set[0] = line;
+  }
+
+  uint64_t misses() const { return m_misses; }
+
+private:
+  std::array<std::array<uint64_t, 8>, 64> m_sets;
+  uint64_t m_misses = 0;
+};
+
+// Draws a large sprite rotated into a smaller target by sampling it for every
+// target pixel, stored by rows and in tiles. Prints the time and the misses of
+// CacheModel per pixel, returns false if the two layouts draw different pixels.
+// Then times the samplers on the sprite shrunk and prints how far each is from
+// a supersampled reference. Last times DrawSprite of engine against drawing
+// the same sprite pixel by pixel, returns false if they differ, or if additive
+// premultiplied pixels blend differently in rows and one at a time.
+inline bool RunSpriteBenchmark(tDX::PixelGameEngine& engine)
+{
+  // 16 MB, far more than the caches hold. The target turned by 45 degrees
+  // still fits inside the source.
+  constexpr int32_t sourceSize = 2048;
+  constexpr int32_t targetSize = 1448;
+
+  tDX::Sprite source(sourceSize, sourceSize);
+  for (int32_t y = 0; y < sourceSize; y++)
+    for (int32_t x = 0; x < sourceSize; x++)
+      source.SetPixel(x, y, tDX::Pixel((uint8_t)(x * 7 + y), (uint8_t)(x ^ y), (uint8_t)(y * 3 - x)));
+
+  std::vector<tDX::Pixel> target(targetSize * targetSize), reference(targetSize * targetSize);
+
+  // Target pixel (i, j) shows the source around its centre at an angle and
+  // scale, scale below 1 magnifies
+  auto draw = [&](float angle, float scale, bool bilinear)
+  {
+    float s, c;
+    sinCos(angle, s, c);
+    s *= scale; c *= scale;
+
+    const float centre = sourceSize * 0.5f;
+    for (int32_t j = 0; j < targetSize; j++)
+      for (int32_t i = 0; i < targetSize; i++)
+      {
+        const float dx = (float)(i - targetSize / 2), dy = (float)(j - targetSize / 2);
+        const float u = centre + dx * c - dy * s;
+        const float v = centre + dx * s + dy * c;
+
+        target[j * targetSize + i] = bilinear ?
+          source.SampleBL(u / sourceSize, v / sourceSize) :
+          source.GetPixel((int32_t)std::floor(u), (int32_t)std::floor(v));
+      }
+  };
+
+  // Same walk as draw, only the nearest source pixel of each target pixel
+  CacheModel cache;
+  auto countMisses = [&](float angle, float scale)
+  {
+    float s, c;
+    sinCos(angle, s, c);
+    s *= scale; c *= scale;
+
+    cache.clear();
+    const float centre = sourceSize * 0.5f;
+    for (int32_t j = 0; j < targetSize; j++)
+      for (int32_t i = 0; i < targetSize; i++)
+      {
+        const float dx = (float)(i - targetSize / 2), dy = (float)(j - targetSize / 2);
+        const int32_t x = (int32_t)std::floor(centre + dx * c - dy * s);
+        const int32_t y = (int32_t)std::floor(centre + dx * s + dy * c);
+        cache.read(source.Offset(x, y) * sizeof(tDX::Pixel));
+      }
+
+    return (double)cache.misses() / (targetSize * targetSize);
+  };
+
+  // Nanoseconds per target pixel, the best of a few tries
+  auto time = [&](float angle, float scale, bool bilinear)
+  {
+    double best = 1e30;
+
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      draw(angle, scale, bilinear);
+      const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count() / (targetSize * targetSize));
+    }
+
+    return best;
+  };
+
+  struct Case { const char* name; float angle; float scale; bool bilinear; };
+  const Case cases[] =
+  {
+    { "0 deg", 0.0f, 1.0f, false },
+    { "30 deg", toRad(30.0f), 1.0f, false },
+    { "90 deg", toRad(90.0f), 1.0f, false },
+    { "90 deg, 2x magnified", toRad(90.0f), 0.5f, false },
+    { "30 deg, bilinear", toRad(30.0f), 1.0f, true },
+    { "90 deg, bilinear", toRad(90.0f), 1.0f, true },
+  };
+
+  bool ok = true;
+
+  std::printf("Rotated sprite draw, %dx%d of a %dx%d sprite\n", targetSize, targetSize, sourceSize, sourceSize);
+  std::printf("  %-24s %18s %18s\n", "", "rows: ns   misses", "tiles: ns   misses");
+
+  for (const Case& test : cases)
+  {
+    source.SetLayout(tDX::Sprite::Layout::ROW_MAJOR);
+    const double rowTime = time(test.angle, test.scale, test.bilinear);
+    const double rowMisses = countMisses(test.angle, test.scale);
+    reference = target;
+
+    source.SetLayout(tDX::Sprite::Layout::TILED);
+    const double tileTime = time(test.angle, test.scale, test.bilinear);
+    const double tileMisses = countMisses(test.angle, test.scale);
+
+    std::printf("  %-24s %9.2f %8.3f %10.2f %8.3f\n", test.name, rowTime, rowMisses, tileTime, tileMisses);
+
+    if (target != reference)
+    {
+      std::printf("  %s differs between the layouts\n", test.name);
+      ok = false;
+    }
+  }
+
+  // Shrunk three times, SampleBL per pixel against rows of SampleBatch. The error
+  // is the mean difference per channel from the average of 8x8 bilinear samples
+  // spread over each target pixel, aliasing makes it large.
+  constexpr int32_t smallSize = 256;
+  constexpr float shrink = 3.0f;
+  source.SetLayout(tDX::Sprite::Layout::ROW_MAJOR);
+  source.GenerateMipmaps();
+
+  std::vector<tDX::Pixel> small(smallSize * smallSize), truth(smallSize * smallSize);
+  std::vector<float> us(smallSize * 64), vs(smallSize * 64);
+  std::vector<tDX::Pixel> subsamples(smallSize * 64);
+
+  // Source coordinates in 0..1 of the target row j, sub x sub samples per pixel
+  auto coordinates = [&](int32_t j, int32_t sub)
+  {
+    float s, c;
+    sinCos(toRad(30.0f), s, c);
+    s *= shrink; c *= shrink;
+
+    const float centre = sourceSize * 0.5f;
+    for (int32_t i = 0; i < smallSize; i++)
+      for (int32_t k = 0; k < sub * sub; k++)
+      {
+        const float dx = (float)(i - smallSize / 2) + ((float)(k % sub) + 0.5f) / sub - 0.5f;
+        const float dy = (float)(j - smallSize / 2) + ((float)(k / sub) + 0.5f) / sub - 0.5f;
+        us[i * sub * sub + k] = (centre + dx * c - dy * s) / sourceSize;
+        vs[i * sub * sub + k] = (centre + dx * s + dy * c) / sourceSize;
+      }
+  };
+
+  for (int32_t j = 0; j < smallSize; j++)
+  {
+    coordinates(j, 8);
+    source.SampleBatch(us.data(), vs.data(), smallSize * 64, subsamples.data());
+
+    for (int32_t i = 0; i < smallSize; i++)
+    {
+      uint32_t r = 0, g = 0, b = 0;
+      for (int32_t k = 0; k < 64; k++)
+      {
+        r += subsamples[i * 64 + k].r; g += subsamples[i * 64 + k].g; b += subsamples[i * 64 + k].b;
+      }
+      truth[j * smallSize + i] = tDX::Pixel((uint8_t)(r / 64), (uint8_t)(g / 64), (uint8_t)(b / 64));
+    }
+  }
+
+  auto error = [&]()
+  {
+    double sum = 0.0;
+    for (size_t i = 0; i < small.size(); i++)
+      sum += std::abs(small[i].r - truth[i].r) + std::abs(small[i].g - truth[i].g) + std::abs(small[i].b - truth[i].b);
+    return sum / (small.size() * 3);
+  };
+
+  auto timeSmall = [&](auto drawRow)
+  {
+    double best = 1e30;
+
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      for (int32_t j = 0; j < smallSize; j++)
+        drawRow(j);
+      const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count() / (smallSize * smallSize));
+    }
+
+    return best;
+  };
+
+  std::printf("Sprite shrunk %gx at 30 deg, %dx%d\n", shrink, smallSize, smallSize);
+  std::printf("  %-24s %9s %9s\n", "", "ns", "error");
+
+  // SampleBL is timed with the same coordinates, computed outside the timing
+  std::vector<float> rowU(smallSize * smallSize), rowV(smallSize * smallSize);
+  for (int32_t j = 0; j < smallSize; j++)
+  {
+    coordinates(j, 1);
+    std::copy_n(us.data(), smallSize, rowU.data() + j * smallSize);
+    std::copy_n(vs.data(), smallSize, rowV.data() + j * smallSize);
+  }
+
+  const float lod = std::log2(shrink);
+  const struct { const char* name; tDX::Sprite::Filter filter; float lod; bool batch; } samplers[] =
+  {
+    { "SampleBL", tDX::Sprite::Filter::BILINEAR, 0.0f, false },
+    { "SampleBatch nearest", tDX::Sprite::Filter::NEAREST, 0.0f, true },
+    { "SampleBatch bilinear", tDX::Sprite::Filter::BILINEAR, 0.0f, true },
+    { "SampleBatch mip bilinear", tDX::Sprite::Filter::BILINEAR, lod, true },
+    { "SampleBatch trilinear", tDX::Sprite::Filter::TRILINEAR, lod, true },
+  };
+
+  for (const auto& sampler : samplers)
+  {
+    const double ns = timeSmall([&](int32_t j)
+    {
+      const float* u = rowU.data() + j * smallSize;
+      const float* v = rowV.data() + j * smallSize;
+      tDX::Pixel* row = small.data() + j * smallSize;
+
+      if (sampler.batch)
+        source.SampleBatch(u, v, smallSize, row, sampler.filter, sampler.lod);
+      else
+        for (int32_t i = 0; i < smallSize; i++)
+          row[i] = source.SampleBL(u[i], v[i]);
+    });
+
+    std::printf("  %-24s %9.2f %9.2f\n", sampler.name, ns, error());
+  }
+
+  // A quarter of every copy falls outside the target and is clipped. Half of
+  // the sprite's pixels are transparent, the rest opaque or half covering.
+  constexpr int32_t blitSize = 256;
+  tDX::Sprite sprite(blitSize, blitSize), blitTarget(768, 768), pixelTarget(768, 768);
+  for (int32_t y = 0; y < blitSize; y++)
+    for (int32_t x = 0; x < blitSize; x++)
+      sprite.SetPixel(x, y, tDX::Pixel((uint8_t)(x * 3), (uint8_t)y, (uint8_t)(x + y), (x ^ y) & 16 ? 0 : (y & 32 ? 128 : 255)));
+
+  std::printf("DrawSprite of %dx%d, pixel by pixel and in rows\n", blitSize, blitSize);
+  std::printf("  %-24s %9s %9s\n", "", "pixels ns", "rows ns");
+
+  const struct { const char* name; tDX::Pixel::Mode mode; uint32_t scale; } blits[] =
+  {
+    { "NORMAL", tDX::Pixel::NORMAL, 1 },
+    { "MASK", tDX::Pixel::MASK, 1 },
+    { "ALPHA", tDX::Pixel::ALPHA, 1 },
+    { "NORMAL, 2x", tDX::Pixel::NORMAL, 2 },
+    { "ALPHA, 2x", tDX::Pixel::ALPHA, 2 },
+  };
+
+  for (const auto& blit : blits)
+  {
+    const int32_t size = blitSize * (int32_t)blit.scale;
+    const int32_t positions[][2] = { { -size / 4, -size / 4 }, { 768 - size * 3 / 4, 100 }, { 200, 768 - size * 3 / 4 } };
+
+    // Nanoseconds per drawn pixel, clipped ones included
+    auto timeBlit = [&](tDX::Sprite& blitInto, bool perPixel)
+    {
+      tDX::Sprite* previousTarget = engine.GetDrawTarget();
+      engine.SetDrawTarget(&blitInto);
+      double best = 1e30;
+
+      for (int attempt = 0; attempt < 5; attempt++)
+      {
+        engine.SetPixelMode(tDX::Pixel::NORMAL);
+        engine.Clear(tDX::Pixel(40, 80, 120));
+        engine.SetPixelMode(blit.mode);
+
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& position : positions)
+          if (perPixel)
+          {
+            for (int32_t j = 0; j < size; j++)
+              for (int32_t i = 0; i < size; i++)
+                engine.Draw(position[0] + i, position[1] + j, sprite.GetPixel(i / (int32_t)blit.scale, j / (int32_t)blit.scale));
+          }
+          else
+            engine.DrawSprite(position[0], position[1], &sprite, blit.scale);
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count() / (3.0 * size * size));
+      }
+
+      engine.SetPixelMode(tDX::Pixel::NORMAL);
+      engine.SetDrawTarget(previousTarget);
+      return best;
+    };
+
+    const double pixelTime = timeBlit(pixelTarget, true);
+    const double rowTime = timeBlit(blitTarget, false);
+    std::printf("  %-24s %9.2f %9.2f\n", blit.name, pixelTime, rowTime);
+
+    if (!std::equal(blitTarget.GetData(), blitTarget.GetData() + 768 * 768, pixelTarget.GetData()))
+    {
+      std::printf("  DrawSprite %s differs from drawing pixel by pixel\n", blit.name);
+      ok = false;
+    }
+  }
+
+  // Premultiplied pixels brighter than their alpha add light and must saturate.
+  // The whole sprite goes through the SIMD rows, drawn one column at a time it
+  // goes through the scalar tail, both have to give the same pixels.
+  tDX::Sprite additive(61, 16), wholeTarget(64, 16), columnTarget(64, 16);
+  additive.PremultiplyAlpha();
+  for (int32_t y = 0; y < additive.height; y++)
+    for (int32_t x = 0; x < additive.width; x++)
+      additive.SetPixel(x, y, tDX::Pixel((uint8_t)(x * 4), (uint8_t)(y * 16), 200, (uint8_t)(x * y & 7 ? x * y * 5 : 0)));
+
+  for (const float blend : { 1.0f, 0.6f })
+  {
+    tDX::Sprite* previousTarget = engine.GetDrawTarget();
+    for (tDX::Sprite* target : { &wholeTarget, &columnTarget })
+    {
+      for (int32_t y = 0; y < target->height; y++)
+        for (int32_t x = 0; x < target->width; x++)
+          target->SetPixel(x, y, tDX::Pixel((uint8_t)(255 - x), (uint8_t)(y * 8), 240));
+      target->MarkDirty(0, 0, target->width, target->height);
+
+      engine.SetDrawTarget(target);
+      engine.SetPixelMode(tDX::Pixel::ALPHA);
+      engine.SetPixelBlend(blend);
+      if (target == &wholeTarget)
+        engine.DrawSprite(1, 0, &additive);
+      else
+        for (int32_t x = 0; x < additive.width; x++)
+          engine.DrawPartialSprite(1 + x, 0, &additive, x, 0, 1, additive.height);
+    }
+    engine.SetPixelBlend(1.0f);
+    engine.SetPixelMode(tDX::Pixel::NORMAL);
+    engine.SetDrawTarget(previousTarget);
+
+    if (!std::equal(wholeTarget.GetData(), wholeTarget.GetData() + 64 * 16, columnTarget.GetData()))
+    {
+      std::printf("  Premultiplied rows differ from single pixels, blend %.1f\n", blend);
+      ok = false;
+    }
+  }
+
+  std::printf(ok ? "All results match\n" : "Some results do not match\n");
+
+  return ok;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+#include "src/math.h"
+
+// A matrix computed from values and from other nodes. It is recomputed only
+// when it is read after invalidate was called on it or on one of its inputs.
+class TransformNode
+{
+public:
+  // Recomputations in the current frame, the most in any finished frame and in total
+  struct Counters
+  {
+    uint32_t frame = 0;
+    uint32_t maxFrame = 0;
+    uint64_t total = 0;
+  };
+
+  TransformNode(const char* name, std::function<float4x4()> compute, std::initializer_list<TransformNode*> inputs = {})
+    : m_name(name), m_compute(std::move(compute))
+  {
+    for (TransformNode* input : inputs)
+      input->m_dependents.push_back(this);
+  }
+
+  // Inputs keep pointers to the nodes computed from them
+  TransformNode(const TransformNode&) = delete;
+  TransformNode& operator=(const TransformNode&) = delete;
+
+  // Marks this node and every node computed from it, directly or not
+  void invalidate()
+  {
+    // Nodes computed from a dirty node are dirty already, they read it when computed
+    if (m_dirty)
+      return;
+
+    m_dirty = true;
+    for (TransformNode* dependent : m_dependents)
+      dependent->invalidate();
+  }
+
+  const float4x4& get()
+  {
+    if (m_dirty)
+    {
+      m_matrix = m_compute();
+      m_dirty = false;
+      m_counters.frame++;
+      m_counters.total++;
+    }
+
+    return m_matrix;
+  }
+
+  const char* name() const { return m_name; }
+  const Counters& counters() const { return m_counters; }
+
+  void endFrame()
+  {
+    m_counters.maxFrame = std::max(m_counters.maxFrame, m_counters.frame);
+    m_counters.frame = 0;
+  }
+
+private:
+  const char* m_name;
+  std::function<float4x4()> m_compute;
+  std::vector<TransformNode*> m_dependents;
+  float4x4 m_matrix = {};
+  bool m_dirty = true;
+  Counters m_counters;
+};